@@ -1,4 +1,5 @@
 #include "binfuse/sharded_filter.hpp"
+#include <algorithm>
 #include <chrono>
 #include <concepts>
 #include <cstddef>
@@ -10,6 +11,11 @@
 #include <stdexcept>
 #include <vector>
 
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using clk = std::chrono::high_resolution_clock;
 
 std::vector<std::uint64_t> gen_shard(std::uint64_t prefix, std::uint8_t shard_bits,
@@ -57,8 +63,9 @@ void populate(T& filter, std::uint32_t shards, std::uint8_t shard_bits, std::siz
     popluate_filter_total += clk::now() - start;
 
     start = clk::now();
-    if (!shard.verify(shard_keys)) {
-      throw std::runtime_error("verify failed!!");
+    if (const auto res = shard.verify(shard_keys, {}); !res) {
+      throw std::runtime_error("verify failed!! " + std::to_string(res.false_negatives) +
+                               " false negatives");
     }
     verify_filter_total += clk::now() - start;
 
@@ -94,15 +101,94 @@ void query(const T& filter, std::size_t size) {
     found_count += filter.contains(key);
   }
   auto end = clk::now();
-  std::cout << std::format(" {:8.1f}ns  {:.6f}%\n", dratio(end - start, iterations),
+
+  // compiled view: no branches on shard populated-ness
+  const auto  view       = filter.compile();
+  auto        view_start = clk::now();
+  std::size_t view_count = 0;
+  for (auto key: random_keys) {
+    view_count += view.contains(key);
+  }
+  auto view_end = clk::now();
+  if (view_count != found_count) {
+    throw std::runtime_error("compiled view disagrees with contains!!");
+  }
+
+  // batched queries overlap the cache misses of many keys
+  std::vector<std::uint8_t> found(iterations);
+  auto                      batch_start = clk::now();
+  filter.contains_many(random_keys, found);
+  auto batch_end = clk::now();
+  if (std::count(found.begin(), found.end(), 1) != static_cast<std::ptrdiff_t>(found_count)) {
+    throw std::runtime_error("contains_many disagrees with contains!!");
+  }
+
+  // partitioned by shard, so each shard's pages are hot while queried
+  auto part_start = clk::now();
+  filter.contains_partitioned(random_keys, found);
+  auto part_end = clk::now();
+  if (std::count(found.begin(), found.end(), 1) != static_cast<std::ptrdiff_t>(found_count)) {
+    throw std::runtime_error("contains_partitioned disagrees with contains!!");
+  }
+
+  std::cout << std::format(" {:8.1f}ns {:8.1f}ns {:8.1f}ns {:8.1f}ns  {:.6f}%\n",
+                           dratio(end - start, iterations),
+                           dratio(view_end - view_start, iterations),
+                           dratio(batch_end - batch_start, iterations),
+                           dratio(part_end - part_start, iterations),
                            100 * ratio(found_count, iterations));
 }
 
+// best effort "cold start": ask the OS to drop the file's cached pages
+void drop_page_cache([[maybe_unused]] const std::filesystem::path& path) {
+#if defined(__unix__)
+  const int fd = ::open(path.c_str(), O_RDONLY); // NOLINT vararg
+  if (fd >= 0) {
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+  }
+#endif
+}
+
+// time until all pages are resident: prefaulted raw mmap vs unpacking
+// the packed copy into anonymous huge pages
+template <typename T>
+void load(const std::filesystem::path& path, std::uint8_t shard_bits) {
+  const std::filesystem::path packed_path = path.string() + "z";
+  T(path, shard_bits).save_packed(packed_path);
+
+  drop_page_cache(path);
+  auto start = clk::now();
+  {
+    const T source(path, shard_bits, binfuse::load_mode::eager, {.prefault = true});
+  }
+  auto raw_time = clk::now() - start;
+
+  drop_page_cache(packed_path);
+  start = clk::now();
+  {
+    const T source(packed_path, shard_bits, binfuse::load_mode::eager, {.huge_pages = true});
+  }
+  auto packed_time = clk::now() - start;
+
+  using millis = std::chrono::duration<double, std::milli>;
+  std::cout << std::format("load f{:<2d} raw+prefault {:8.1f}ms {:6.1f}MB  packed {:8.1f}ms "
+                           "{:6.1f}MB\n",
+                           T::nbits, millis(raw_time).count(),
+                           ratio(std::filesystem::file_size(path), 1'000'000),
+                           millis(packed_time).count(),
+                           ratio(std::filesystem::file_size(packed_path), 1'000'000));
+  std::filesystem::remove(packed_path);
+}
+
 int main() {
 
   try {
     constexpr std::size_t size = 10'000'000;
 
+    constexpr binfuse::map_options pinned_huge_pages{
+        .random_access = true, .huge_pages = true, .lock = true, .anonymous_copy = true};
+
     for (std::uint8_t shard_bits = 1; shard_bits <= 8; ++shard_bits) {
 
       const std::uint32_t shards     = 1U << shard_bits;
@@ -111,8 +197,9 @@ int main() {
       std::cout << std::format("\n\nShard Size: {}  Shards: {}  Keys: {}\n\n", shard_size, shards,
                                size);
 
-      std::cout << std::format("      {:>8s}   {:>8s}   {:>8s}   {:>8s}   {:>8s}   {:>8s}\n", "gen",
-                               "populate", "verify", "add", "query", "f+ve");
+      std::cout << std::format(
+          "      {:>8s}   {:>8s}   {:>8s}   {:>8s}   {:>8s}   {:>8s}   {:>8s}   {:>8s}   {:>8s}\n",
+          "gen", "populate", "verify", "add", "query", "view", "batch", "part", "f+ve");
 
       {
         binfuse::sharded_filter8_sink sink8("filter8.bin", shard_bits);
@@ -122,6 +209,13 @@ int main() {
         binfuse::sharded_filter8_source source8("filter8.bin", shard_bits);
         query(source8, size);
       }
+      {
+        // "h8" row: queries against a pinned anonymous huge page copy
+        binfuse::sharded_filter8_source source8("filter8.bin", shard_bits,
+                                                binfuse::load_mode::eager, pinned_huge_pages);
+        std::cout << std::format("h8 {:44s}", "");
+        query(source8, size);
+      }
       {
         binfuse::sharded_filter16_sink sink16("filter16.bin", shard_bits);
         populate(sink16, shards, shard_bits, shard_size);
@@ -130,6 +224,14 @@ int main() {
         binfuse::sharded_filter16_source source16("filter16.bin", shard_bits);
         query(source16, size);
       }
+      {
+        binfuse::sharded_filter16_source source16("filter16.bin", shard_bits,
+                                                  binfuse::load_mode::eager, pinned_huge_pages);
+        std::cout << std::format("h16{:44s}", "");
+        query(source16, size);
+      }
+      load<binfuse::sharded_filter8_source>("filter8.bin", shard_bits);
+      load<binfuse::sharded_filter16_source>("filter16.bin", shard_bits);
       std::filesystem::remove("filter8.bin");
       std::filesystem::remove("filter16.bin");
     }
@@ -0,0 +1,124 @@
+// Per socket query latency of a `sharded_filter` source, with one
+// shared mapping of the file, and with a node local replica per NUMA
+// node (`binfuse::numa_replicated`).
+//
+//   binfuse_bench_numa [keys=50M] [queries=2M] [shard_bits=8] [dir=.]
+//
+// The shared mapping is faulted in by a thread on node 0, as a server
+// which loads its filter on start up would typically do. Then, for
+// each node in turn, a thread pinned to that node runs a chain of
+// dependent queries (each key depends on the previous result), so
+// that each query's latency, including its remote memory fetches, is
+// exposed rather than overlapped. On a single node machine both rows
+// are the same.
+
+#include "binfuse/numa.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using clk    = std::chrono::steady_clock;
+using source = binfuse::sharded_filter8_source;
+
+namespace {
+
+std::vector<std::uint64_t> sorted_keys(std::size_t count) {
+  std::mt19937_64            gen{42}; // NOLINT fixed seed
+  std::vector<std::uint64_t> keys(count);
+  for (auto& key: keys) key = gen();
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+// ns per query of a dependent chain of `queries`, half of them hits
+double chained_latency(const source& filter, const std::vector<std::uint64_t>& keys,
+                       std::size_t queries) {
+  std::mt19937_64 gen{7}; // NOLINT fixed seed
+  std::size_t     found = 0;
+  const auto      start = clk::now();
+  for (std::size_t i = 0; i != queries; ++i) {
+    const auto rnd    = gen() + found; // depends on the previous result
+    const auto needle = (rnd & 1U) != 0 ? keys[rnd % keys.size()] : rnd;
+    found += filter.contains(needle) ? 1U : 0U;
+  }
+  const std::chrono::duration<double, std::nano> elapsed = clk::now() - start;
+  if (found < queries / 4) throw std::runtime_error("too few hits: broken filter?");
+  return elapsed.count() / static_cast<double>(queries);
+}
+
+// runs `fn` on a fresh thread pinned to `node`
+template <typename Func>
+auto on_node(const binfuse::numa_topology& topology, std::size_t node, const Func& fn) {
+  decltype(fn()) result{};
+  std::thread    thread([&] {
+    topology.pin_to_node(node);
+    result = fn();
+  });
+  thread.join();
+  return result;
+}
+
+std::size_t arg(int argc, char** argv, int index, std::size_t fallback) {
+  return argc > index ? std::stoul(argv[index]) : fallback; // NOLINT pointer arithmetic
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  try {
+    const auto keys_count = arg(argc, argv, 1, 50'000'000);
+    const auto queries    = arg(argc, argv, 2, 2'000'000);
+    const auto shard_bits = static_cast<std::uint8_t>(arg(argc, argv, 3, 8));
+    const auto dir        = std::filesystem::path(argc > 4 ? argv[4] : "."); // NOLINT
+    const auto path       = dir / "numa_bench.bin";
+
+    const auto topology = binfuse::numa_topology::detect();
+    std::cout << std::format("{} NUMA node(s), {} keys, {} dependent queries per node\n",
+                             topology.nodes(), keys_count, queries);
+
+    const auto keys = sorted_keys(keys_count);
+    {
+      binfuse::sharded_filter8_sink sink(path, shard_bits);
+      sink.add_sorted(keys);
+    }
+
+    const auto shared = on_node(topology, 0, [&] {
+      return std::make_shared<source>(path, shard_bits, binfuse::load_mode::eager,
+                                      binfuse::map_options{.prefault = true});
+    });
+    const binfuse::numa_replicated<source> replicated(
+        [&] {
+          return std::make_unique<source>(path, shard_bits, binfuse::load_mode::eager,
+                                          binfuse::map_options{.anonymous_copy = true});
+        },
+        topology);
+
+    std::cout << std::format("{:>6s} {:>14s} {:>14s}\n", "node", "shared ns/q", "local ns/q");
+    for (std::size_t node = 0; node != topology.nodes(); ++node) {
+      const auto remote = on_node(topology, node, [&] {
+        return chained_latency(*shared, keys, queries);
+      });
+      const auto local = on_node(topology, node, [&] {
+        return chained_latency(replicated.local(), keys, queries);
+      });
+      std::cout << std::format("{:>6d} {:>14.1f} {:>14.1f}\n", node, remote, local);
+    }
+    std::filesystem::remove(path);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,792 @@
+// Parameterized benchmark suite, writing Google Benchmark compatible
+// JSON, so results can be compared across releases with the usual
+// tooling (eg benchmark's tools/compare.py).
+//
+// Every combination of the comma separated lists below is run. One
+// filter file is built for each (keys, dist, fp, layout, shard_bits)
+// and is then queried with each (hit, zipf, mode, threads, cache)
+// combination.
+//
+//   --keys=1M,10M          keys in the filter, K/M/G suffixes allowed
+//   --dist=uniform,dense   uniform random keys, or 16 dense runs of ids
+//   --layout=flat,adaptive a `sharded_filter`, or an
+//                          `adaptive_sharded_filter`, whose build needs
+//                          all the keys in memory
+//   --shard-bits=1,4,8,16  1..16, flat layout only
+//   --fp=8,16              fingerprint bits
+//   --hit=0,0.5,1          fraction of queries for keys in the filter
+//   --zipf=0,0.99          query skew, 0 is uniform
+//   --mode=single,batch    one contains() per query, or contains_many
+//   --batch=1024           keys per contains_many call
+//   --threads=1,2,4        query threads, each with its own queries
+//   --cache=warm,cold      cold drops the file's cached pages first
+//   --drop-caches          for cold runs, also drop the whole kernel page
+//                          cache (needs root), rather than just the file's
+//   --queries=1M           queries per thread
+//   --dir=.                where filter files are built
+//   --out=-                JSON to this file, or stdout; the console
+//                          table always goes to stderr
+//
+// Latencies are recorded, per query (single) or per batch divided by
+// its size (batch), in a log-linear histogram with ~3% resolution. The
+// measured overhead of reading the clock is subtracted and reported in
+// the context. Throughput (`real_time`) comes from a separate untimed
+// pass, so it does not include the timing overhead.
+
+#include "binfuse/adaptive.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <latch>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+using clk = std::chrono::steady_clock;
+
+// parameters
+
+struct options {
+  std::vector<std::uint64_t> keys       = {1'000'000, 10'000'000};
+  std::vector<std::string>   dist       = {"uniform"};
+  std::vector<std::string>   layout     = {"flat"};
+  std::vector<std::uint64_t> shard_bits = {1, 4, 8, 12, 16};
+  std::vector<std::uint64_t> fp         = {8, 16};
+  std::vector<double>        hit        = {0.0, 0.5, 1.0};
+  std::vector<double>        zipf       = {0.0, 0.99};
+  std::vector<std::string>   mode       = {"single", "batch"};
+  std::vector<std::uint64_t> threads;
+  std::vector<std::string>   cache       = {"warm", "cold"};
+  std::uint64_t              batch       = 1024;
+  std::uint64_t              queries     = 1'000'000;
+  bool                       drop_caches = false;
+  std::filesystem::path      dir         = ".";
+  std::string                out         = "-";
+};
+
+std::vector<std::string> split(std::string_view list) {
+  std::vector<std::string> items;
+  while (!list.empty()) {
+    const auto comma = list.find(',');
+    items.emplace_back(list.substr(0, comma));
+    list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+  }
+  return items;
+}
+
+std::uint64_t parse_count(const std::string& item) {
+  std::size_t         end   = 0;
+  const std::uint64_t value = std::stoull(item, &end);
+  const auto          unit  = item.substr(end);
+  if (unit.empty()) return value;
+  if (unit == "K" || unit == "k") return value * 1'000;
+  if (unit == "M" || unit == "m") return value * 1'000'000;
+  if (unit == "G" || unit == "g" || unit == "B") return value * 1'000'000'000;
+  throw std::runtime_error("bad count: " + item);
+}
+
+std::vector<std::uint64_t> parse_counts(std::string_view list) {
+  std::vector<std::uint64_t> counts;
+  for (const auto& item: split(list)) counts.push_back(parse_count(item));
+  return counts;
+}
+
+std::vector<double> parse_doubles(std::string_view list) {
+  std::vector<double> values;
+  for (const auto& item: split(list)) values.push_back(std::stod(item));
+  return values;
+}
+
+options parse_options(std::span<char*> args) {
+  options opts;
+  for (std::string_view arg: args) {
+    const auto eq    = arg.find('=');
+    const auto name  = arg.substr(0, eq);
+    const auto value = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+    if (name == "--keys") {
+      opts.keys = parse_counts(value);
+    } else if (name == "--dist") {
+      opts.dist = split(value);
+    } else if (name == "--layout") {
+      opts.layout = split(value);
+    } else if (name == "--shard-bits") {
+      opts.shard_bits = parse_counts(value);
+    } else if (name == "--fp") {
+      opts.fp = parse_counts(value);
+    } else if (name == "--hit") {
+      opts.hit = parse_doubles(value);
+    } else if (name == "--zipf") {
+      opts.zipf = parse_doubles(value);
+    } else if (name == "--mode") {
+      opts.mode = split(value);
+    } else if (name == "--threads") {
+      opts.threads = parse_counts(value);
+    } else if (name == "--cache") {
+      opts.cache = split(value);
+    } else if (name == "--batch") {
+      opts.batch = parse_count(std::string(value));
+    } else if (name == "--queries") {
+      opts.queries = parse_count(std::string(value));
+    } else if (name == "--drop-caches") {
+      opts.drop_caches = true;
+    } else if (name == "--dir") {
+      opts.dir = value;
+    } else if (name == "--out") {
+      opts.out = value;
+    } else {
+      throw std::runtime_error("unknown option: " + std::string(arg));
+    }
+  }
+  if (opts.threads.empty()) {
+    const auto max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+    for (std::uint64_t t = 1; t < max_threads; t *= 2) opts.threads.push_back(t);
+    opts.threads.push_back(max_threads);
+  }
+  for (auto bits: opts.shard_bits) {
+    if (bits == 0 || bits > 16) throw std::runtime_error("shard_bits must be in range [1, 16]");
+  }
+  for (auto bits: opts.fp) {
+    if (bits != 8 && bits != 16) throw std::runtime_error("fp must be 8 or 16");
+  }
+  for (const auto& dist: opts.dist) {
+    if (dist != "uniform" && dist != "dense") throw std::runtime_error("bad dist: " + dist);
+  }
+  for (const auto& layout: opts.layout) {
+    if (layout != "flat" && layout != "adaptive") {
+      throw std::runtime_error("bad layout: " + layout);
+    }
+  }
+  for (const auto& mode: opts.mode) {
+    if (mode != "single" && mode != "batch") throw std::runtime_error("bad mode: " + mode);
+  }
+  for (const auto& cache: opts.cache) {
+    if (cache != "warm" && cache != "cold") throw std::runtime_error("bad cache: " + cache);
+  }
+  if (opts.batch == 0 || opts.queries == 0) {
+    throw std::runtime_error("batch and queries must be > 0");
+  }
+  return opts;
+}
+
+// latency histogram, log-linear: exact below 2^sub_bits ns, above
+// that each power of 2 is split into 2^sub_bits buckets
+
+class latency_histogram {
+public:
+  void record(std::uint64_t nanos) {
+    ++counts_[index(nanos)];
+    ++total_;
+    max_ = std::max(max_, nanos);
+  }
+
+  void merge(const latency_histogram& other) {
+    for (std::size_t i = 0; i != counts_.size(); ++i) counts_[i] += other.counts_[i];
+    total_ += other.total_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  // bucket midpoint of the `q` quantile
+  [[nodiscard]] double percentile(double q) const {
+    const auto  rank = static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(total_)));
+    std::size_t seen = 0;
+    for (std::size_t i = 0; i != counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen != 0 && seen >= rank) return std::min(midpoint(i), static_cast<double>(max_));
+    }
+    return static_cast<double>(max_);
+  }
+
+  [[nodiscard]] std::uint64_t max() const { return max_; }
+
+private:
+  static constexpr unsigned    sub_bits = 5;
+  static constexpr std::size_t sub      = std::size_t{1} << sub_bits;
+
+  static std::size_t index(std::uint64_t nanos) {
+    if (nanos < 2 * sub) return nanos;
+    const auto shift = static_cast<unsigned>(std::bit_width(nanos)) - sub_bits - 1;
+    return shift * sub + (nanos >> shift);
+  }
+
+  static double midpoint(std::size_t idx) {
+    if (idx < 2 * sub) return static_cast<double>(idx);
+    const auto shift = idx / sub - 1;
+    const auto low   = (idx % sub + sub) << shift;
+    return static_cast<double>(low) + static_cast<double>((std::size_t{1} << shift) - 1) / 2;
+  }
+
+  std::array<std::uint64_t, 64 * sub> counts_{};
+  std::uint64_t                       total_ = 0;
+  std::uint64_t                       max_   = 0;
+};
+
+// smallest observed back to back clock reading difference
+std::uint64_t clock_overhead() {
+  std::uint64_t overhead = ~std::uint64_t{0};
+  for (int i = 0; i != 10'000; ++i) {
+    const auto start = clk::now();
+    const auto end   = clk::now();
+    overhead         = std::min(overhead, static_cast<std::uint64_t>((end - start).count()));
+  }
+  return overhead;
+}
+
+std::uint64_t elapsed_nanos(clk::time_point start, clk::time_point end, std::uint64_t overhead) {
+  const auto nanos = static_cast<std::uint64_t>(std::chrono::nanoseconds(end - start).count());
+  return nanos > overhead ? nanos - overhead : 0;
+}
+
+// page cache
+
+// best effort "cold start": write back and drop the file's cached
+// pages, and optionally the whole page cache, which needs root
+void drop_page_cache([[maybe_unused]] const std::filesystem::path& path, bool global) {
+#if defined(__unix__)
+  const int fd = ::open(path.c_str(), O_RDONLY); // NOLINT vararg
+  if (fd >= 0) {
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+  }
+  if (global) {
+    ::sync();
+    std::ofstream drop("/proc/sys/vm/drop_caches");
+    drop << "3\n";
+    if (!drop) std::cerr << "warning: cannot write /proc/sys/vm/drop_caches (not root?)\n";
+  }
+#else
+  (void)global;
+#endif
+}
+
+// keys and queries
+
+// sample of the filter's keys, from which hits are drawn
+constexpr std::size_t max_hit_sample = 1'000'000;
+
+// calls `add` with `count` distinct keys, in ascending order, and
+// returns an evenly spaced sample of them. Keys are generated already
+// sorted, so no buffer of them is needed, however many there are.
+//
+// uniform: exactly count / 2^shard_bits keys under each prefix, so flat
+// shards are balanced, drawn as successive uniform order statistics:
+// each is uniform in what is left above the previous one.
+// dense: 16 runs of ids, at random offsets, with gaps of 1 to 3, as
+// skewed as, eg, auto-increment row ids.
+template <typename Add>
+std::vector<std::uint64_t> generate(std::uint64_t count, const std::string& dist,
+                                    std::uint8_t shard_bits, const Add& add) {
+  std::mt19937_64     gen(42); // NOLINT fixed seed: reproducible files
+  const auto          stride = std::max<std::uint64_t>(1, count / max_hit_sample);
+  std::uint64_t       added  = 0;
+  std::vector<std::uint64_t> sample;
+  const auto                 emit = [&](std::uint64_t key) {
+    add(key);
+    if (added++ % stride == 0) sample.push_back(key);
+  };
+
+  if (dist == "dense") {
+    constexpr std::uint64_t runs = 16;
+    std::array<std::uint64_t, runs> starts{};
+    for (auto& start: starts) start = gen() >> 1U; // leaves room for the run
+    std::sort(starts.begin(), starts.end());
+    std::uniform_int_distribution<std::uint64_t> gap(1, 3);
+    std::uint64_t                                key = 0;
+    for (std::uint64_t run = 0; run != runs; ++run) {
+      key = std::max(key + 1, starts[run]);
+      for (std::uint64_t i = count * run / runs; i != count * (run + 1) / runs; ++i) {
+        emit(key);
+        key += gap(gen);
+      }
+    }
+    return sample;
+  }
+
+  const std::uint64_t shards = std::uint64_t{1} << shard_bits;
+  const unsigned      shift  = 64U - shard_bits;
+  const std::uint64_t max_low = (std::uint64_t{1} << shift) - 1;
+  const auto          span   = static_cast<double>(max_low);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  for (std::uint64_t prefix = 0; prefix != shards; ++prefix) {
+    const std::uint64_t shard_keys = count * (prefix + 1) / shards - count * prefix / shards;
+
+    double        position = 0; // in [0, 1)
+    std::uint64_t next_low = 0; // keeps them distinct, in spite of rounding
+    for (std::uint64_t i = 0; i != shard_keys; ++i) {
+      // the smallest of the `shard_keys - i` keys left, uniform in [position, 1)
+      const auto left = static_cast<double>(shard_keys - i);
+      position += (1 - position) * (1 - std::pow(unit(gen), 1 / left));
+      const auto low = std::min(std::max(static_cast<std::uint64_t>(position * span), next_low),
+                                max_low);
+      next_low       = low + 1;
+      emit(prefix << shift | low);
+    }
+  }
+  return sample;
+}
+
+// streams the keys into a flat `sharded_filter` sink
+template <typename Sink>
+std::vector<std::uint64_t> build(Sink& sink, std::uint64_t count, const std::string& dist,
+                                 std::uint8_t shard_bits) {
+  sink.stream_prepare(std::max(std::thread::hardware_concurrency(), 1U));
+  auto sample = generate(count, dist, shard_bits, [&](std::uint64_t key) { sink.stream_add(key); });
+  sink.stream_finalize();
+  return sample;
+}
+
+// an `adaptive_sharded_filter` is built from all the keys at once
+template <typename Sink>
+std::vector<std::uint64_t> build_adaptive(Sink& sink, std::uint64_t count,
+                                          const std::string& dist) {
+  std::vector<std::uint64_t> keys;
+  keys.reserve(count);
+  auto sample = generate(count, dist, 1, [&](std::uint64_t key) { keys.push_back(key); });
+  sink.build(keys);
+  return sample;
+}
+
+// ranks in [0, size), with P(rank) ~ 1 / (rank + 1)^s, or uniform for s == 0
+class zipf_distribution {
+public:
+  zipf_distribution(std::size_t size, double s) : size_(size) {
+    if (s == 0.0) return;
+    cdf_.reserve(size);
+    double sum = 0;
+    for (std::size_t rank = 0; rank != size; ++rank) {
+      sum += 1.0 / std::pow(static_cast<double>(rank + 1), s);
+      cdf_.push_back(sum);
+    }
+    for (auto& c: cdf_) c /= sum;
+  }
+
+  std::size_t operator()(std::mt19937_64& gen) {
+    if (cdf_.empty()) return std::uniform_int_distribution<std::size_t>(0, size_ - 1)(gen);
+    const auto at = std::lower_bound(cdf_.begin(), cdf_.end(), unit_(gen));
+    return std::min(static_cast<std::size_t>(at - cdf_.begin()), size_ - 1);
+  }
+
+private:
+  std::size_t                            size_;
+  std::vector<double>                    cdf_;
+  std::uniform_real_distribution<double> unit_{0.0, 1.0};
+};
+
+// `count` queries, a `hit` fraction of them from `sample`, the rest
+// random (and so almost all misses). Both are drawn from a fixed pool
+// with the `zipf` skew, so that hot keys repeat.
+std::vector<std::uint64_t> make_queries(const std::vector<std::uint64_t>& sample,
+                                        std::uint64_t count, double hit, double zipf,
+                                        std::uint64_t seed) {
+  std::mt19937_64 gen(seed);
+
+  std::vector<std::uint64_t> hits = sample;
+  std::shuffle(hits.begin(), hits.end(), gen); // rank order independent of key order
+  std::vector<std::uint64_t> misses(std::min<std::uint64_t>(count, max_hit_sample));
+  for (auto& miss: misses) miss = gen();
+
+  zipf_distribution           hit_rank(hits.size(), zipf);
+  zipf_distribution           miss_rank(misses.size(), zipf);
+  std::bernoulli_distribution is_hit(hit);
+
+  std::vector<std::uint64_t> queries(count);
+  for (auto& query: queries) {
+    query = is_hit(gen) ? hits[hit_rank(gen)] : misses[miss_rank(gen)];
+  }
+  return queries;
+}
+
+// runs
+
+// one filter file
+struct filter_config {
+  std::uint64_t keys;
+  std::string   dist;
+  std::string   layout;
+  std::uint8_t  shard_bits; // 0 for the adaptive layout
+  std::uint64_t fp_bits;
+  std::uint64_t shards     = 0;
+  std::uint64_t file_size  = 0;
+};
+
+struct run_config {
+  double        hit;
+  double        zipf;
+  std::string   mode;
+  std::uint64_t threads;
+  std::string   cache;
+};
+
+struct run_result {
+  double            real_time; // ns per query, wall, of each thread
+  double            cpu_time;  // ns per query, process cpu, all threads
+  std::uint64_t     iterations;
+  std::uint64_t     found;
+  latency_histogram latency;
+};
+
+double cpu_seconds() { return static_cast<double>(std::clock()) / CLOCKS_PER_SEC; }
+
+template <typename Source>
+std::uint64_t query_pass(const Source& source, std::span<const std::uint64_t> queries,
+                         const run_config& cfg, std::uint64_t batch, latency_histogram* latency,
+                         std::uint64_t overhead) {
+  std::uint64_t found = 0;
+  if (cfg.mode == "single") {
+    for (auto key: queries) {
+      if (latency == nullptr) {
+        found += source.contains(key) ? 1U : 0U;
+        continue;
+      }
+      const auto start = clk::now();
+      const bool hit   = source.contains(key);
+      const auto end   = clk::now();
+      found += hit ? 1U : 0U;
+      latency->record(elapsed_nanos(start, end, overhead));
+    }
+    return found;
+  }
+  std::vector<std::uint8_t> out(batch);
+  for (std::size_t begin = 0; begin < queries.size(); begin += batch) {
+    const auto keys  = queries.subspan(begin, std::min<std::size_t>(batch, queries.size() - begin));
+    const auto start = clk::now();
+    source.contains_many(keys, out);
+    const auto end = clk::now();
+    const auto found_in = std::span(out).first(keys.size());
+    found += static_cast<std::uint64_t>(std::count(found_in.begin(), found_in.end(), 1));
+    if (latency != nullptr) latency->record(elapsed_nanos(start, end, overhead) / keys.size());
+  }
+  return found;
+}
+
+// all threads start together; returns the wall time of the slowest
+template <typename Fn>
+clk::duration run_threads(std::uint64_t threads, Fn fn) {
+  std::latch                 ready(static_cast<std::ptrdiff_t>(threads));
+  std::vector<clk::duration> wall(threads);
+  std::vector<std::thread>   workers;
+  workers.reserve(threads);
+  for (std::uint64_t t = 0; t != threads; ++t) {
+    workers.emplace_back([&ready, &wall, &fn, t] {
+      ready.arrive_and_wait();
+      const auto start = clk::now();
+      fn(t);
+      wall[t] = clk::now() - start;
+    });
+  }
+  for (auto& worker: workers) worker.join();
+  return *std::max_element(wall.begin(), wall.end());
+}
+
+// `open()` returns a new source for `path`
+template <typename Open>
+run_result run(const options& opts, const std::filesystem::path& path, const Open& open,
+               const std::vector<std::uint64_t>& sample, const run_config& cfg,
+               std::uint64_t overhead) {
+  std::vector<std::vector<std::uint64_t>> queries;
+  queries.reserve(cfg.threads);
+  for (std::uint64_t t = 0; t != cfg.threads; ++t) {
+    queries.push_back(make_queries(sample, opts.queries, cfg.hit, cfg.zipf, t + 1));
+  }
+  const bool cold = cfg.cache == "cold";
+
+  run_result result{};
+  result.iterations = opts.queries * cfg.threads;
+
+  // throughput
+  {
+    if (cold) drop_page_cache(path, opts.drop_caches);
+    const auto                 source = open();
+    std::vector<std::uint64_t> found(cfg.threads);
+    const auto                 cpu_start = cpu_seconds();
+
+    const auto wall = run_threads(cfg.threads, [&](std::uint64_t t) {
+      found[t] = query_pass(source, queries[t], cfg, opts.batch, nullptr, overhead);
+    });
+    const auto cpu   = cpu_seconds() - cpu_start;
+    const auto iters = static_cast<double>(result.iterations);
+    // per query, per thread: like Google Benchmark's real_time
+    result.real_time = static_cast<double>(std::chrono::nanoseconds(wall).count()) / iters *
+                       static_cast<double>(cfg.threads);
+    result.cpu_time  = cpu * 1e9 / iters;
+    for (auto f: found) result.found += f;
+  }
+
+  // latency
+  {
+    if (cold) drop_page_cache(path, opts.drop_caches);
+    const auto                     source = open();
+    std::vector<latency_histogram> latency(cfg.threads);
+    run_threads(cfg.threads, [&](std::uint64_t t) {
+      query_pass(source, queries[t], cfg, opts.batch, &latency[t], overhead);
+    });
+    for (const auto& histogram: latency) result.latency.merge(histogram);
+  }
+  return result;
+}
+
+// output
+
+std::string json_string(std::string_view text) {
+  std::string quoted = "\"";
+  for (char c: text) {
+    if (c == '"' || c == '\\') quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+std::string timestamp() {
+  const auto        now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  std::tm           local{};
+  std::stringstream out;
+#if defined(__unix__) || defined(__APPLE__)
+  ::localtime_r(&now, &local);
+#else
+  local = *std::localtime(&now); // NOLINT no concurrent callers
+#endif
+  out << std::put_time(&local, "%Y-%m-%dT%H:%M:%S%z");
+  return out.str();
+}
+
+std::string host_name() {
+#if defined(__unix__) || defined(__APPLE__)
+  std::array<char, 256> name{};
+  if (::gethostname(name.data(), name.size() - 1) == 0) return name.data();
+#endif
+  return "unknown";
+}
+
+class json_writer {
+public:
+  json_writer(std::ostream& out, const std::string& executable, std::uint64_t overhead)
+      : out_(out) {
+    out_ << std::setprecision(6) << "{\n  \"context\": {\n"
+         << "    \"date\": " << json_string(timestamp()) << ",\n"
+         << "    \"host_name\": " << json_string(host_name()) << ",\n"
+         << "    \"executable\": " << json_string(executable) << ",\n"
+         << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+#ifdef NDEBUG
+         << "    \"library_build_type\": \"release\",\n"
+#else
+         << "    \"library_build_type\": \"debug\",\n"
+#endif
+         << "    \"timer_overhead_ns\": " << overhead << "\n"
+         << "  },\n  \"benchmarks\": [";
+  }
+
+  json_writer(const json_writer&)            = delete;
+  json_writer& operator=(const json_writer&) = delete;
+  json_writer(json_writer&&)                 = delete;
+  json_writer& operator=(json_writer&&)      = delete;
+
+  ~json_writer() { out_ << "\n  ]\n}\n"; }
+
+  void add(const std::string& name, const filter_config& fil, std::uint64_t batch,
+           const run_config& cfg, const run_result& res) {
+    const double per_second = res.real_time > 0 ? 1e9 / res.real_time : 0;
+    out_ << (first_ ? "\n" : ",\n") << "    {\n"
+         << "      \"name\": " << json_string(name) << ",\n"
+         << "      \"run_name\": " << json_string(name) << ",\n"
+         << "      \"run_type\": \"iteration\",\n"
+         << "      \"repetitions\": 1,\n"
+         << "      \"repetition_index\": 0,\n"
+         << "      \"threads\": " << cfg.threads << ",\n"
+         << "      \"iterations\": " << res.iterations << ",\n"
+         << "      \"real_time\": " << res.real_time << ",\n"
+         << "      \"cpu_time\": " << res.cpu_time << ",\n"
+         << "      \"time_unit\": \"ns\",\n"
+         << "      \"items_per_second\": " << per_second << ",\n"
+         << "      \"keys\": " << fil.keys << ",\n"
+         << "      \"dist\": " << json_string(fil.dist) << ",\n"
+         << "      \"layout\": " << json_string(fil.layout) << ",\n"
+         << "      \"shard_bits\": " << int{fil.shard_bits} << ",\n"
+         << "      \"shards\": " << fil.shards << ",\n"
+         << "      \"fp_bits\": " << fil.fp_bits << ",\n"
+         << "      \"bits_per_key\": "
+         << static_cast<double>(fil.file_size) * 8 / static_cast<double>(fil.keys) << ",\n"
+         << "      \"hit_ratio\": " << cfg.hit << ",\n"
+         << "      \"zipf\": " << cfg.zipf << ",\n"
+         << "      \"mode\": " << json_string(cfg.mode) << ",\n"
+         << "      \"batch\": " << (cfg.mode == "batch" ? batch : 1) << ",\n"
+         << "      \"cache\": " << json_string(cfg.cache) << ",\n"
+         << "      \"found_ratio\": "
+         << static_cast<double>(res.found) / static_cast<double>(res.iterations) << ",\n"
+         << "      \"p50_ns\": " << res.latency.percentile(0.5) << ",\n"
+         << "      \"p90_ns\": " << res.latency.percentile(0.9) << ",\n"
+         << "      \"p99_ns\": " << res.latency.percentile(0.99) << ",\n"
+         << "      \"p999_ns\": " << res.latency.percentile(0.999) << ",\n"
+         << "      \"max_ns\": " << res.latency.max() << "\n"
+         << "    }";
+    first_ = false;
+    out_.flush();
+  }
+
+private:
+  std::ostream& out_;
+  bool          first_ = true;
+};
+
+// queries the filter built at `path` with every run_config
+template <typename Open>
+void bench_queries(const options& opts, json_writer& json, const std::filesystem::path& path,
+                   const Open& open, const filter_config& fil,
+                   const std::vector<std::uint64_t>& sample, double build_seconds,
+                   std::uint64_t overhead) {
+  std::cerr << "\nkeys " << fil.keys << "  " << fil.dist << "  " << fil.layout;
+  if (fil.layout == "flat") std::cerr << "  shard_bits " << int{fil.shard_bits};
+  std::cerr << "  shards " << fil.shards << "  fp " << fil.fp_bits << "  build " << std::fixed
+            << std::setprecision(2) << build_seconds << "s  "
+            << static_cast<double>(fil.file_size) * 8 / static_cast<double>(fil.keys)
+            << " bits/key\n"
+            << std::setw(5) << "hit" << std::setw(6) << "zipf" << std::setw(7) << "mode"
+            << std::setw(4) << "thr" << std::setw(6) << "cache" << std::setw(10) << "ns/query"
+            << std::setw(9) << "p50" << std::setw(9) << "p99" << std::setw(9) << "p999"
+            << std::setw(9) << "found\n";
+
+  for (auto hit: opts.hit) {
+    for (auto zipf: opts.zipf) {
+      for (const auto& mode: opts.mode) {
+        for (auto threads: opts.threads) {
+          for (const auto& cache: opts.cache) {
+            const run_config cfg{hit, zipf, mode, threads, cache};
+            const auto       res = run(opts, path, open, sample, cfg, overhead);
+
+            std::stringstream name;
+            name << "contains/fp:" << fil.fp_bits << "/keys:" << fil.keys << "/dist:" << fil.dist
+                 << "/layout:" << fil.layout;
+            if (fil.layout == "flat") name << "/shard_bits:" << int{fil.shard_bits};
+            name << "/hit:" << hit << "/zipf:" << zipf << "/" << mode << "/" << cache
+                 << "/threads:" << threads;
+            json.add(name.str(), fil, opts.batch, cfg, res);
+
+            std::cerr << std::setprecision(2) << std::setw(5) << hit << std::setw(6) << zipf
+                      << std::setw(7) << mode << std::setw(4) << threads << std::setw(6) << cache
+                      << std::setprecision(1) << std::setw(10) << res.real_time << std::setw(9)
+                      << res.latency.percentile(0.5) << std::setw(9)
+                      << res.latency.percentile(0.99) << std::setw(9)
+                      << res.latency.percentile(0.999) << std::setprecision(4) << std::setw(8)
+                      << static_cast<double>(res.found) / static_cast<double>(res.iterations)
+                      << "\n";
+          }
+        }
+      }
+    }
+  }
+  std::filesystem::remove(path);
+}
+
+template <typename Sink, typename Source>
+void bench_flat(const options& opts, json_writer& json, std::uint64_t keys,
+                const std::string& dist, std::uint8_t shard_bits, std::uint64_t overhead) {
+  filter_config               fil{keys, dist, "flat", shard_bits, Sink::nbits};
+  const std::filesystem::path path = opts.dir / ("bench_f" + std::to_string(fil.fp_bits) + "_" +
+                                                 std::to_string(shard_bits) + ".bin");
+
+  std::vector<std::uint64_t> sample;
+  const auto                 build_start = clk::now();
+  {
+    Sink sink(path, shard_bits);
+    sample     = build(sink, keys, dist, shard_bits);
+    fil.shards = sink.shards();
+  }
+  const std::chrono::duration<double> build_time = clk::now() - build_start;
+  fil.file_size = std::filesystem::file_size(path);
+  bench_queries(
+      opts, json, path, [&] { return Source(path, shard_bits); }, fil, sample, build_time.count(),
+      overhead);
+}
+
+template <typename Sink, typename Source>
+void bench_adaptive(const options& opts, json_writer& json, std::uint64_t keys,
+                    const std::string& dist, std::uint64_t overhead) {
+  filter_config               fil{keys, dist, "adaptive", 0, Sink::nbits};
+  const std::filesystem::path path =
+      opts.dir / ("bench_a" + std::to_string(fil.fp_bits) + ".bin");
+
+  std::vector<std::uint64_t> sample;
+  const auto                 build_start = clk::now();
+  {
+    Sink sink(path);
+    sample     = build_adaptive(sink, keys, dist);
+    fil.shards = sink.shards();
+  }
+  const std::chrono::duration<double> build_time = clk::now() - build_start;
+  fil.file_size = std::filesystem::file_size(path);
+  bench_queries(
+      opts, json, path, [&] { return Source(path); }, fil, sample, build_time.count(), overhead);
+}
+
+template <typename Sink, typename Source, typename AdaptiveSink, typename AdaptiveSource>
+void bench_fp(const options& opts, json_writer& json, std::uint64_t keys, const std::string& dist,
+              std::uint64_t overhead) {
+  for (const auto& layout: opts.layout) {
+    if (layout == "adaptive") {
+      bench_adaptive<AdaptiveSink, AdaptiveSource>(opts, json, keys, dist, overhead);
+      continue;
+    }
+    for (auto bits: opts.shard_bits) {
+      bench_flat<Sink, Source>(opts, json, keys, dist, static_cast<std::uint8_t>(bits), overhead);
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    const auto args = std::span(argv, static_cast<std::size_t>(argc));
+    const auto opts = parse_options(args.subspan(1));
+
+    const auto    overhead = clock_overhead();
+    std::ofstream file;
+    if (opts.out != "-") {
+      file.open(opts.out);
+      if (!file) throw std::runtime_error("cannot open " + opts.out);
+    }
+    json_writer json(opts.out == "-" ? std::cout : file, args[0], overhead);
+
+    for (auto keys: opts.keys) {
+      for (const auto& dist: opts.dist) {
+        for (auto fp: opts.fp) {
+          if (fp == 8) {
+            bench_fp<binfuse::sharded_filter8_sink, binfuse::sharded_filter8_source,
+                     binfuse::adaptive_sharded_filter8_sink,
+                     binfuse::adaptive_sharded_filter8_source>(opts, json, keys, dist, overhead);
+          } else {
+            bench_fp<binfuse::sharded_filter16_sink, binfuse::sharded_filter16_source,
+                     binfuse::adaptive_sharded_filter16_sink,
+                     binfuse::adaptive_sharded_filter16_source>(opts, json, keys, dist, overhead);
+          }
+        }
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,404 @@
+#pragma once
+
+#include "binfuse/filter.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include "mio/mmap.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <limits>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace binfuse {
+
+// how `adaptive_sharded_filter::build` lays out the shards
+struct adaptive_options {
+  std::uint8_t index_bits        = 10;        // 2^10 16 byte entries: 16kB, stays in L1
+  std::size_t  target_shard_keys = 1UL << 20; // aim for at most this many keys per shard
+  std::uint8_t max_sub_bits      = 16;        // most shards one prefix is split into: 2^16
+  unsigned     threads           = std::thread::hardware_concurrency();
+
+  static constexpr std::uint8_t max_index_bits   = 16;
+  static constexpr std::uint8_t max_max_sub_bits = 24;
+};
+
+/* binfuse::adaptive_index
+ *
+ * The two level prefix index of `adaptive_sharded_filter`: one entry
+ * per top `index_bits` prefix of the key, each naming a run of
+ * `2^sub_bits` consecutive shards, and how to pick one of them.
+ *
+ * `plan` sizes the runs from the key counts: a dense prefix is split
+ * into equal width slices of the range from its smallest to its
+ * largest key, so even a contiguous range of small integers spreads
+ * evenly over its sub-shards, and consecutive sparse (and empty)
+ * prefixes are merged into one shard of up to `target_shard_keys`
+ * keys, with `sub_bits == 0`.
+ *
+ * `shard(key)` is branch-free: one load from the index, a subtract,
+ * a shift and a masked add.
+ */
+class adaptive_index {
+public:
+  struct entry {
+    std::uint64_t low      = 0; // smallest key of a split prefix
+    std::uint32_t base     = 0; // first shard of the run
+    std::uint8_t  shift    = 0; // sub-shard = ((key - low) >> shift) & (2^sub_bits - 1)
+    std::uint8_t  sub_bits = 0;
+    std::uint16_t reserved = 0;
+  };
+  static_assert(sizeof(entry) == 16);
+
+  adaptive_index() = default;
+  adaptive_index(std::vector<entry> entries, std::uint8_t index_bits, std::uint32_t shards)
+      : entries_(std::move(entries)), index_bits_(index_bits), shards_(shards) {
+    check();
+  }
+
+  // `keys` must be sorted ascending
+  [[nodiscard]] static adaptive_index plan(std::span<const std::uint64_t> keys,
+                                           const adaptive_options& opts) {
+    if (opts.index_bits == 0 || opts.index_bits > adaptive_options::max_index_bits) {
+      throw std::runtime_error("adaptive_index: index_bits must be in range [1, " +
+                               std::to_string(adaptive_options::max_index_bits) + "]");
+    }
+    const std::size_t  target   = std::max<std::size_t>(opts.target_shard_keys, 1);
+    const std::uint8_t max_sub  = std::min(opts.max_sub_bits, adaptive_options::max_max_sub_bits);
+    const unsigned     shift    = 64U - opts.index_bits;
+    const std::size_t  prefixes = std::size_t{1} << opts.index_bits;
+
+    std::vector<entry> entries(prefixes);
+    std::uint64_t      next       = 0; // next unused shard
+    bool               open_group = false;
+    std::size_t        group_keys = 0;
+    std::size_t        pos        = 0;
+    for (std::size_t prefix = 0; prefix != prefixes; ++prefix) {
+      const std::size_t start = pos;
+      while (pos != keys.size() && (keys[pos] >> shift) == prefix) ++pos;
+      const std::size_t count = pos - start;
+
+      if (count > target) {
+        // slices of 2^shift keys, at least half of them in the range
+        const auto span   = static_cast<unsigned>(std::bit_width(keys[pos - 1] - keys[start]));
+        const auto wanted = static_cast<unsigned>(std::bit_width((count - 1) / target));
+        const auto sub    = std::min({wanted, unsigned{max_sub}, span});
+        entries[prefix]   = {keys[start], static_cast<std::uint32_t>(next),
+                             static_cast<std::uint8_t>(span - sub), static_cast<std::uint8_t>(sub),
+                             0};
+        next += std::uint64_t{1} << sub;
+        open_group = false;
+      } else {
+        if (!open_group || group_keys + count > target) {
+          open_group = true;
+          group_keys = 0;
+          ++next;
+        }
+        group_keys += count;
+        entries[prefix] = {0, static_cast<std::uint32_t>(next - 1), 0, 0, 0};
+      }
+      if (next > max_shards) {
+        throw std::runtime_error("adaptive_index: more than " + std::to_string(max_shards) +
+                                 " shards, raise target_shard_keys");
+      }
+    }
+    return {std::move(entries), opts.index_bits, static_cast<std::uint32_t>(next)};
+  }
+
+  [[nodiscard]] std::uint32_t shard(std::uint64_t key) const noexcept {
+    const auto& ent = entries_[key >> (64U - index_bits_)];
+    const auto  sub = ((key - ent.low) >> ent.shift) & ((std::uint64_t{1} << ent.sub_bits) - 1);
+    return ent.base + static_cast<std::uint32_t>(sub);
+  }
+
+  [[nodiscard]] const std::vector<entry>& entries() const { return entries_; }
+  [[nodiscard]] std::uint8_t              index_bits() const { return index_bits_; }
+  [[nodiscard]] std::uint32_t             shards() const { return shards_; }
+
+  static constexpr std::uint64_t max_shards = std::uint64_t{1} << 28;
+
+private:
+  std::vector<entry> entries_;
+  std::uint8_t       index_bits_ = 0;
+  std::uint32_t      shards_     = 0;
+
+  // every entry must name shards which exist: `shard` does not check
+  void check() const {
+    if (index_bits_ == 0 || index_bits_ > adaptive_options::max_index_bits ||
+        entries_.size() != std::size_t{1} << index_bits_ || shards_ > max_shards) {
+      throw std::runtime_error("corrupt adaptive index: bad index_bits or shard count");
+    }
+    for (const auto& ent: entries_) {
+      if (ent.sub_bits > adaptive_options::max_max_sub_bits || ent.shift + ent.sub_bits > 63U ||
+          ent.base + (std::uint64_t{1} << ent.sub_bits) > shards_) {
+        throw std::runtime_error("corrupt adaptive index: entry names shards beyond " +
+                                 std::to_string(shards_));
+      }
+    }
+  }
+};
+
+/* binfuse::adaptive_sharded_filter
+ *
+ * Like `sharded_filter`, but sharded by an `adaptive_index` rather
+ * than a fixed number of top bits, so that skewed key sets, eg dense
+ * ranges of integer ids, still give shards of about equal size, and
+ * sparse ones do not waste a shard (and its header) on a handful of
+ * keys.
+ *
+ * The sink is built once, from all the keys, sorted:
+ *
+ *     adaptive_sharded_filter8_sink sink("filter.abin");
+ *     sink.build(sorted_keys);
+ *
+ * and the shards are populated in parallel, on `opts.threads`. The
+ * source maps the file and answers queries exactly like a
+ * `sharded_view`: `contains` is branch-free and `noexcept`, with
+ * empty shards replaced by `shard_descriptor::sentinel()`.
+ *
+ * File format:
+ *   [0, 16)  tag "abinfuse08-v001", (16, 32 for other fingerprints)
+ *   [16, 20) uint32 index_bits
+ *   [20, 24) uint32 number of shards
+ *   [24, 32) reserved, zero
+ *   then 2^index_bits 16 byte `adaptive_index::entry`s
+ *   then a uint64 offset per shard, 0 if it is empty
+ *   then the shards, in upstream format, each 8 byte aligned
+ */
+template <filter_type FilterType, mio::access_mode AccessMode>
+class adaptive_sharded_filter : private sharded_mmap_base<AccessMode> {
+public:
+  using shard_filter_t     = filter<FilterType>;
+  using shard_descriptor_t = shard_descriptor<FilterType>;
+  using probe_t            = typename filter<FilterType>::probe_t;
+
+  static constexpr std::uint32_t nbits = sizeof(typename ftype<FilterType>::fingerprint_t) * 8;
+  static constexpr std::size_t   header_length = 32;
+
+  adaptive_sharded_filter() = default;
+  // a source loads the file, a sink only creates it in `build`
+  explicit adaptive_sharded_filter(std::filesystem::path path, const map_options& opts = {})
+      : filepath_(std::move(path)) {
+    if constexpr (AccessMode == mio::access_mode::read) {
+      load(opts);
+    }
+  }
+
+  [[nodiscard]] bool contains(std::uint64_t needle) const noexcept {
+    return shards_[index_.shard(needle)].matches(needle);
+  }
+
+  // as `sharded_view::contains_many`
+  void contains_many(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out) const {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("contains_many: output span is smaller than keys span.");
+    }
+    constexpr auto window_size = filter<FilterType>::batch_window;
+
+    // NOLINTBEGIN uninitialised, always written first
+    std::array<const shard_descriptor_t*, window_size> shards;
+    std::array<probe_t, window_size>                   probes;
+    // NOLINTEND
+    for (std::size_t base = 0; base < keys.size(); base += window_size) {
+      const auto window = std::min(window_size, keys.size() - base);
+      for (std::size_t i = 0; i != window; ++i) {
+        shards[i] = &shards_[index_.shard(keys[base + i])];
+        detail::prefetch(shards[i]);
+      }
+      for (std::size_t i = 0; i != window; ++i) probes[i] = shards[i]->probe(keys[base + i]);
+      for (std::size_t i = 0; i != window; ++i) {
+        out[base + i] = shards[i]->resolve_masked(probes[i]) ? 1 : 0;
+      }
+    }
+  }
+
+  [[nodiscard]] verify_result verify(std::span<const std::uint64_t> keys,
+                                     const verify_options& opts = {}) const {
+    return detail::verify_keys(keys, opts, [this](auto batch, auto out) {
+      contains_many(batch, out);
+    });
+  }
+
+  // `keys` must be sorted ascending. Writes the whole file, replacing
+  // any existing one, after which the sink can be queried.
+  void build(std::span<const std::uint64_t> keys, const adaptive_options& opts = {})
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (!std::is_sorted(keys.begin(), keys.end())) {
+      throw std::runtime_error("adaptive_sharded_filter: keys must be sorted");
+    }
+    auto index = adaptive_index::plan(keys, opts);
+
+    // the keys of each shard are contiguous, in shard order
+    std::vector<std::size_t> starts(std::size_t{index.shards()} + 1);
+    for (const auto key: keys) ++starts[index.shard(key) + 1];
+    for (std::size_t i = 1; i != starts.size(); ++i) starts[i] += starts[i - 1];
+
+    std::vector<shard_filter_t> filters(index.shards());
+    populate_shards(keys, starts, filters, opts.threads);
+
+    const std::size_t     table = header_length + index.entries().size() * sizeof(entry_t);
+    std::vector<offset_t> offsets(index.shards());
+    offset_t              end = table + offsets.size() * sizeof(offset_t);
+    for (std::size_t i = 0; i != filters.size(); ++i) {
+      if (filters[i].is_populated()) {
+        offsets[i] = end;
+        end        = align(end + filters[i].serialization_bytes());
+      }
+    }
+
+    {
+      const std::ofstream touch(filepath_, std::ios::trunc);
+    }
+    std::filesystem::resize_file(filepath_, end);
+    map_whole_file();
+    char* data = this->mmap.data();
+    memset(data, 0, table);
+    const auto tag   = type_id();
+    const auto bits  = static_cast<std::uint32_t>(index.index_bits());
+    const auto count = index.shards();
+    memcpy(data, tag.data(), tag.size());
+    memcpy(data + 16, &bits, sizeof(bits));
+    memcpy(data + 20, &count, sizeof(count));
+    memcpy(data + header_length, index.entries().data(), index.entries().size() * sizeof(entry_t));
+    memcpy(data + table, offsets.data(), offsets.size() * sizeof(offset_t));
+    for (std::size_t i = 0; i != filters.size(); ++i) {
+      if (offsets[i] != 0) filters[i].serialize(data + offsets[i]);
+    }
+    std::error_code err;
+    this->mmap.sync(err);
+    if (err) {
+      throw std::runtime_error("adaptive_sharded_filter:: mmap.sync(): " + err.message());
+    }
+    parse();
+  }
+
+  [[nodiscard]] std::size_t           shards() const { return shards_.size(); }
+  [[nodiscard]] std::uint8_t          index_bits() const { return index_.index_bits(); }
+  [[nodiscard]] const adaptive_index& index() const { return index_; }
+
+private:
+  using offset_t = std::uint64_t;
+  using entry_t  = adaptive_index::entry;
+
+  std::filesystem::path           filepath_;
+  adaptive_index                  index_;
+  std::vector<shard_descriptor_t> shards_;
+
+  static constexpr offset_t align(offset_t offset) { return (offset + 7) & ~offset_t{7}; }
+
+  [[nodiscard]] static std::string type_id() {
+    std::stringstream tag;
+    tag << "abinfuse" << std::setfill('0') << std::setw(2) << nbits << "-v001";
+    return tag.str();
+  }
+
+  // each worker takes the next unpopulated shard
+  static void populate_shards(std::span<const std::uint64_t> keys,
+                              const std::vector<std::size_t>& starts,
+                              std::vector<shard_filter_t>& filters, unsigned threads) {
+    std::atomic<std::size_t> next{0};
+    const auto               work = [&] {
+      populate_options opts;
+      opts.threads = 1;
+      for (auto i = next++; i < filters.size(); i = next++) {
+        const auto shard_keys = keys.subspan(starts[i], starts[i + 1] - starts[i]);
+        if (shard_keys.size() > std::numeric_limits<std::uint32_t>::max()) {
+          throw std::runtime_error("adaptive_sharded_filter: shard " + std::to_string(i) +
+                                   " has too many keys, raise max_sub_bits");
+        }
+        if (!shard_keys.empty()) filters[i].populate(shard_keys, opts);
+      }
+    };
+    const std::size_t              workers = std::clamp<std::size_t>(threads, 1, filters.size());
+    std::vector<std::future<void>> futures;
+    for (std::size_t i = 1; i < workers; ++i) {
+      futures.push_back(std::async(std::launch::async, work));
+    }
+    work();
+    for (auto& fut: futures) fut.get();
+  }
+
+  void map_whole_file() {
+    std::error_code err;
+    this->mmap.map(filepath_.string(), err);
+    if (err) {
+      throw std::runtime_error("adaptive_sharded_filter:: mmap.map(): " + err.message());
+    }
+  }
+
+  void load(const map_options& opts) {
+    map_whole_file();
+    detail::advise(this->mmap.data(), this->mmap.size(), opts);
+    parse();
+  }
+
+  // validates the whole index, so that queries need not check anything
+  void parse() {
+    const char*       data = this->mmap.data();
+    const std::size_t size = this->mmap.size();
+    const auto        tag  = type_id();
+    if (size < header_length || std::string(data, tag.size()) != tag) {
+      throw std::runtime_error("incorrect type_id: expected: " + tag);
+    }
+    std::uint32_t bits  = 0;
+    std::uint32_t count = 0;
+    memcpy(&bits, data + 16, sizeof(bits));
+    memcpy(&count, data + 20, sizeof(count));
+    if (bits == 0 || bits > adaptive_options::max_index_bits) {
+      throw std::runtime_error("corrupt file: index_bits = " + std::to_string(bits));
+    }
+    const std::size_t table = header_length + (std::size_t{1} << bits) * sizeof(entry_t);
+    if (count > adaptive_index::max_shards || table + count * sizeof(offset_t) > size) {
+      throw std::runtime_error("corrupt file: index extends beyond end of file");
+    }
+    std::vector<entry_t> entries(std::size_t{1} << bits);
+    memcpy(entries.data(), data + header_length, entries.size() * sizeof(entry_t));
+    index_ = adaptive_index(std::move(entries), static_cast<std::uint8_t>(bits), count);
+
+    shards_.assign(count, shard_descriptor_t::sentinel());
+    const std::size_t body = table + count * sizeof(offset_t);
+    for (std::uint32_t i = 0; i != count; ++i) {
+      offset_t offset = 0;
+      memcpy(&offset, data + table + i * sizeof(offset_t), sizeof(offset));
+      if (offset == 0) continue;
+      if (offset < body) {
+        throw std::runtime_error("corrupt file: shard " + std::to_string(i) +
+                                 " overlaps the header or index");
+      }
+      // without overflow, for any offset: the shard's header, then the whole shard
+      if (offset > size || size - offset < shard_filter_t::upstream_header_bytes ||
+          size - offset < shard_filter_t::serialization_bytes_at(data + offset)) {
+        throw std::runtime_error("corrupt file: shard " + std::to_string(i) +
+                                 " extends beyond end of file");
+      }
+      const auto desc = shard_descriptor_t::deserialize(data + offset);
+      if (desc.is_populated()) shards_[i] = desc;
+    }
+  }
+};
+
+// the main instantiations
+using adaptive_sharded_filter8_sink =
+    adaptive_sharded_filter<binary_fuse8_t, mio::access_mode::write>;
+using adaptive_sharded_filter8_source =
+    adaptive_sharded_filter<binary_fuse8_t, mio::access_mode::read>;
+using adaptive_sharded_filter16_sink =
+    adaptive_sharded_filter<binary_fuse16_t, mio::access_mode::write>;
+using adaptive_sharded_filter16_source =
+    adaptive_sharded_filter<binary_fuse16_t, mio::access_mode::read>;
+
+} // namespace binfuse
@@ -0,0 +1,427 @@
+#pragma once
+
+#include "binfuse/sharded_filter.hpp"
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if !defined(BINFUSE_DISABLE_IO_URING) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define BINFUSE_IO_URING 1
+#include <atomic>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace binfuse::detail {
+
+#ifdef BINFUSE_IO_URING
+
+/* detail::io_ring
+ *
+ * Minimal io_uring, driven by raw syscalls (no liburing): queue reads,
+ * submit them in one syscall, reap completions. Single threaded. If
+ * the kernel does not offer io_uring (too old, or disabled by seccomp
+ * or sysctl), `is_open()` is false and the caller falls back.
+ */
+class io_ring {
+public:
+  explicit io_ring(unsigned entries) {
+    io_uring_params params{};
+    fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0) {
+      return;
+    }
+    sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+      sq_bytes_ = cq_bytes_ = std::max(sq_bytes_, cq_bytes_);
+    }
+    sqe_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+    sq_ring_   = map(sq_bytes_, IORING_OFF_SQ_RING);
+    cq_ring_   = (params.features & IORING_FEAT_SINGLE_MMAP) != 0
+                     ? sq_ring_
+                     : map(cq_bytes_, IORING_OFF_CQ_RING);
+    sqes_      = static_cast<io_uring_sqe*>(map(sqe_bytes_, IORING_OFF_SQES));
+    if (sq_ring_ == nullptr || cq_ring_ == nullptr || sqes_ == nullptr) {
+      close();
+      return;
+    }
+    entries_  = params.sq_entries;
+    sq_head_  = field(sq_ring_, params.sq_off.head);
+    sq_tail_  = field(sq_ring_, params.sq_off.tail);
+    sq_mask_  = *field(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = field(sq_ring_, params.sq_off.array);
+    cq_head_  = field(cq_ring_, params.cq_off.head);
+    cq_tail_  = field(cq_ring_, params.cq_off.tail);
+    cq_mask_  = *field(cq_ring_, params.cq_off.ring_mask);
+    cqes_     = reinterpret_cast<io_uring_cqe*>( // NOLINT kernel abi
+        static_cast<char*>(cq_ring_) + params.cq_off.cqes);
+  }
+
+  io_ring(const io_ring& other)            = delete;
+  io_ring& operator=(const io_ring& other) = delete;
+  io_ring(io_ring&& other)                 = delete;
+  io_ring& operator=(io_ring&& other)      = delete;
+
+  ~io_ring() { close(); }
+
+  [[nodiscard]] bool     is_open() const { return fd_ >= 0; }
+  [[nodiscard]] unsigned entries() const { return entries_; }
+
+  // precondition: fewer than `entries()` reads queued or in flight
+  void queue_read(int fd, void* buffer, unsigned length, std::uint64_t offset,
+                  std::uint64_t user_data) {
+    const unsigned tail = *sq_tail_; // only this thread writes the tail
+    const unsigned idx  = tail & sq_mask_;
+    io_uring_sqe&  sqe  = sqes_[idx]; // NOLINT kernel abi
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_READ;
+    sqe.fd        = fd;
+    sqe.addr      = reinterpret_cast<std::uint64_t>(buffer); // NOLINT kernel abi
+    sqe.len       = length;
+    sqe.off       = offset;
+    sqe.user_data = user_data;
+    sq_array_[idx] = idx; // NOLINT kernel abi
+    std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1, std::memory_order_release);
+  }
+
+  // submits all queued reads and waits until at least `wait_for` have
+  // completed. What is still unsubmitted is read from the SQ head,
+  // which the kernel advances as it consumes entries.
+  void submit(unsigned wait_for) {
+    for (;;) {
+      const unsigned unsubmitted = unsubmitted_entries();
+      if (unsubmitted == 0 && wait_for == 0) {
+        return;
+      }
+      const unsigned flags = wait_for != 0 ? IORING_ENTER_GETEVENTS : 0U;
+      const auto     ret   = ::syscall(__NR_io_uring_enter, fd_, unsubmitted, wait_for, flags,
+                                       nullptr, 0);
+      if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+          continue;
+        }
+        throw std::runtime_error("io_uring_enter: " + std::string(std::strerror(errno)));
+      }
+      if (ret == 0 && wait_for == 0 && unsubmitted_entries() == unsubmitted) {
+        // no progress, and none to be expected from retrying
+        throw std::runtime_error("io_uring_enter: queued reads were not submitted");
+      }
+      wait_for = 0; // the kernel only returns once `wait_for` are complete
+    }
+  }
+
+  // calls fn(user_data, result) for each completed read
+  template <typename Func>
+  std::size_t reap(const Func& fn) {
+    unsigned       head = *cq_head_; // only this thread writes the head
+    const unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+    std::size_t    count = 0;
+    for (; head != tail; ++head, ++count) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_]; // NOLINT kernel abi
+      fn(cqe.user_data, cqe.res);
+      std::atomic_ref<unsigned>(*cq_head_).store(head + 1, std::memory_order_release);
+    }
+    return count;
+  }
+
+private:
+  int           fd_          = -1;
+  unsigned      entries_     = 0;
+  std::size_t   sq_bytes_    = 0;
+  std::size_t   cq_bytes_    = 0;
+  std::size_t   sqe_bytes_   = 0;
+  void*         sq_ring_     = nullptr;
+  void*         cq_ring_     = nullptr;
+  io_uring_sqe* sqes_        = nullptr;
+  unsigned*     sq_head_     = nullptr;
+  unsigned*     sq_tail_     = nullptr;
+  unsigned*     sq_array_    = nullptr;
+  unsigned      sq_mask_     = 0;
+  unsigned*     cq_head_     = nullptr;
+  unsigned*     cq_tail_     = nullptr;
+  unsigned      cq_mask_     = 0;
+  io_uring_cqe* cqes_        = nullptr;
+
+  [[nodiscard]] void* map(std::size_t bytes, off_t offset) const {
+    void* addr =
+        ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return addr == MAP_FAILED ? nullptr : addr;
+  }
+
+  [[nodiscard]] unsigned unsubmitted_entries() const {
+    return *sq_tail_ - std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] static unsigned* field(void* ring, unsigned offset) {
+    return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset); // NOLINT kernel abi
+  }
+
+  void close() noexcept {
+    if (sqes_ != nullptr) ::munmap(sqes_, sqe_bytes_);
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_bytes_);
+    if (sq_ring_ != nullptr) ::munmap(sq_ring_, sq_bytes_);
+    if (fd_ >= 0) ::close(fd_);
+    sqes_    = nullptr;
+    cq_ring_ = sq_ring_ = nullptr;
+    fd_                 = -1;
+  }
+};
+
+#endif // BINFUSE_IO_URING
+
+} // namespace binfuse::detail
+
+namespace binfuse {
+
+/* binfuse::async_query
+ *
+ * Asynchronous `contains` against a `sharded_filter` source, for files
+ * much larger than the page cache. There, a `contains` on the mmap
+ * will often stall its thread on a major page fault, one at a time.
+ * Instead, each lookup here computes its 3 fingerprint slots from the
+ * (in memory) shard descriptor, and reads just those fingerprints with
+ * io_uring. Many lookups are then queued on the device, overlapping
+ * their latencies, on one thread.
+ *
+ * Lookups are started with a callback:
+ *
+ *     query.contains_async(key, [](bool found) { ... });
+ *
+ * or awaited from a coroutine (of any task type):
+ *
+ *     const bool found = co_await query.contains_async(key);
+ *
+ * Started lookups are submitted in one syscall, and completed, ie their
+ * callbacks run or coroutines resumed, on the thread calling `poll` or
+ * `run`. At most `depth` lookups are in flight: starting another waits
+ * for (and completes) earlier ones first. A lookup without any read,
+ * ie for an empty shard, completes immediately.
+ *
+ * Each query thread owns its own `async_query`, which is not
+ * thread-safe. Any number of them may share one source. Without
+ * io_uring (other platforms, old kernels, BINFUSE_DISABLE_IO_URING) or
+ * when the source is served from anonymous memory, lookups are
+ * answered synchronously by `contains`. Results are always identical
+ * to `contains`. Lookups still pending when an `async_query` is
+ * destroyed are abandoned: their callbacks never run.
+ */
+template <filter_type FilterType>
+class async_query {
+public:
+  using source_t           = sharded_filter<FilterType, mio::access_mode::read>;
+  using shard_descriptor_t = typename source_t::shard_descriptor_t;
+  using fingerprint_t      = typename shard_descriptor_t::fingerprint_t;
+  using callback_t         = std::function<void(bool)>;
+
+  static constexpr unsigned max_depth = 4096;
+
+  // `source` must outlive this `async_query`. `depth` is clamped to
+  // [1, max_depth].
+  explicit async_query(const source_t& source, unsigned depth = 128)
+      : source_(&source), ops_(std::clamp(depth, 1U, max_depth)) {
+    free_.reserve(ops_.size());
+    for (std::size_t i = ops_.size(); i != 0; --i) free_.push_back(i - 1);
+#ifdef BINFUSE_IO_URING
+    if (source.file_handle() != mio::invalid_handle) {
+      ring_ = std::make_unique<detail::io_ring>(static_cast<unsigned>(ops_.size()) * 3);
+      if (!ring_->is_open() || ring_->entries() < ops_.size() * 3) {
+        ring_.reset();
+      }
+    }
+#endif
+  }
+
+  async_query(const async_query& other)            = delete;
+  async_query& operator=(const async_query& other) = delete;
+  async_query(async_query&& other)                 = delete;
+  async_query& operator=(async_query&& other)      = delete;
+
+  ~async_query() {
+#ifdef BINFUSE_IO_URING
+    // the kernel may still write into `ops_`: wait for, but discard, all reads
+    try {
+      while (ring_ != nullptr && reads_in_flight_ != 0) {
+        ring_->submit(1);
+        reads_in_flight_ -= ring_->reap([](std::uint64_t, int) {});
+      }
+    } catch (...) { // NOLINT(bugprone-empty-catch) nothing sensible to do in a destructor
+    }
+#endif
+  }
+
+  // true if lookups are read via io_uring, rather than answered synchronously
+  [[nodiscard]] bool is_async() const {
+#ifdef BINFUSE_IO_URING
+    return ring_ != nullptr;
+#else
+    return false;
+#endif
+  }
+
+  // number of started, but not yet completed, lookups
+  [[nodiscard]] std::size_t pending() const { return ops_.size() - free_.size(); }
+
+  // starts a lookup of `key`, `callback(found)` is called on completion,
+  // which may be before this returns
+  void contains_async(std::uint64_t key, callback_t callback) {
+    if (auto found = start(key); found.has_value()) {
+      callback(*found);
+    } else {
+      ops_[free_.back()].callback = std::move(callback);
+      free_.pop_back();
+    }
+  }
+
+  class awaitable {
+  public:
+    [[nodiscard]] bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> waiter) {
+      if (auto found = query_->start(key_); found.has_value()) {
+        found_ = *found;
+        return false; // no read needed: continue without suspending
+      }
+      auto& op  = query_->ops_[query_->free_.back()];
+      op.waiter = waiter;
+      op.found  = &found_;
+      query_->free_.pop_back();
+      return true;
+    }
+
+    [[nodiscard]] bool await_resume() const noexcept { return found_; }
+
+  private:
+    friend class async_query;
+    awaitable(async_query* query, std::uint64_t key) : query_(query), key_(key) {}
+
+    async_query*  query_;
+    std::uint64_t key_;
+    bool          found_ = false;
+  };
+
+  // starts a lookup of `key` when awaited, resuming with whether it was found
+  [[nodiscard]] awaitable contains_async(std::uint64_t key) { return {this, key}; }
+
+  // submits started lookups and completes those which have finished,
+  // without blocking. Returns the number completed.
+  std::size_t poll() { return complete(0); }
+
+  // submits started lookups and completes them all, including any
+  // started by their callbacks or coroutines meanwhile. Returns the
+  // number completed.
+  std::size_t run() {
+    std::size_t count = 0;
+    while (pending() != 0) count += complete(1);
+    return count;
+  }
+
+private:
+  struct lookup {
+    std::array<fingerprint_t, 3> fingerprints{};
+    fingerprint_t                expected  = 0;
+    unsigned                     remaining = 0;
+    bool                         failed    = false;
+    std::uint64_t                key       = 0;
+    callback_t                   callback;
+    std::coroutine_handle<>      waiter;
+    bool*                        found = nullptr;
+  };
+
+  const source_t*           source_;
+  std::vector<lookup>       ops_;
+  std::vector<std::size_t>  free_; // indexes into ops_, the back one is used next
+#ifdef BINFUSE_IO_URING
+  std::unique_ptr<detail::io_ring> ring_;
+  std::size_t                      reads_in_flight_ = 0;
+#endif
+
+  // Answers `key` now, if possible. Otherwise queues its reads in
+  // `ops_[free_.back()]`, which the caller then takes.
+  std::optional<bool> start(std::uint64_t key) {
+    const auto& shard = source_->shard_for(key);
+    if (!shard.is_populated()) {
+      return false;
+    }
+#ifdef BINFUSE_IO_URING
+    if (ring_ == nullptr) {
+      return shard.contains(key);
+    }
+    while (free_.empty()) complete(1); // at most `depth` in flight
+    const auto idx = free_.back();
+    auto&      op  = ops_[idx];
+    const auto prb = shard.locate(key);
+    op.expected    = static_cast<fingerprint_t>(ftype<FilterType>::fingerprint(prb.hash));
+    op.remaining   = 3;
+    op.failed      = false;
+    op.key         = key;
+    op.callback    = nullptr;
+    op.waiter      = nullptr;
+    op.found       = nullptr;
+    const std::array<std::uint32_t, 3> slots{prb.slots.h0, prb.slots.h1, prb.slots.h2};
+    for (std::size_t i = 0; i != slots.size(); ++i) {
+      ring_->queue_read(source_->file_handle(), &op.fingerprints[i], sizeof(fingerprint_t),
+                        source_->file_offset(&shard.fingerprints[slots[i]]), idx * 3 + i);
+    }
+    reads_in_flight_ += 3;
+    return std::nullopt;
+#else
+    return shard.contains(key);
+#endif
+  }
+
+  // submits queued reads, waits for at least `wait_for` of them, and
+  // completes every lookup whose reads are all done
+  std::size_t complete([[maybe_unused]] unsigned wait_for) {
+#ifdef BINFUSE_IO_URING
+    if (ring_ == nullptr) {
+      return 0;
+    }
+    ring_->submit(reads_in_flight_ != 0 ? wait_for : 0U);
+    std::vector<std::size_t> done;
+    reads_in_flight_ -= ring_->reap([&](std::uint64_t user_data, int result) {
+      auto& op = ops_[user_data / 3];
+      op.failed = op.failed || result != static_cast<int>(sizeof(fingerprint_t));
+      if (--op.remaining == 0) done.push_back(user_data / 3);
+    });
+    for (const auto idx: done) {
+      auto&      op    = ops_[idx];
+      const bool found = op.failed // eg a short read: ask the mmap instead
+                             ? source_->contains(op.key)
+                             : (op.expected ^ op.fingerprints[0] ^ op.fingerprints[1] ^
+                                op.fingerprints[2]) == 0;
+      auto callback    = std::move(op.callback);
+      auto waiter      = std::exchange(op.waiter, nullptr);
+      if (op.found != nullptr) *op.found = found;
+      free_.push_back(idx); // before continuing, which may start new lookups
+      if (waiter) {
+        waiter.resume();
+      } else if (callback) {
+        callback(found);
+      }
+    }
+    return done.size();
+#else
+    return 0;
+#endif
+  }
+};
+
+using async_query8  = async_query<binary_fuse8_t>;
+using async_query16 = async_query<binary_fuse16_t>;
+using async_query32 = async_query<binary_fuse32_t>;
+
+} // namespace binfuse
@@ -1,27 +1,45 @@
 #pragma once
 
 #include "binaryfusefilter.h"
+#include "binfuse/instrument.hpp"
+#include "binfuse/native.hpp"
+#include "binfuse/simd.hpp"
 #include "mio/mmap.hpp"
 #include "mio/page.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <climits>
 #include <concepts>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
 
 namespace binfuse {
 
 template <typename T>
-concept filter_type = std::same_as<T, binary_fuse8_t> || std::same_as<T, binary_fuse16_t>;
+concept filter_type = std::same_as<T, binary_fuse8_t> || std::same_as<T, binary_fuse16_t> ||
+                      std::same_as<T, binary_fuse32_t>;
 
 // select which functions on the C-API will be called with specialisations of the function ptrs
 
@@ -32,11 +50,14 @@ template <>
 struct ftype<binary_fuse8_t> {
   static constexpr auto* allocate            = binary_fuse8_allocate;
   static constexpr auto* populate            = binary_fuse8_populate;
+  static constexpr auto* populate_parallel   = native::populate_parallel<binary_fuse8_t>;
   static constexpr auto* contains            = binary_fuse8_contain;
   static constexpr auto* free                = binary_fuse8_free;
   static constexpr auto* serialization_bytes = binary_fuse8_serialization_bytes;
   static constexpr auto* serialize           = binary_fuse8_serialize;
   static constexpr auto* deserialize_header  = binary_fuse8_deserialize_header;
+  static constexpr auto* hash_batch          = binary_fuse8_hash_batch;
+  static constexpr auto* fingerprint         = binary_fuse8_fingerprint;
   using fingerprint_t                        = std::uint8_t;
 };
 
@@ -44,25 +65,421 @@ template <>
 struct ftype<binary_fuse16_t> {
   static constexpr auto* allocate            = binary_fuse16_allocate;
   static constexpr auto* populate            = binary_fuse16_populate;
+  static constexpr auto* populate_parallel   = native::populate_parallel<binary_fuse16_t>;
   static constexpr auto* contains            = binary_fuse16_contain;
   static constexpr auto* free                = binary_fuse16_free;
   static constexpr auto* serialization_bytes = binary_fuse16_serialization_bytes;
   static constexpr auto* serialize           = binary_fuse16_serialize;
   static constexpr auto* deserialize_header  = binary_fuse16_deserialize_header;
+  static constexpr auto* hash_batch          = binary_fuse16_hash_batch;
+  static constexpr auto* fingerprint         = binary_fuse16_fingerprint;
   using fingerprint_t                        = std::uint16_t;
 };
 
+// natively implemented, see native.hpp
+template <>
+struct ftype<binary_fuse32_t> {
+  using fingerprint_t                        = std::uint32_t;
+  static constexpr auto* allocate            = native::allocate<fingerprint_t>;
+  static constexpr auto* populate            = native::populate<fingerprint_t>;
+  static constexpr auto* populate_parallel   = native::populate_parallel<binary_fuse32_t>;
+  static constexpr auto* contains            = native::contains<fingerprint_t>;
+  static constexpr auto* free                = native::free<fingerprint_t>;
+  static constexpr auto* serialization_bytes = native::serialization_bytes<fingerprint_t>;
+  static constexpr auto* serialize           = native::serialize<fingerprint_t>;
+  static constexpr auto* deserialize_header  = native::deserialize_header<fingerprint_t>;
+  static constexpr auto* hash_batch          = native::hash_batch<fingerprint_t>;
+  static constexpr auto* fingerprint         = native::fingerprint<fingerprint_t>;
+};
+
+namespace detail {
+
+// hint that `addr` will be read soon. no-op where unsupported.
+inline void prefetch(const void* addr) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(addr);
+#else
+  (void)addr;
+#endif
+}
+
+} // namespace detail
+
+// how the file mappings of `persistent_filter` and `sharded_filter`
+// sources are treated on load. All options are best effort and are
+// no-ops where the platform does not support them.
+struct map_options {
+  bool random_access  = false; // MADV_RANDOM: no useless readahead on page faults
+  bool huge_pages     = false; // MADV_HUGEPAGE: transparent huge pages, fewer TLB misses
+  bool prefault       = false; // fault in all pages on load, like MAP_POPULATE
+  bool lock           = false; // mlock: pin all pages in RAM
+  bool anonymous_copy = false; // copy file into anonymous (huge page) memory and unmap it
+};
+
+// how `filter::populate` builds very large filters. The upstream
+// filter holds at most 2^32-1 keys. Above `max_part_keys` keys, the
+// filter is transparently partitioned by the high bits of the keys
+// into up to 2^16 sub-filters, ("parts"), which are populated in
+// parallel, as many at once as `threads` and `memory_budget` allow.
+struct populate_options {
+  std::size_t max_part_keys = std::numeric_limits<std::uint32_t>::max();
+  unsigned    threads       = std::thread::hardware_concurrency();
+  std::size_t memory_budget = 0; // bytes, for concurrent part populates. 0 = unlimited
+
+  // from this many keys, and with `threads` > 1, a filter (or part) is
+  // populated with `native::populate_parallel`
+  std::size_t parallel_keys = std::size_t{1} << 22U;
+
+  // conservative upstream populate peak, incl. the partitioned copy of the keys
+  static constexpr std::size_t bytes_per_key = 48;
+};
+
+// how `verify(keys, opts)` checks for false negatives. Keys are
+// checked in batches, with `contains_many`, split over `threads`. With
+// `sample < 1.0`, only a pseudo-random subset of about that fraction
+// of the keys is checked, chosen by a hash of each key's index and
+// `seed`, so that the same subset is checked on every run.
+struct verify_options {
+  unsigned      threads      = std::thread::hardware_concurrency();
+  double        sample       = 1.0; // fraction of keys to check, in (0, 1]
+  std::uint64_t seed         = 0;
+  std::size_t   max_reported = 16; // false negatives to return, in key order
+};
+
+struct verify_result {
+  std::size_t                checked         = 0;
+  std::size_t                false_negatives = 0;
+  std::vector<std::uint64_t> offending; // the first `max_reported` false negatives
+
+  [[nodiscard]] bool ok() const { return false_negatives == 0; }
+  explicit operator bool() const { return ok(); }
+};
+
+namespace detail {
+
+// `query(keys, out)` is a batched `contains`
+template <typename Query>
+verify_result verify_keys(std::span<const std::uint64_t> keys, const verify_options& opts,
+                          const Query& query) {
+  constexpr std::size_t batch = 4096;
+
+  // index sampled if its hash is below this
+  const double        sample    = std::clamp(opts.sample, 0.0, 1.0);
+  const bool          sampled   = sample < 1.0;
+  const std::uint64_t threshold = static_cast<std::uint64_t>(
+      sample * static_cast<double>(std::numeric_limits<std::uint64_t>::max()));
+
+  const auto check = [&](std::size_t begin, std::size_t end) {
+    verify_result             res;
+    std::vector<std::uint64_t> selected;
+    std::vector<std::uint8_t>  found(batch);
+    const auto                 flush = [&] {
+      query(std::span<const std::uint64_t>(selected), std::span(found));
+      for (std::size_t i = 0; i != selected.size(); ++i) {
+        if (found[i] != 0) continue;
+        if (res.offending.size() < opts.max_reported) res.offending.push_back(selected[i]);
+        ++res.false_negatives;
+      }
+      res.checked += selected.size();
+      selected.clear();
+    };
+    selected.reserve(batch);
+    for (std::size_t i = begin; i != end; ++i) {
+      if (sampled && binary_fuse_murmur64(i ^ opts.seed) > threshold) continue;
+      selected.push_back(keys[i]);
+      if (selected.size() == batch) flush();
+    }
+    flush();
+    return res;
+  };
+
+  const std::size_t workers = std::clamp<std::size_t>(opts.threads, 1, keys.size() / batch + 1);
+  std::vector<std::future<verify_result>> futures;
+  for (std::size_t w = 1; w < workers; ++w) {
+    futures.push_back(std::async(std::launch::async, check, keys.size() * w / workers,
+                                 keys.size() * (w + 1) / workers));
+  }
+  auto res = check(0, keys.size() / workers);
+  for (auto& future: futures) { // in key order
+    auto part = future.get();
+    res.checked += part.checked;
+    res.false_negatives += part.false_negatives;
+    for (auto key: part.offending) {
+      if (res.offending.size() < opts.max_reported) res.offending.push_back(key);
+    }
+  }
+  return res;
+}
+
+} // namespace detail
+
+/* binfuse::build_arena
+ *
+ * Reusable memory for populating many filters one after another, eg
+ * the shards of a `sharded_filter`: the populate scratch arrays, the
+ * fingerprints, and a buffer of keys. They only ever grow, so once the
+ * largest filter has been built, further populates allocate nothing,
+ * and touch only warm pages. Use one per thread.
+ *
+ * A filter populated with an arena borrows the arena's fingerprints,
+ * until the arena is next used or destroyed. That suits filters which
+ * are serialized straight after being populated (eg into a sharded
+ * file), and then discarded.
+ */
+class build_arena {
+public:
+  [[nodiscard]] native::scratch& scratch() { return scratch_; }
+
+  // zeroed storage for `count` fingerprints, 8 byte aligned
+  template <native_fingerprint Fingerprint>
+  [[nodiscard]] Fingerprint* fingerprints(std::size_t count) {
+    const std::size_t words = (count * sizeof(Fingerprint) + 7) / 8;
+    fingerprints_.assign(std::max<std::size_t>(words, 1), 0);
+    return reinterpret_cast<Fingerprint*>(fingerprints_.data()); // NOLINT plain storage
+  }
+
+  // for keys, which are buffered before populating
+  [[nodiscard]] std::vector<std::uint64_t>& keys() { return keys_; }
+
+  [[nodiscard]] std::size_t capacity_bytes() const {
+    return scratch_.capacity_bytes() + (fingerprints_.capacity() + keys_.capacity()) * 8;
+  }
+
+private:
+  native::scratch            scratch_;
+  std::vector<std::uint64_t> fingerprints_;
+  std::vector<std::uint64_t> keys_;
+};
+
+namespace detail {
+
+inline void advise(const char* data, std::size_t size, const map_options& opts) {
+  if (data == nullptr || size == 0) return;
+#if defined(__unix__) || defined(__APPLE__)
+  auto* addr = const_cast<char*>(data); // NOLINT madvise/mlock do not modify contents
+#ifdef MADV_HUGEPAGE
+  if (opts.huge_pages) ::madvise(addr, size, MADV_HUGEPAGE);
+#endif
+  if (opts.random_access) ::madvise(addr, size, MADV_RANDOM);
+  if (opts.prefault) {
+    ::madvise(addr, size, MADV_WILLNEED);
+    const auto    page = mio::page_size();
+    volatile char sink = 0;
+    for (std::size_t i = 0; i < size; i += page) {
+      sink = data[i]; // fault it in
+    }
+    (void)sink;
+  }
+  if (opts.lock) ::mlock(addr, size);
+#else
+  (void)opts;
+#endif
+}
+
+/* detail::anonymous_buffer
+ *
+ * Read/write memory not backed by any file, for
+ * `map_options::anonymous_copy`. Prefers explicit huge pages
+ * (MAP_HUGETLB) if requested and reserved by the OS, otherwise uses
+ * ordinary anonymous pages, advised to be transparent huge pages.
+ */
+class anonymous_buffer {
+public:
+  anonymous_buffer() = default;
+  anonymous_buffer(std::size_t size, bool huge_pages) : size_(size) {
+#if defined(__unix__) || defined(__APPLE__)
+    void* addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge_pages) {
+      constexpr std::size_t huge_page_size = 2UL * 1024 * 1024;
+      mapped_size_ = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+      addr         = ::mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (addr == MAP_FAILED) {
+      mapped_size_ = size;
+      addr         = ::mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (addr == MAP_FAILED) {
+        throw std::runtime_error("failed to allocate memory.\n");
+      }
+      advise(static_cast<char*>(addr), mapped_size_, {.huge_pages = huge_pages});
+    }
+    data_ = static_cast<char*>(addr);
+#else
+    (void)huge_pages;
+    data_        = new char[size]; // NOLINT owning raw ptr, to share representation with mmap
+    mapped_size_ = size;
+#endif
+  }
+
+  anonymous_buffer(const anonymous_buffer& other)          = delete;
+  anonymous_buffer& operator=(const anonymous_buffer& rhs) = delete;
+
+  anonymous_buffer(anonymous_buffer&& other) noexcept
+      : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)),
+        mapped_size_(std::exchange(other.mapped_size_, 0)) {}
+  anonymous_buffer& operator=(anonymous_buffer&& rhs) noexcept {
+    if (this != &rhs) {
+      release();
+      data_        = std::exchange(rhs.data_, nullptr);
+      size_        = std::exchange(rhs.size_, 0);
+      mapped_size_ = std::exchange(rhs.mapped_size_, 0);
+    }
+    return *this;
+  }
+
+  ~anonymous_buffer() { release(); }
+
+  [[nodiscard]] char*       data() { return data_; }
+  [[nodiscard]] const char* data() const { return data_; }
+  [[nodiscard]] std::size_t size() const { return size_; }
+  [[nodiscard]] bool        empty() const { return data_ == nullptr; }
+
+private:
+  char*       data_        = nullptr;
+  std::size_t size_        = 0;
+  std::size_t mapped_size_ = 0;
+
+  void release() noexcept {
+    if (data_ == nullptr) return;
+#if defined(__unix__) || defined(__APPLE__)
+    ::munmap(data_, mapped_size_);
+#else
+    delete[] data_; // NOLINT see constructor
+#endif
+    data_ = nullptr;
+  }
+};
+
+} // namespace detail
+
+/* binfuse::serialized_segments
+ *
+ * A filter's serialization as a list of scatter/gather segments, see
+ * `filter::serialize_segments`. The few header bytes are owned by
+ * this object, the bulky fingerprints are referred to in place, so
+ * the filter must outlive it. Concatenating all segments gives
+ * exactly the bytes which `filter::serialize` writes, with any
+ * alignment padding between the parts of a partitioned filter zeroed.
+ */
+class serialized_segments {
+public:
+  // not copyable: a copy's segments would still refer into this
+  // object's owned bytes. Moves keep them, and so the segments, valid.
+  serialized_segments(const serialized_segments& other)            = delete;
+  serialized_segments& operator=(const serialized_segments& other) = delete;
+  serialized_segments(serialized_segments&& other)                 = default;
+  serialized_segments& operator=(serialized_segments&& other)      = default;
+  ~serialized_segments()                                           = default;
+
+  // refers into this object: keep it alive (ie not a temporary) while in use
+  [[nodiscard]] std::span<const std::span<const char>> segments() const { return segments_; }
+
+  [[nodiscard]] std::size_t size() const {
+    std::size_t total = 0;
+    for (const auto& segment: segments_) total += segment.size();
+    return total;
+  }
+
+#if defined(__unix__) || defined(__APPLE__)
+  // for writev, sendmsg, io_uring etc
+  [[nodiscard]] std::vector<iovec> iovecs() const {
+    std::vector<iovec> iovs;
+    iovs.reserve(segments_.size());
+    for (const auto& segment: segments_) {
+      // NOLINTNEXTLINE const_cast: iovec is also used for reading
+      iovs.push_back({const_cast<char*>(segment.data()), segment.size()});
+    }
+    return iovs;
+  }
+
+  // Writes all segments to `fd` (a file, pipe or socket) with writev,
+  // without copying the fingerprints. Retries partial writes and EINTR.
+  void write_to(int fd) const {
+    auto        iovs  = iovecs();
+    std::size_t first = 0;
+    while (first != iovs.size()) {
+      const auto count = static_cast<int>(std::min<std::size_t>(iovs.size() - first, IOV_MAX));
+      const auto written = ::writev(fd, &iovs[first], count);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        throw std::system_error(errno, std::system_category(), "serialized_segments: writev");
+      }
+      auto remaining = static_cast<std::size_t>(written);
+      while (first != iovs.size() && remaining >= iovs[first].iov_len) {
+        remaining -= iovs[first++].iov_len;
+      }
+      if (remaining != 0) {
+        iovs[first].iov_base = static_cast<char*>(iovs[first].iov_base) + remaining;
+        iovs[first].iov_len -= remaining;
+      }
+    }
+  }
+#endif
+
+  // streams all segments, eg to a std::ofstream or socket streambuf
+  void write_to(std::ostream& out) const {
+    for (const auto& segment: segments_) {
+      out.write(segment.data(), static_cast<std::streamsize>(segment.size()));
+    }
+    if (!out) {
+      throw std::runtime_error("serialized_segments: failed to write to stream");
+    }
+  }
+
+private:
+  template <filter_type FilterType, instrumentation_policy Instrument>
+  friend class filter;
+
+  explicit serialized_segments(std::size_t owned_bytes) { owned_.reserve(owned_bytes); }
+
+  // appends owned bytes as a new segment. Never reallocates, see constructor.
+  void add_owned(const void* data, std::size_t size) {
+    const auto start = owned_.size();
+    owned_.resize(start + size);
+    memcpy(&owned_[start], data, size);
+    segments_.emplace_back(&owned_[start], size);
+  }
+
+  void add_external(const char* data, std::size_t size) { segments_.emplace_back(data, size); }
+
+  std::vector<char>                   owned_;
+  std::vector<std::span<const char>> segments_;
+};
+
 /* binfuse::filter
  *
- * wraps a single binary_fuse(8|16)_filter
+ * wraps a single binary_fuse(8|16|32)_filter, or, when populated with
+ * more keys than `populate_options::max_part_keys`, a set of them,
+ * partitioned by the high bits of the keys. The partitioning is
+ * transparent, except that a partitioned filter has its own
+ * serialization format (see `serialize`) and can not be a shard of a
+ * `sharded_filter`.
+ *
+ * `Instrument` is an optional instrumentation policy, see
+ * instrument.hpp, which is a no-op by default.
  */
-template <filter_type FilterType>
+template <filter_type FilterType, instrumentation_policy Instrument = no_instrumentation>
 class filter {
 public:
   static constexpr std::uint32_t nbits = sizeof(typename ftype<FilterType>::fingerprint_t) * 8;
 
+  // number of keys which are hashed and prefetched ahead of being
+  // resolved in `contains_many`
+  static constexpr std::size_t batch_window = 32;
+
+  // the hash of a key and its 3 fingerprint slots, see `probe`/`resolve`
+  struct probe_t {
+    std::uint64_t   hash;
+    binary_hashes_t slots;
+  };
+
   filter() = default;
-  explicit filter(std::span<const std::uint64_t> keys) { populate(keys); }
+  explicit filter(std::span<const std::uint64_t> keys, const populate_options& opts = {}) {
+    populate(keys, opts);
+  }
 
   // accepts an r-value reference of the upstream `binary_fuse(8|16)_filter` object
   // will take ownership of any allocated memory pointed to by the `Fingerprints` member
@@ -76,7 +493,9 @@ public:
   filter& operator=(const filter& rhs) = delete;
 
   filter(filter&& other) noexcept
-      : fil_(other.fil_), skip_free_fingerprints(other.skip_free_fingerprints) {
+      : fil_(other.fil_), skip_free_fingerprints(other.skip_free_fingerprints),
+        parts_(std::move(other.parts_)), part_bits_(other.part_bits_),
+        parts_size_(other.parts_size_), instrument_(other.instrument_) {
     other.fil_.Fingerprints = nullptr; // this object now owns any memory
   }
   filter& operator=(filter&& rhs) noexcept {
@@ -84,49 +503,222 @@ public:
     return *this;
   }
 
-  ~filter() {
-    if (skip_free_fingerprints) {
-      fil_.Fingerprints = nullptr;
-    }
-    ftype<FilterType>::free(&fil_);
-  }
+  ~filter() { release_fingerprints(); }
 
-  void populate(std::span<const std::uint64_t> keys) {
+  void populate(std::span<const std::uint64_t> keys, const populate_options& opts = {}) {
     if (is_populated()) {
       throw std::runtime_error("filter is already populated. You must provide all data at once.");
     }
+    if (keys.size() > std::max<std::size_t>(opts.max_part_keys, 1)) {
+      populate_parts(keys, opts);
+      return;
+    }
 
-    if (!ftype<FilterType>::allocate(static_cast<std::uint32_t>(keys.size()), &fil_)) {
-      throw std::runtime_error("failed to allocate memory.\n");
+    release_fingerprints(); // eg of an empty filter
+    {
+      [[maybe_unused]] const auto scope = instrument_.phase(build_phase::allocate);
+      if (!ftype<FilterType>::allocate(static_cast<std::uint32_t>(keys.size()), &fil_)) {
+        throw std::runtime_error("failed to allocate memory.\n");
+      }
+    }
+    [[maybe_unused]] const auto scope = instrument_.phase(build_phase::populate);
+    const auto                  size  = static_cast<std::uint32_t>(keys.size());
+    if (opts.threads > 1 && keys.size() >= opts.parallel_keys) {
+      if (!ftype<FilterType>::populate_parallel(keys.data(), size, &fil_, opts.threads)) {
+        throw std::runtime_error("failed to populate the filter");
+      }
+      return;
     }
     if (!ftype<FilterType>::populate(
             const_cast<std::uint64_t*>(keys.data()), // NOLINT const_cast until API changed
-            static_cast<std::uint32_t>(keys.size()), &fil_)) {
+            size, &fil_)) {
       throw std::runtime_error("failed to populate the filter");
     }
   }
 
+  // As above, but with all memory from `arena`, which this filter
+  // borrows until the arena is reused, see `build_arena`. Populated
+  // with the native implementation, whose results and format are those
+  // of upstream. Partitioned filters, which are populated in parallel,
+  // do not use the arena.
+  void populate(std::span<const std::uint64_t> keys, build_arena& arena,
+                const populate_options& opts = {}) {
+    if (is_populated()) {
+      throw std::runtime_error("filter is already populated. You must provide all data at once.");
+    }
+    if (keys.size() > std::max<std::size_t>(opts.max_part_keys, 1)) {
+      populate_parts(keys, opts);
+      return;
+    }
+    using fingerprint_t = typename ftype<FilterType>::fingerprint_t;
+    const auto                      size = static_cast<std::uint32_t>(keys.size());
+    binary_fuse_t<fingerprint_t>    fil{};
+    native::layout(size, &fil);
+    {
+      [[maybe_unused]] const auto scope = instrument_.phase(build_phase::allocate);
+      fil.Fingerprints = arena.fingerprints<fingerprint_t>(fil.ArrayLength);
+    }
+    {
+      [[maybe_unused]] const auto scope = instrument_.phase(build_phase::populate);
+      if (!native::populate_reusing(keys.data(), size, &fil, arena.scratch())) {
+        throw std::runtime_error("failed to populate the filter");
+      }
+    }
+    release_fingerprints();
+    fil_.Seed               = fil.Seed;
+    fil_.Size               = fil.Size;
+    fil_.SegmentLength      = fil.SegmentLength;
+    fil_.SegmentLengthMask  = fil.SegmentLengthMask;
+    fil_.SegmentCount       = fil.SegmentCount;
+    fil_.SegmentCountLength = fil.SegmentCountLength;
+    fil_.ArrayLength        = fil.ArrayLength;
+    fil_.Fingerprints       = fil.Fingerprints;
+    skip_free_fingerprints  = true; // owned by the arena
+  }
+
   [[nodiscard]] bool contains(std::uint64_t needle) const {
     if (!is_populated()) {
       throw std::runtime_error("filter is not populated.");
     }
-    return ftype<FilterType>::contains(needle, &fil_);
+    return instrument_.query(0, [this, needle] {
+      if (is_partitioned()) {
+        const auto& part = parts_[part_index(needle)];
+        return part.is_populated() && ftype<FilterType>::contains(needle, &part.fil_);
+      }
+      return ftype<FilterType>::contains(needle, &fil_);
+    });
+  }
+
+  // Batched `contains`: writes 1 to `out[i]` if `keys[i]` is
+  // contained, 0 otherwise. `out` must be at least as large as `keys`.
+  //
+  // Uses the vectorised kernel for `level` (see simd.hpp) where
+  // available. Otherwise, and for any remainder, for each window of
+  // keys, all hashes and fingerprint slots are computed and
+  // prefetched first, and then resolved, so that many cache misses
+  // are in flight at once. Results are identical for all levels.
+  void contains_many(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out,
+                     simd_level level = detect_simd_level()) const {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("contains_many: output span is smaller than keys span.");
+    }
+    if (!is_populated()) {
+      throw std::runtime_error("filter is not populated.");
+    }
+    instrument_.count(0, keys.size());
+    if (is_partitioned()) {
+      contains_many_parts(keys, out);
+      return;
+    }
+    const std::size_t done =
+        detail::contains_many_simd<FilterType, typename ftype<FilterType>::fingerprint_t>(
+            fil_, keys, out, level);
+    std::array<probe_t, batch_window> probes; // NOLINT uninitialised, always written first
+    for (std::size_t base = done; base < keys.size(); base += batch_window) {
+      const auto window = std::min(batch_window, keys.size() - base);
+      for (std::size_t i = 0; i != window; ++i) {
+        probes[i] = probe(keys[base + i]);
+      }
+      for (std::size_t i = 0; i != window; ++i) {
+        out[base + i] = resolve(probes[i]) ? 1 : 0;
+      }
+    }
+  }
+
+  // Low level building blocks of `contains_many`, also used by
+  // `sharded_filter`. `probe` computes the hash and fingerprint slots
+  // of `needle` and prefetches those slots. `resolve` later completes
+  // the query. Neither checks `is_populated()`, and neither may be
+  // used on a partitioned filter.
+  [[nodiscard]] probe_t probe(std::uint64_t needle) const noexcept {
+    const std::uint64_t hash  = binary_fuse_mix_split(needle, fil_.Seed);
+    const auto          slots = ftype<FilterType>::hash_batch(hash, &fil_);
+    detail::prefetch(&fil_.Fingerprints[slots.h0]);
+    detail::prefetch(&fil_.Fingerprints[slots.h1]);
+    detail::prefetch(&fil_.Fingerprints[slots.h2]);
+    return {hash, slots};
+  }
+
+  [[nodiscard]] bool resolve(const probe_t& prb) const noexcept {
+    const auto* fps = fil_.Fingerprints;
+    return (ftype<FilterType>::fingerprint(prb.hash) ^ fps[prb.slots.h0] ^ fps[prb.slots.h1] ^
+            fps[prb.slots.h2]) == 0;
   }
 
   [[nodiscard]] std::size_t size() const {
-    return static_cast<std::size_t>(fil_.Size);
+    return is_partitioned() ? parts_size_ : static_cast<std::size_t>(fil_.Size);
   }
 
   [[nodiscard]] bool is_populated() const { return size() > 0; }
 
+  // true if populated with more than `populate_options::max_part_keys` keys
+  [[nodiscard]] bool is_partitioned() const { return !parts_.empty(); }
+
+  // number of sub-filters, 0 if not partitioned
+  [[nodiscard]] std::size_t parts() const { return parts_.size(); }
+
   [[nodiscard]] std::size_t serialization_bytes() const {
+    if (is_partitioned()) {
+      std::size_t bytes = parts_header_bytes();
+      for (const auto& part: parts_) bytes += align_part(part.serialization_bytes());
+      return bytes;
+    }
     // upstream API should be const
     return ftype<FilterType>::serialization_bytes(const_cast<FilterType*>(&fil_));
   }
 
   // caller provides and owns the buffer. Either malloc'd or a
   // writable mmap, typically.
-  void serialize(char* buffer) const { ftype<FilterType>::serialize(&fil_, buffer); }
+  //
+  // A single filter uses the upstream format. A partitioned one
+  // writes: uint32 part_bits, uint32 reserved (0), a uint64 offset
+  // (from `buffer`) for each part, and then the parts in upstream
+  // format, each 8 byte aligned. Read it back with `deserialize_parts`.
+  void serialize(char* buffer) const {
+    if (!is_partitioned()) {
+      [[maybe_unused]] const auto scope = instrument_.phase(build_phase::serialize);
+      ftype<FilterType>::serialize(&fil_, buffer);
+      return;
+    }
+    const std::uint32_t header[2] = {part_bits_, 0}; // NOLINT c-array for memcpy
+    memcpy(buffer, header, sizeof(header));
+    std::uint64_t offset = parts_header_bytes();
+    for (std::size_t i = 0; i != parts_.size(); ++i) {
+      memcpy(buffer + sizeof(header) + i * sizeof(offset), &offset, sizeof(offset));
+      parts_[i].serialize(buffer + offset);
+      offset += align_part(parts_[i].serialization_bytes());
+    }
+  }
+
+  // Zero copy alternative to `serialize`, eg for sending filters over
+  // the network: see `serialized_segments`.
+  [[nodiscard]] serialized_segments serialize_segments() const {
+    serialized_segments segs(owned_serialization_bytes());
+    append_segments(segs);
+    return segs;
+  }
+
+  // exact number of bytes the filter serialized at `buffer` occupies,
+  // once at least `upstream_header_bytes` are available
+  [[nodiscard]] static std::size_t serialization_bytes_at(const char* buffer) {
+    FilterType fil{};
+    ftype<FilterType>::deserialize_header(&fil, buffer);
+    return ftype<FilterType>::serialization_bytes(&fil);
+  }
+
+  static constexpr std::size_t upstream_header_bytes = 8 + 5 * 4;
+
+  // As `deserialize(const char*)`, eg for a received buffer, but checks
+  // that `buffer` holds the complete (single) filter. The fingerprints
+  // are used in place, and the same lifetime requirements apply.
+  void deserialize(std::span<const char> buffer) {
+    if (buffer.size() < upstream_header_bytes ||
+        buffer.size() < serialization_bytes_at(buffer.data())) {
+      throw std::runtime_error("deserialize: buffer of " + std::to_string(buffer.size()) +
+                               " bytes is too small for the serialized filter");
+    }
+    deserialize(buffer.data());
+  }
 
   // Caller provides and owns the buffer. The lifetime of the buffer
   // must exceed the lifetime of this object.
@@ -150,6 +742,25 @@ public:
     skip_free_fingerprints = true; // do not attempt to free this external buffer (probably an mmap)
   }
 
+  // as `deserialize`, for a buffer written by `serialize` from a
+  // partitioned filter. The same lifetime requirements apply.
+  void deserialize_parts(const char* buffer) {
+    std::uint32_t header[2]; // NOLINT c-array for memcpy
+    memcpy(header, buffer, sizeof(header));
+    if (header[0] == 0 || header[0] > max_part_bits) {
+      throw std::runtime_error("corrupt partitioned filter: part_bits = " +
+                               std::to_string(header[0]));
+    }
+    part_bits_ = static_cast<std::uint8_t>(header[0]);
+    parts_     = std::vector<filter>(std::size_t{1} << part_bits_);
+    for (std::size_t i = 0; i != parts_.size(); ++i) {
+      std::uint64_t offset = 0;
+      memcpy(&offset, buffer + sizeof(header) + i * sizeof(offset), sizeof(offset));
+      parts_[i].deserialize(buffer + offset);
+    }
+    parts_size_ = total_parts_size();
+  }
+
   // Check that each of the provided keys are `contain`ed in the
   // filter. Any false negative, immediately returns false with a
   // message to std::cerr.
@@ -164,17 +775,198 @@ public:
     return true;
   }
 
+  // As above, but batched, optionally parallel and sampled, see
+  // `verify_options`, and reporting all false negatives, rather than
+  // printing the first.
+  [[nodiscard]] verify_result verify(std::span<const std::uint64_t> keys,
+                                     const verify_options& opts) const {
+    if (!is_populated()) {
+      throw std::runtime_error("filter is not populated.");
+    }
+    return detail::verify_keys(keys, opts, [this](auto batch, auto out) {
+      contains_many(batch, out);
+    });
+  }
+
+  [[nodiscard]] const Instrument& instrument() const { return instrument_; }
+
+  // eg to share one `instrumentation` between many filters
+  void set_instrument(Instrument instrument) { instrument_ = std::move(instrument); }
+
 private:
   FilterType fil_{};
   bool       skip_free_fingerprints = false;
+
+  // partitioned filters only
+  std::vector<filter> parts_;
+  std::uint8_t        part_bits_  = 0;
+  std::size_t         parts_size_ = 0;
+
+  [[no_unique_address]] Instrument instrument_;
+
+  static constexpr std::uint8_t max_part_bits = 16;
+
+  // frees the fingerprints, if this filter owns them
+  void release_fingerprints() noexcept {
+    if (skip_free_fingerprints) {
+      fil_.Fingerprints = nullptr;
+    }
+    ftype<FilterType>::free(&fil_);
+    skip_free_fingerprints = false;
+  }
+
+  [[nodiscard]] std::size_t part_index(std::uint64_t key) const {
+    return static_cast<std::size_t>(key >> (sizeof(key) * 8 - part_bits_));
+  }
+
+  [[nodiscard]] std::size_t parts_header_bytes() const {
+    return 2 * sizeof(std::uint32_t) + parts_.size() * sizeof(std::uint64_t);
+  }
+
+  [[nodiscard]] static std::size_t align_part(std::size_t bytes) { return (bytes + 7) & ~7UL; }
+
+  // the upstream header, in upstream `serialize` field order
+  [[nodiscard]] std::array<char, upstream_header_bytes> upstream_header() const {
+    std::array<char, upstream_header_bytes> header{};
+    char*                                   pos = header.data();
+    for (const auto& [field, size]: {std::pair<const void*, std::size_t>{&fil_.Seed, 8},
+                                     {&fil_.Size, 4},
+                                     {&fil_.SegmentLength, 4},
+                                     {&fil_.SegmentCount, 4},
+                                     {&fil_.SegmentCountLength, 4},
+                                     {&fil_.ArrayLength, 4}}) {
+      memcpy(pos, field, size);
+      pos += size;
+    }
+    return header;
+  }
+
+  [[nodiscard]] std::size_t owned_serialization_bytes() const {
+    if (!is_partitioned()) {
+      return upstream_header_bytes;
+    }
+    return parts_header_bytes() + parts_.size() * (upstream_header_bytes + 7); // + padding
+  }
+
+  void append_segments(serialized_segments& segs) const {
+    if (!is_partitioned()) {
+      const auto header = upstream_header();
+      segs.add_owned(header.data(), header.size());
+      segs.add_external(reinterpret_cast<const char*>(fil_.Fingerprints), // NOLINT bytes
+                        serialization_bytes() - upstream_header_bytes);
+      return;
+    }
+    std::vector<char> table(parts_header_bytes()); // as `serialize` writes it
+    const std::uint32_t header[2] = {part_bits_, 0}; // NOLINT c-array for memcpy
+    memcpy(table.data(), header, sizeof(header));
+    std::uint64_t offset = parts_header_bytes();
+    for (std::size_t i = 0; i != parts_.size(); ++i) {
+      memcpy(&table[sizeof(header) + i * sizeof(offset)], &offset, sizeof(offset));
+      offset += align_part(parts_[i].serialization_bytes());
+    }
+    segs.add_owned(table.data(), table.size());
+    static constexpr std::array<char, 8> zeros{};
+    for (const auto& part: parts_) {
+      part.append_segments(segs);
+      const auto bytes = part.serialization_bytes();
+      if (const auto padding = align_part(bytes) - bytes; padding != 0) {
+        segs.add_owned(zeros.data(), padding);
+      }
+    }
+  }
+
+  [[nodiscard]] std::size_t total_parts_size() const {
+    std::size_t total = 0;
+    for (const auto& part: parts_) total += part.size();
+    return total;
+  }
+
+  // Chooses the fewest part_bits for which every part fits
+  // `max_part_keys`, then populates groups of parts concurrently.
+  // Sorted keys are used in place, otherwise each group's keys are
+  // first copied out in one pass over `keys`.
+  void populate_parts(std::span<const std::uint64_t> keys, const populate_options& opts) {
+    const std::size_t        max_part_keys = std::max<std::size_t>(opts.max_part_keys, 1);
+    std::vector<std::size_t> counts;
+    auto bits = static_cast<std::uint8_t>(std::bit_width((keys.size() - 1) / max_part_keys));
+    for (;; ++bits) {
+      if (bits > max_part_bits) {
+        throw std::runtime_error("populate: keys are too skewed to partition into parts of " +
+                                 std::to_string(max_part_keys) + " keys");
+      }
+      part_bits_ = bits;
+      counts.assign(std::size_t{1} << bits, 0);
+      for (auto key: keys) ++counts[part_index(key)];
+      if (*std::max_element(counts.begin(), counts.end()) <= max_part_keys) break;
+    }
+
+    const bool               sorted = std::is_sorted(keys.begin(), keys.end());
+    std::vector<std::size_t> starts(counts.size() + 1);
+    for (std::size_t i = 0; i != counts.size(); ++i) starts[i + 1] = starts[i] + counts[i];
+
+    const std::size_t largest = *std::max_element(counts.begin(), counts.end());
+    std::size_t       group   = std::max(opts.threads, 1U);
+    if (opts.memory_budget != 0) {
+      group = std::clamp<std::size_t>(
+          opts.memory_budget / (largest * populate_options::bytes_per_key + 1), 1, group);
+    }
+
+    std::vector<filter> parts(counts.size());
+    for (auto& part: parts) part.instrument_ = instrument_;
+    for (std::size_t first = 0; first < parts.size(); first += group) {
+      const std::size_t                       last = std::min(parts.size(), first + group);
+      std::vector<std::vector<std::uint64_t>> copies(sorted ? 0 : last - first);
+      if (!sorted) {
+        for (std::size_t i = first; i != last; ++i) copies[i - first].reserve(counts[i]);
+        for (auto key: keys) {
+          if (const auto idx = part_index(key); idx >= first && idx < last) {
+            copies[idx - first].push_back(key);
+          }
+        }
+      }
+      std::vector<std::future<void>> futures;
+      populate_options part_opts = opts; // share the threads between the group
+      part_opts.threads = static_cast<unsigned>(std::max<std::size_t>(opts.threads / group, 1));
+      for (std::size_t i = first; i != last; ++i) {
+        const auto part_keys = sorted ? keys.subspan(starts[i], counts[i])
+                                      : std::span<const std::uint64_t>(copies[i - first]);
+        futures.push_back(std::async(std::launch::async, [&parts, i, part_keys, &part_opts] {
+          parts[i].populate(part_keys, part_opts);
+        }));
+      }
+      for (auto& future: futures) future.get(); // rethrows any populate exception
+    }
+    parts_      = std::move(parts);
+    parts_size_ = total_parts_size();
+  }
+
+  void contains_many_parts(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out) const {
+    // NOLINTBEGIN uninitialised, always written first
+    std::array<const filter*, batch_window> parts;
+    std::array<probe_t, batch_window>       probes;
+    // NOLINTEND
+    for (std::size_t base = 0; base < keys.size(); base += batch_window) {
+      const auto window = std::min(batch_window, keys.size() - base);
+      for (std::size_t i = 0; i != window; ++i) {
+        parts[i] = &parts_[part_index(keys[base + i])];
+        if (parts[i]->is_populated()) probes[i] = parts[i]->probe(keys[base + i]);
+      }
+      for (std::size_t i = 0; i != window; ++i) {
+        out[base + i] = parts[i]->is_populated() && parts[i]->resolve(probes[i]) ? 1 : 0;
+      }
+    }
+  }
 };
 
-template <filter_type FilterType, mio::access_mode AccessMode>
-class persistent_filter : public filter<FilterType> {
+template <filter_type FilterType, mio::access_mode AccessMode,
+          instrumentation_policy Instrument = no_instrumentation>
+class persistent_filter : public filter<FilterType, Instrument> {
 
 public:
-  using filter<FilterType>::filter;
+  using filter<FilterType, Instrument>::filter;
 
+  // save/load handle both single and partitioned filters. Partitioned
+  // ones are tagged "pbinfuseNN", so older versions reject them.
   void save(std::filesystem::path filepath)
     requires(AccessMode == mio::access_mode::write)
   {
@@ -188,20 +980,40 @@ public:
     map_whole_file();
     create_filetag();
     this->serialize(&mmap_[header_length]);
+    [[maybe_unused]] const auto scope = this->instrument().phase(build_phase::sync);
     sync();
   }
 
-  void load(std::filesystem::path filepath)
+  void load(std::filesystem::path filepath, const map_options& opts = {})
     requires(AccessMode == mio::access_mode::read)
   {
+    [[maybe_unused]] const auto scope = this->instrument().faults(fault_site::load);
     filepath_ = std::move(filepath);
     map_whole_file();
-    check_type_id();
-    this->deserialize(&mmap_[header_length]);
+    const bool partitioned = has_partitioned_tag();
+    if (!partitioned) {
+      check_type_id();
+    }
+    const char* data = mmap_.data();
+    if (opts.anonymous_copy) {
+      anon_copy_ = detail::anonymous_buffer(mmap_.size(), opts.huge_pages);
+      memcpy(anon_copy_.data(), mmap_.data(), mmap_.size());
+      mmap_.unmap();
+      data = anon_copy_.data();
+      detail::advise(anon_copy_.data(), anon_copy_.size(), opts);
+    } else {
+      detail::advise(mmap_.data(), mmap_.size(), opts);
+    }
+    if (partitioned) {
+      this->deserialize_parts(&data[header_length]);
+    } else {
+      this->deserialize(&data[header_length]);
+    }
   }
 
 private:
   mio::basic_mmap<AccessMode, char> mmap_;
+  detail::anonymous_buffer          anon_copy_; // map_options::anonymous_copy only
   std::filesystem::path             filepath_;
 
   using offset_t = std::size_t;
@@ -275,15 +1087,21 @@ private:
     return existing_filesize;
   }
 
+  [[nodiscard]] bool has_partitioned_tag() const {
+    const auto tid = "p" + type_id();
+    return mmap_.size() >= header_length && get_str_from_map(0, tid.size()) == tid;
+  }
+
   void create_filetag()
     requires(AccessMode == mio::access_mode::write)
   {
-    copy_str_to_map(type_id(), 0);
+    copy_str_to_map(this->is_partitioned() ? "p" + type_id() : type_id(), 0);
   }
 };
 
 using filter8  = filter<binary_fuse8_t>;
 using filter16 = filter<binary_fuse16_t>;
+using filter32 = filter<binary_fuse32_t>;
 
 using filter8_sink   = persistent_filter<binary_fuse8_t, mio::access_mode::write>;
 using filter8_source = persistent_filter<binary_fuse8_t, mio::access_mode::read>;
@@ -291,4 +1109,7 @@ using filter8_source = persistent_filter<binary_fuse8_t, mio::access_mode::read>
 using filter16_sink   = persistent_filter<binary_fuse16_t, mio::access_mode::write>;
 using filter16_source = persistent_filter<binary_fuse16_t, mio::access_mode::read>;
 
+using filter32_sink   = persistent_filter<binary_fuse32_t, mio::access_mode::write>;
+using filter32_source = persistent_filter<binary_fuse32_t, mio::access_mode::read>;
+
 } // namespace binfuse
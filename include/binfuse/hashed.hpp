@@ -0,0 +1,292 @@
+#pragma once
+
+#include "binaryfusefilter.h"
+#include "binfuse/filter.hpp"
+#include "binfuse/simd.hpp"
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/* binfuse::fast_hash and binfuse::hashed_filter
+ *
+ * The filters take `uint64_t` keys, and `sharded_filter` shards them
+ * by their top bits, so the keys must already be well distributed
+ * hashes. `hashed_filter` is a front-end for any other keys, eg
+ * strings or sequential ids: it hashes them with a `Hasher` and
+ * forwards to the wrapped filter.
+ *
+ * The default `fast_hash` hashes integers with the murmur finalizer (a
+ * bijection, so distinct integers never collide) and strings 8 bytes
+ * at a time, followed by the same finalizer. It is fast, but not
+ * cryptographic, nor resistant to chosen keys. For integers, its
+ * `hash_many` runs 4 (AVX2) or 8 (AVX-512) keys at once, selected at
+ * runtime like `filter::contains_many`, with identical results to the
+ * single key `operator()`.
+ *
+ * `hashed_filter::contains_many` hashes and queries each batch of keys
+ * in one pass, in blocks small enough for the hashes to stay in L1.
+ *
+ * Any other hasher needs `operator()(const Key&) -> uint64_t`, and
+ * optionally a batched `hash_many(std::span<const Key>,
+ * std::span<std::uint64_t>)`. It must be the same for building and
+ * querying, so a hasher with a seed must be given the same seed.
+ */
+namespace binfuse {
+
+template <typename Hasher, typename Key>
+concept key_hasher = requires(const Hasher& hasher, const Key& key) {
+  { hasher(key) } -> std::convertible_to<std::uint64_t>;
+};
+
+template <typename Hasher, typename Key>
+concept batch_key_hasher =
+    key_hasher<Hasher, Key> &&
+    requires(const Hasher& hasher, std::span<const Key> keys, std::span<std::uint64_t> out) {
+      hasher.hash_many(keys, out);
+    };
+
+template <typename Key>
+concept string_key = std::convertible_to<const Key&, std::string_view>;
+
+namespace detail {
+
+inline constexpr std::uint64_t hash_length_mult = 0x9E3779B97F4A7C15ULL;
+inline constexpr std::uint64_t hash_word_mult   = 0xBF58476D1CE4E5B9ULL;
+
+// word `idx` of `key`, little endian, with the last one zero padded.
+// Keys of 8 bytes or more read the last word as the last 8 bytes,
+// shifted, so that every word is one load, without branches.
+[[nodiscard]] inline std::uint64_t hash_word(std::string_view key, std::size_t idx) noexcept {
+  std::uint64_t word = 0;
+  if (key.size() < 8) {
+    memcpy(&word, key.data(), key.size()); // idx is 0
+    return word;
+  }
+  const std::size_t offset = std::min(idx * 8, key.size() - 8);
+  memcpy(&word, key.data() + offset, 8);
+  return word >> ((idx * 8 - offset) * 8);
+}
+
+[[nodiscard]] inline std::size_t hash_words(std::string_view key) noexcept {
+  return (key.size() + 7) / 8;
+}
+
+[[nodiscard]] inline std::uint64_t hash_string(std::string_view key, std::uint64_t seed) noexcept {
+  std::uint64_t hash = seed ^ (key.size() * hash_length_mult);
+  for (std::size_t i = 0; i != hash_words(key); ++i) {
+    hash = (hash ^ hash_word(key, i)) * hash_word_mult;
+    hash ^= hash >> 29;
+  }
+  return binary_fuse_murmur64(hash);
+}
+
+#ifdef BINFUSE_SIMD_X86
+
+__attribute__((target("avx2"))) inline __m256i murmur64_avx2(__m256i hash) {
+  hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+  hash = mullo64_avx2(hash, _mm256_set1_epi64x(static_cast<long long>(0xff51afd7ed558ccdULL)));
+  hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+  hash = mullo64_avx2(hash, _mm256_set1_epi64x(static_cast<long long>(0xc4ceb9fe1a85ec53ULL)));
+  return _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+}
+
+__attribute__((target("avx512f,avx512dq"))) inline __m512i murmur64_avx512(__m512i hash) {
+  hash = _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 33));
+  hash = _mm512_mullo_epi64(hash, _mm512_set1_epi64(static_cast<long long>(0xff51afd7ed558ccdULL)));
+  hash = _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 33));
+  hash = _mm512_mullo_epi64(hash, _mm512_set1_epi64(static_cast<long long>(0xc4ceb9fe1a85ec53ULL)));
+  return _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 33));
+}
+
+// processes keys in blocks of 4, returns number of keys processed
+__attribute__((target("avx2"))) inline std::size_t
+hash_ints_avx2(const std::uint64_t* keys, std::uint64_t* out, std::size_t count,
+               std::uint64_t seed) {
+  const __m256i vseed = _mm256_set1_epi64x(static_cast<long long>(seed));
+  std::size_t   i     = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m256i key = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),                           // NOLINT
+                        murmur64_avx2(_mm256_add_epi64(key, vseed)));
+  }
+  return i;
+}
+
+__attribute__((target("avx512f,avx512dq"))) inline std::size_t
+hash_ints_avx512(const std::uint64_t* keys, std::uint64_t* out, std::size_t count,
+                 std::uint64_t seed) {
+  const __m512i vseed = _mm512_set1_epi64(static_cast<long long>(seed));
+  std::size_t   i     = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm512_storeu_si512(out + i, murmur64_avx512(_mm512_add_epi64(_mm512_loadu_si512(keys + i),
+                                                                  vseed)));
+  }
+  return i;
+}
+
+#endif // BINFUSE_SIMD_X86
+
+// As `contains_many_simd`: runs the best (or the given) kernel over a
+// prefix of `keys`, and returns how many keys were processed.
+[[nodiscard]] inline std::size_t hash_ints_simd(std::span<const std::uint64_t> keys,
+                                                std::span<std::uint64_t> out, std::uint64_t seed,
+                                                simd_level level = detect_simd_level()) {
+#ifdef BINFUSE_SIMD_X86
+  if (level == simd_level::avx512) {
+    return hash_ints_avx512(keys.data(), out.data(), keys.size(), seed);
+  }
+  if (level == simd_level::avx2) {
+    return hash_ints_avx2(keys.data(), out.data(), keys.size(), seed);
+  }
+#endif
+  (void)keys;
+  (void)out;
+  (void)seed;
+  (void)level;
+  return 0;
+}
+
+} // namespace detail
+
+struct fast_hash {
+  std::uint64_t seed = 0x5851F42D4C957F2DULL;
+
+  template <std::integral Key>
+  [[nodiscard]] std::uint64_t operator()(Key key) const noexcept {
+    return binary_fuse_murmur64(static_cast<std::uint64_t>(key) + seed);
+  }
+
+  template <string_key Key>
+    requires(!std::integral<Key>)
+  [[nodiscard]] std::uint64_t operator()(const Key& key) const noexcept {
+    return detail::hash_string(std::string_view(key), seed);
+  }
+
+  // `out.size()` must be at least `keys.size()`
+  void hash_many(std::span<const std::uint64_t> keys, std::span<std::uint64_t> out,
+                 simd_level level = detect_simd_level()) const noexcept {
+    for (auto i = detail::hash_ints_simd(keys, out, seed, level); i != keys.size(); ++i) {
+      out[i] = (*this)(keys[i]);
+    }
+  }
+
+  // a plain loop: the cpu already overlaps the hashes of successive
+  // keys, which are bound by loading their words
+  template <string_key Key>
+  void hash_many(std::span<const Key> keys, std::span<std::uint64_t> out) const noexcept {
+    for (std::size_t i = 0; i != keys.size(); ++i) out[i] = (*this)(keys[i]);
+  }
+};
+
+/* binfuse::hashed_filter
+ *
+ * Wraps a `filter`, a `sharded_filter` or an `adaptive_sharded_filter`
+ * and takes keys of any type which `Hasher` can hash:
+ *
+ *     binfuse::hashed_filter<binfuse::filter8> fil;
+ *     fil.populate(strings);     // eg a std::vector<std::string>
+ *     fil.contains("needle");
+ *
+ *     binfuse::hashed_filter sink(binfuse::sharded_filter8_sink("f.bin", 8));
+ *     sink.populate(strings);    // hashed, sorted, deduplicated and `add_sorted`
+ *
+ * The wrapped filter is still available from `filter()`, eg to
+ * `save()` it, but must then be queried with the same hashes.
+ */
+template <typename Filter, typename Hasher = fast_hash>
+class hashed_filter {
+public:
+  hashed_filter() = default;
+  explicit hashed_filter(Filter filter, Hasher hasher = {})
+      : filter_(std::move(filter)), hasher_(std::move(hasher)) {}
+
+  template <typename Key>
+    requires key_hasher<Hasher, Key>
+  [[nodiscard]] std::uint64_t hash(const Key& key) const {
+    return static_cast<std::uint64_t>(hasher_(key));
+  }
+
+  template <typename Key>
+    requires key_hasher<Hasher, Key>
+  void hash_many(std::span<const Key> keys, std::span<std::uint64_t> out) const {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("hash_many: output span is smaller than keys span.");
+    }
+    if constexpr (batch_key_hasher<Hasher, Key>) {
+      hasher_.hash_many(keys, out);
+    } else {
+      for (std::size_t i = 0; i != keys.size(); ++i) out[i] = hash(keys[i]);
+    }
+  }
+
+  // Hashes all `keys` and builds the filter from the hashes, which are
+  // sorted and deduplicated first, as equal keys give equal hashes.
+  template <std::ranges::contiguous_range Keys>
+  void populate(const Keys& keys) {
+    using key_t = std::ranges::range_value_t<Keys>;
+    const std::span<const key_t> key_span(std::ranges::data(keys), std::ranges::size(keys));
+    std::vector<std::uint64_t>   hashes(key_span.size());
+    hash_many(key_span, std::span(hashes));
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+    const std::span<const std::uint64_t> sorted(hashes);
+
+    if constexpr (requires { filter_.populate(sorted); }) {
+      filter_.populate(sorted);
+    } else if constexpr (requires { filter_.add_sorted(sorted); }) {
+      filter_.add_sorted(sorted);
+    } else {
+      filter_.build(sorted);
+    }
+  }
+
+  template <typename Key>
+    requires key_hasher<Hasher, Key>
+  [[nodiscard]] bool contains(const Key& key) const {
+    return filter_.contains(hash(key));
+  }
+
+  // hashes and queries `keys` in blocks of `block_size`
+  template <typename Key>
+    requires key_hasher<Hasher, Key>
+  void contains_many(std::span<const Key> keys, std::span<std::uint8_t> out) const {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("contains_many: output span is smaller than keys span.");
+    }
+    std::array<std::uint64_t, block_size> hashes; // NOLINT uninitialised, always written first
+    for (std::size_t base = 0; base < keys.size(); base += block_size) {
+      const auto block = keys.subspan(base, std::min(block_size, keys.size() - base));
+      hash_many(block, std::span(hashes).first(block.size()));
+      filter_.contains_many(std::span<const std::uint64_t>(hashes).first(block.size()),
+                            out.subspan(base, block.size()));
+    }
+  }
+
+  template <std::ranges::contiguous_range Keys>
+  void contains_many(const Keys& keys, std::span<std::uint8_t> out) const {
+    using key_t = std::ranges::range_value_t<Keys>;
+    contains_many(std::span<const key_t>(std::ranges::data(keys), std::ranges::size(keys)), out);
+  }
+
+  [[nodiscard]] Filter&       filter() { return filter_; }
+  [[nodiscard]] const Filter& filter() const { return filter_; }
+  [[nodiscard]] const Hasher& hasher() const { return hasher_; }
+
+  // 8kB of hashes
+  static constexpr std::size_t block_size = 1024;
+
+private:
+  Filter                       filter_;
+  [[no_unique_address]] Hasher hasher_;
+};
+
+} // namespace binfuse
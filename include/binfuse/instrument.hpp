@@ -0,0 +1,332 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BINFUSE_HAS_RDTSC
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define BINFUSE_HAS_RDTSC
+#endif
+
+namespace binfuse {
+
+/* binfuse::instrumentation policies
+ *
+ * The last template parameter of `filter`, `persistent_filter` and
+ * `sharded_filter`. The default, `no_instrumentation`, is an empty
+ * type whose hooks are all empty inline functions, so an
+ * uninstrumented filter compiles to identical code.
+ *
+ * `instrumentation` records:
+ *  - query counts per shard (one "shard" for a `filter`)
+ *  - latencies of every `sample_every`th single-key query, per thread,
+ *    in ticks (TSC cycles on x86, otherwise nanoseconds), in a log2
+ *    histogram
+ *  - wall time of the build phases: allocate, populate, serialize and
+ *    sync. Phases which run on several threads are summed.
+ *  - minor/major page fault deltas of the calling thread across
+ *    `load()` and `add_shard`, ie the mmap faults
+ *
+ * It is a cheap, shared handle to atomic counters, so the read path
+ * stays thread-safe, and one handle can be shared between many
+ * filters, see `set_instrument`. Per-shard counters are contended
+ * between threads querying the same shard; see `query_stats` for
+ * uncontended per-thread counts. `snapshot()` copies all counters out,
+ * eg for a metrics exporter.
+ */
+
+enum class build_phase : std::uint8_t { allocate, populate, serialize, sync };
+enum class fault_site : std::uint8_t { load, add_shard };
+
+inline constexpr std::size_t build_phases = 4;
+inline constexpr std::size_t fault_sites  = 2;
+
+[[nodiscard]] constexpr std::string_view name(build_phase phase) {
+  constexpr std::array<std::string_view, build_phases> names{"allocate", "populate", "serialize",
+                                                             "sync"};
+  return names[static_cast<std::size_t>(phase)];
+}
+
+[[nodiscard]] constexpr std::string_view name(fault_site site) {
+  return site == fault_site::load ? "load" : "add_shard";
+}
+
+template <typename T>
+concept instrumentation_policy = requires(T& ins, const T& cins, std::uint32_t shard) {
+  { T::enabled } -> std::convertible_to<bool>;
+  ins.shards(std::size_t{});
+  cins.count(shard);
+  cins.count(shard, std::size_t{});
+  { cins.query(shard, [] { return true; }) } -> std::same_as<bool>;
+  cins.phase(build_phase::populate);
+  cins.faults(fault_site::load);
+};
+
+struct no_instrumentation {
+  static constexpr bool enabled = false;
+
+  struct scope {};
+
+  void shards(std::size_t /* count */) noexcept {}
+  void count(std::uint32_t /* shard */, std::size_t /* queries */ = 1) const noexcept {}
+
+  template <typename Query>
+  [[nodiscard]] bool query(std::uint32_t /* shard */, Query&& run) const {
+    return run();
+  }
+
+  [[nodiscard]] scope phase(build_phase /* phase */) const noexcept { return {}; }
+  [[nodiscard]] scope faults(fault_site /* site */) const noexcept { return {}; }
+};
+
+namespace detail {
+
+[[nodiscard]] inline std::uint64_t ticks() noexcept {
+#ifdef BINFUSE_HAS_RDTSC
+  return __rdtsc();
+#else
+  return static_cast<std::uint64_t>(
+      std::chrono::steady_clock::now().time_since_epoch() / std::chrono::nanoseconds(1));
+#endif
+}
+
+struct fault_counts {
+  std::uint64_t minor = 0;
+  std::uint64_t major = 0;
+};
+
+// of this thread, where the OS says so, else of the process
+[[nodiscard]] inline fault_counts current_faults() noexcept {
+#if defined(__unix__) || defined(__APPLE__)
+  rusage usage{};
+#ifdef RUSAGE_THREAD
+  ::getrusage(RUSAGE_THREAD, &usage);
+#else
+  ::getrusage(RUSAGE_SELF, &usage);
+#endif
+  return {static_cast<std::uint64_t>(usage.ru_minflt), static_cast<std::uint64_t>(usage.ru_majflt)};
+#else
+  return {};
+#endif
+}
+
+} // namespace detail
+
+struct instrumentation_snapshot {
+  struct phase_stats {
+    std::uint64_t count = 0;
+    std::uint64_t nanos = 0;
+  };
+  struct fault_stats {
+    std::uint64_t calls        = 0;
+    std::uint64_t minor_faults = 0;
+    std::uint64_t major_faults = 0;
+  };
+
+  static constexpr std::size_t latency_buckets = 64;
+
+  std::uint64_t                                queries = 0; // sum of `shard_queries`
+  std::vector<std::uint64_t>                   shard_queries;
+  std::array<phase_stats, build_phases>        phases{};
+  std::array<fault_stats, fault_sites>         faults{};
+  std::uint32_t                                sample_every = 0;
+  std::array<std::uint64_t, latency_buckets>   latency{}; // [i]: sampled in [2^i, 2^(i+1)) ticks
+
+  [[nodiscard]] const phase_stats& phase(build_phase ph) const {
+    return phases[static_cast<std::size_t>(ph)];
+  }
+
+  [[nodiscard]] const fault_stats& fault(fault_site site) const {
+    return faults[static_cast<std::size_t>(site)];
+  }
+
+  [[nodiscard]] std::uint64_t latency_samples() const {
+    std::uint64_t total = 0;
+    for (auto count: latency) total += count;
+    return total;
+  }
+
+  // upper bound, in ticks, of the bucket holding the `q` quantile, or 0
+  // if nothing was sampled
+  [[nodiscard]] std::uint64_t latency_percentile(double q) const {
+    const auto    total = latency_samples();
+    const auto    rank  = static_cast<std::uint64_t>(q * static_cast<double>(total));
+    std::uint64_t seen  = 0;
+    for (std::size_t i = 0; i != latency.size(); ++i) {
+      seen += latency[i];
+      if (seen != 0 && seen > rank) return (std::uint64_t{2} << i) - 1;
+    }
+    return 0;
+  }
+
+  // unit of the latency histogram
+  [[nodiscard]] static constexpr std::string_view tick_unit() {
+#ifdef BINFUSE_HAS_RDTSC
+    return "cycles";
+#else
+    return "ns";
+#endif
+  }
+};
+
+class instrumentation {
+  struct state;
+
+public:
+  static constexpr bool enabled = true;
+
+  explicit instrumentation(std::uint32_t sample_every = 1024)
+      : state_(std::make_shared<state>(std::max(sample_every, 1U))) {}
+
+  class phase_scope {
+  public:
+    phase_scope(const phase_scope&)            = delete;
+    phase_scope& operator=(const phase_scope&) = delete;
+    phase_scope(phase_scope&&)                 = delete;
+    phase_scope& operator=(phase_scope&&)      = delete;
+    ~phase_scope() {
+      const auto nanos = (std::chrono::steady_clock::now() - start_) / std::chrono::nanoseconds(1);
+      auto&      stats = state_->phases[static_cast<std::size_t>(phase_)];
+      stats.count.fetch_add(1, std::memory_order_relaxed);
+      stats.nanos.fetch_add(static_cast<std::uint64_t>(nanos), std::memory_order_relaxed);
+    }
+
+  private:
+    friend class instrumentation;
+    state*                                state_;
+    build_phase                           phase_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+
+    phase_scope(state* st, build_phase phase) : state_(st), phase_(phase) {}
+  };
+
+  class fault_scope {
+  public:
+    fault_scope(const fault_scope&)            = delete;
+    fault_scope& operator=(const fault_scope&) = delete;
+    fault_scope(fault_scope&&)                 = delete;
+    fault_scope& operator=(fault_scope&&)      = delete;
+    ~fault_scope() {
+      const auto end   = detail::current_faults();
+      auto&      stats = state_->faults[static_cast<std::size_t>(site_)];
+      stats.calls.fetch_add(1, std::memory_order_relaxed);
+      stats.minor.fetch_add(end.minor - start_.minor, std::memory_order_relaxed);
+      stats.major.fetch_add(end.major - start_.major, std::memory_order_relaxed);
+    }
+
+  private:
+    friend class instrumentation;
+    state*               state_;
+    fault_site           site_;
+    detail::fault_counts start_ = detail::current_faults();
+
+    fault_scope(state* st, fault_site site) : state_(st), site_(site) {}
+  };
+
+  // sizes the per-shard counters, discarding their counts. Not
+  // thread-safe: called on load, before any queries.
+  void shards(std::size_t count) {
+    if (count == state_->shard_count) return;
+    state_->shard_count   = std::max<std::size_t>(count, 1);
+    state_->shard_queries = std::make_unique<std::atomic<std::uint64_t>[]>(state_->shard_count);
+  }
+
+  void count(std::uint32_t shard, std::size_t queries = 1) const noexcept {
+    if (shard < state_->shard_count) {
+      state_->shard_queries[shard].fetch_add(queries, std::memory_order_relaxed);
+    }
+  }
+
+  // counts the query and times it, if it is this thread's
+  // `sample_every`th
+  template <typename Query>
+  [[nodiscard]] bool query(std::uint32_t shard, Query&& run) const {
+    count(shard);
+    thread_local std::uint32_t countdown = 0;
+    if (countdown-- != 0) {
+      return run();
+    }
+    countdown        = state_->sample_every - 1;
+    const auto start = detail::ticks();
+    const bool found = run();
+    const auto end   = detail::ticks();
+    const auto delta = end > start ? end - start : 1;
+    state_->latency[static_cast<std::size_t>(std::bit_width(delta) - 1)].fetch_add(
+        1, std::memory_order_relaxed);
+    return found;
+  }
+
+  [[nodiscard]] phase_scope phase(build_phase ph) const { return {state_.get(), ph}; }
+  [[nodiscard]] fault_scope faults(fault_site site) const { return {state_.get(), site}; }
+
+  // a consistent copy of each counter, though not of all of them
+  // together, while other threads are still recording
+  [[nodiscard]] instrumentation_snapshot snapshot() const {
+    instrumentation_snapshot snap;
+    snap.sample_every = state_->sample_every;
+    snap.shard_queries.resize(state_->shard_count);
+    for (std::size_t i = 0; i != state_->shard_count; ++i) {
+      snap.shard_queries[i] = state_->shard_queries[i].load(std::memory_order_relaxed);
+      snap.queries += snap.shard_queries[i];
+    }
+    for (std::size_t i = 0; i != build_phases; ++i) {
+      snap.phases[i] = {state_->phases[i].count.load(std::memory_order_relaxed),
+                        state_->phases[i].nanos.load(std::memory_order_relaxed)};
+    }
+    for (std::size_t i = 0; i != fault_sites; ++i) {
+      snap.faults[i] = {state_->faults[i].calls.load(std::memory_order_relaxed),
+                        state_->faults[i].minor.load(std::memory_order_relaxed),
+                        state_->faults[i].major.load(std::memory_order_relaxed)};
+    }
+    for (std::size_t i = 0; i != snap.latency.size(); ++i) {
+      snap.latency[i] = state_->latency[i].load(std::memory_order_relaxed);
+    }
+    return snap;
+  }
+
+private:
+  struct state {
+    explicit state(std::uint32_t every) : sample_every(every) {}
+
+    struct phase_counters {
+      std::atomic<std::uint64_t> count{0};
+      std::atomic<std::uint64_t> nanos{0};
+    };
+    struct fault_counters {
+      std::atomic<std::uint64_t> calls{0};
+      std::atomic<std::uint64_t> minor{0};
+      std::atomic<std::uint64_t> major{0};
+    };
+
+    std::uint32_t                                 sample_every;
+    std::size_t                                   shard_count = 1;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> shard_queries = // NOLINT c-array of atomics
+        std::make_unique<std::atomic<std::uint64_t>[]>(1);        // NOLINT
+    std::array<phase_counters, build_phases> phases;
+    std::array<fault_counters, fault_sites>  faults;
+    std::array<std::atomic<std::uint64_t>, instrumentation_snapshot::latency_buckets> latency{};
+  };
+
+  std::shared_ptr<state> state_;
+};
+
+static_assert(instrumentation_policy<no_instrumentation>);
+static_assert(instrumentation_policy<instrumentation>);
+
+} // namespace binfuse
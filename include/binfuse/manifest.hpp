@@ -0,0 +1,389 @@
+#pragma once
+
+#include "binfuse/filter.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include "mio/mmap.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace binfuse {
+
+// one shard of a `manifest`: the keys with top `shard_bits` bits of
+// `prefix` are in the `persistent_filter` file (or object) `name`,
+// of `bytes` bytes
+struct manifest_entry {
+  std::uint32_t  prefix = 0;
+  std::uintmax_t bytes  = 0;
+  std::string    name; // relative to the manifest's directory, unless resolved otherwise
+
+  bool operator==(const manifest_entry& rhs) const = default;
+};
+
+/* binfuse::manifest
+ *
+ * The index of a multi-file sharded filter: a small text file, eg
+ *
+ *     mbinfuse08-v001
+ *     shard_bits 8
+ *     00 1234567 filter.00.bin
+ *     2a 1234511 filter.2a.bin
+ *
+ * ie a type tag, the shard bits, and then one line per non empty
+ * shard, with its prefix in hex, its file's size (so that truncated
+ * copies are detected) and its name, which is the rest of the line.
+ * Each shard file is an ordinary `persistent_filter` file, eg from
+ * `filter8_sink::save`, so shards can be built anywhere, and a filter
+ * is assembled by writing only its manifest.
+ */
+struct manifest {
+  std::uint32_t               nbits      = 8;
+  std::uint8_t                shard_bits = 8;
+  std::vector<manifest_entry> shards; // ascending prefix, see `add`
+
+  static constexpr std::uint8_t max_shard_bits = 16; // one file per shard: 64K at most
+
+  [[nodiscard]] static std::string type_id(std::uint32_t nbits) {
+    std::stringstream tag;
+    tag << "mbinfuse" << std::setfill('0') << std::setw(2) << nbits << "-v001";
+    return tag.str();
+  }
+
+  [[nodiscard]] std::uint32_t max_shards() const { return std::uint32_t{1} << shard_bits; }
+
+  // keeps `shards` ordered. Throws on a duplicate or out of range prefix.
+  void add(manifest_entry entry) {
+    if (entry.prefix >= max_shards()) {
+      throw std::runtime_error("manifest: prefix " + std::to_string(entry.prefix) +
+                               " is out of range for shard_bits = " + std::to_string(shard_bits));
+    }
+    auto pos = std::lower_bound(shards.begin(), shards.end(), entry.prefix,
+                                [](const auto& lhs, auto prefix) { return lhs.prefix < prefix; });
+    if (pos != shards.end() && pos->prefix == entry.prefix) {
+      throw std::runtime_error("manifest: duplicate shard for prefix " +
+                               std::to_string(entry.prefix));
+    }
+    shards.insert(pos, std::move(entry));
+  }
+
+  [[nodiscard]] static manifest read(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    if (!file) {
+      throw std::runtime_error("manifest: can not open '" + path.string() + "'");
+    }
+    manifest    result;
+    std::string line;
+    std::getline(file, line);
+    if (line.size() != type_id(0).size() || !line.starts_with("mbinfuse") ||
+        !line.ends_with("-v001")) {
+      throw std::runtime_error("manifest: incorrect type_id: found: " + line);
+    }
+    result.nbits = static_cast<std::uint32_t>(std::stoul(line.substr(8, 2)));
+
+    std::string key;
+    unsigned    bits = 0;
+    if (!std::getline(file, line) || !(std::istringstream(line) >> key >> bits) ||
+        key != "shard_bits" || bits == 0 || bits > max_shard_bits) {
+      throw std::runtime_error("manifest: missing or invalid shard_bits: " + line);
+    }
+    result.shard_bits = static_cast<std::uint8_t>(bits);
+
+    while (std::getline(file, line)) {
+      if (line.empty()) continue;
+      std::istringstream fields(line);
+      manifest_entry     entry;
+      fields >> std::hex >> entry.prefix >> std::dec >> entry.bytes;
+      if (fields) std::getline(fields >> std::ws, entry.name);
+      if (entry.name.empty()) {
+        throw std::runtime_error("manifest: corrupt shard line: " + line);
+      }
+      result.add(std::move(entry));
+    }
+    return result;
+  }
+
+  // atomically, via a temporary file and a rename, so readers never see
+  // a half written manifest. The file is synced before, and its
+  // directory after, the rename, so that it is also durable.
+  void write(const std::filesystem::path& path) const {
+    std::ostringstream text;
+    text << type_id(nbits) << '\n' << "shard_bits " << unsigned{shard_bits} << '\n';
+    const auto width = (shard_bits + 3) / 4;
+    for (const auto& entry: shards) {
+      text << std::hex << std::setfill('0') << std::setw(width) << entry.prefix << std::dec << ' '
+           << entry.bytes << ' ' << entry.name << '\n';
+    }
+    const auto contents = text.str();
+
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+    {
+      detail::file_appender file(tmp_path);
+      file.append(contents.data(), contents.size());
+      file.sync();
+    }
+    std::filesystem::rename(tmp_path, path);
+    detail::sync_directory(path);
+  }
+};
+
+// maps a manifest entry's name to a local file, eg after downloading
+// the object of that name. Called at most once per shard, possibly
+// concurrently for different shards.
+using shard_resolver = std::function<std::filesystem::path(const std::string& name)>;
+
+/* binfuse::manifest_sharded_filter
+ *
+ * A sharded filter, like `sharded_filter`, but with each shard in its
+ * own `persistent_filter` file, listed in a `manifest`, rather than
+ * all in one file. Very large filters then need no single huge file
+ * (nor a resize of it per shard), and can be built on many machines:
+ * each builds and saves its shards' filters, and they are assembled
+ * by writing the manifest alone, with `add_shard_file`.
+ *
+ * Sinks: `add_shard` populates and saves a shard's file next to the
+ * manifest, and rewrites the manifest. An existing manifest is
+ * appended to.
+ *
+ * Sources: shard files are checked against their manifest size, and
+ * mapped, all on load (eager), or each on its first query (lazy),
+ * exactly once and thread safely, as `sharded_filter`. A
+ * `shard_resolver` maps names to local files, eg fetching remote
+ * objects, so that a lazy source only downloads the shards it is
+ * queried on, and `load_all` fetches them all, in parallel.
+ *
+ * Thread safety: as `sharded_filter`.
+ */
+template <filter_type FilterType, mio::access_mode AccessMode>
+class manifest_sharded_filter {
+public:
+  using shard_filter_t = persistent_filter<FilterType, AccessMode>;
+
+  static constexpr std::uint32_t nbits = sizeof(typename ftype<FilterType>::fingerprint_t) * 8;
+
+  // sinks: `shard_bits` for a new manifest, or must match the existing one
+  explicit manifest_sharded_filter(std::filesystem::path path, std::uint8_t shard_bits = 8)
+    requires(AccessMode == mio::access_mode::write)
+      : path_(std::move(path)) {
+    if (std::filesystem::exists(path_)) {
+      manifest_ = manifest::read(path_);
+      check_nbits();
+      if (manifest_.shard_bits != shard_bits) {
+        throw std::runtime_error("manifest_sharded_filter: existing manifest has shard_bits = " +
+                                 std::to_string(manifest_.shard_bits));
+      }
+    } else {
+      if (shard_bits == 0 || shard_bits > manifest::max_shard_bits) {
+        throw std::runtime_error("shard_bits must be in range [1, " +
+                                 std::to_string(manifest::max_shard_bits) + "]");
+      }
+      manifest_.nbits      = nbits;
+      manifest_.shard_bits = shard_bits;
+      manifest_.write(path_);
+    }
+  }
+
+  // sources
+  explicit manifest_sharded_filter(std::filesystem::path path, load_mode mode = load_mode::eager,
+                                   const map_options& opts = {}, shard_resolver resolver = {})
+    requires(AccessMode == mio::access_mode::read)
+      : path_(std::move(path)), manifest_(manifest::read(path_)), opts_(opts),
+        resolver_(std::move(resolver)), lazy_(mode == load_mode::lazy) {
+    check_nbits();
+    entry_of_.assign(manifest_.max_shards(), no_entry);
+    for (std::uint32_t i = 0; i != manifest_.shards.size(); ++i) {
+      entry_of_[manifest_.shards[i].prefix] = i;
+    }
+    loaded_.resize(manifest_.shards.size());
+    once_ = std::make_unique<std::once_flag[]>(manifest_.shards.size()); // NOLINT
+    if (!lazy_) load_all(1);
+  }
+
+  // Populates the shard for `prefix` from `keys`, which must all have
+  // that prefix, saves it as "<manifest stem>.<prefix>.bin" and adds
+  // it to the manifest.
+  void add_shard(std::span<const std::uint64_t> keys, std::uint32_t prefix,
+                 const populate_options& opts = {})
+    requires(AccessMode == mio::access_mode::write)
+  {
+    for (const auto key: keys) {
+      if (extract_prefix(key) != prefix) {
+        throw std::runtime_error("manifest_sharded_filter: key with prefix " +
+                                 std::to_string(extract_prefix(key)) + " in shard " +
+                                 std::to_string(prefix));
+      }
+    }
+    check_new_prefix(prefix);
+    const auto name = shard_name(prefix);
+    shard_filter_t shard(keys, opts);
+    shard.save(path_.parent_path() / name);
+    add_shard_file(prefix, name);
+  }
+
+  // Adds an existing shard file, eg built elsewhere, to the manifest.
+  // `name` is relative to the manifest's directory. Only its type tag
+  // is checked here.
+  void add_shard_file(std::uint32_t prefix, const std::string& name)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    const auto file = path_.parent_path() / name;
+    {
+      source_t check;
+      check.load(file);
+    }
+    manifest_.add({prefix, std::filesystem::file_size(file), name});
+    manifest_.write(path_);
+  }
+
+  [[nodiscard]] bool contains(std::uint64_t needle) const
+    requires(AccessMode == mio::access_mode::read)
+  {
+    const auto* shard = shard_for(needle);
+    return shard != nullptr && shard->contains(needle);
+  }
+
+  // as `sharded_filter::contains_many`, but unbatched across shards
+  void contains_many(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out) const
+    requires(AccessMode == mio::access_mode::read)
+  {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("contains_many: output span is smaller than keys span.");
+    }
+    for (std::size_t i = 0; i != keys.size(); ++i) out[i] = contains(keys[i]) ? 1 : 0;
+  }
+
+  [[nodiscard]] verify_result verify(std::span<const std::uint64_t> keys,
+                                     const verify_options& opts = {}) const
+    requires(AccessMode == mio::access_mode::read)
+  {
+    return detail::verify_keys(keys, opts,
+                               [this](auto batch, auto out) { contains_many(batch, out); });
+  }
+
+  // resolves and maps all shards not yet loaded, on up to `threads`
+  void load_all(unsigned threads = std::thread::hardware_concurrency()) const
+    requires(AccessMode == mio::access_mode::read)
+  {
+    std::atomic<std::size_t> next{0};
+    const auto               work = [&] {
+      for (auto i = next++; i < loaded_.size(); i = next++) {
+        (void)shard_at(static_cast<std::uint32_t>(i));
+      }
+    };
+    const std::size_t workers = std::clamp<std::size_t>(threads, 1, loaded_.size() + 1);
+    std::vector<std::future<void>> futures;
+    for (std::size_t i = 1; i < workers; ++i) {
+      futures.push_back(std::async(std::launch::async, work));
+    }
+    work();
+    for (auto& future: futures) future.get(); // rethrows any load exception
+  }
+
+  // number of shards mapped so far, eg in lazy mode. Not synchronised
+  // with concurrent queries.
+  [[nodiscard]] std::size_t loaded_shards() const
+    requires(AccessMode == mio::access_mode::read)
+  {
+    return static_cast<std::size_t>(std::count_if(
+        loaded_.begin(), loaded_.end(), [](const auto& shard) { return shard != nullptr; }));
+  }
+
+  [[nodiscard]] std::uint32_t extract_prefix(std::uint64_t key) const {
+    return static_cast<std::uint32_t>(key >> (sizeof(key) * 8 - manifest_.shard_bits));
+  }
+
+  [[nodiscard]] const manifest& get_manifest() const { return manifest_; }
+  [[nodiscard]] std::size_t     shards() const { return manifest_.shards.size(); }
+  [[nodiscard]] std::uint8_t    shard_bits() const { return manifest_.shard_bits; }
+
+private:
+  static constexpr std::uint32_t no_entry = ~std::uint32_t{0};
+
+  using source_t = persistent_filter<FilterType, mio::access_mode::read>;
+
+  std::filesystem::path path_;
+  manifest              manifest_;
+  map_options           opts_;
+  shard_resolver        resolver_;
+  bool                  lazy_ = false;
+
+  std::vector<std::uint32_t>                     entry_of_; // prefix => manifest index
+  mutable std::vector<std::unique_ptr<source_t>> loaded_;
+  mutable std::unique_ptr<std::once_flag[]>      once_; // NOLINT
+
+  void check_nbits() const {
+    if (manifest_.nbits != nbits) {
+      throw std::runtime_error("incorrect type_id: expected: " + manifest::type_id(nbits) +
+                               ", found: " + manifest::type_id(manifest_.nbits));
+    }
+  }
+
+  void check_new_prefix(std::uint32_t prefix) const {
+    if (prefix >= manifest_.max_shards()) {
+      throw std::runtime_error("manifest_sharded_filter: prefix " + std::to_string(prefix) +
+                               " is out of range");
+    }
+    for (const auto& entry: manifest_.shards) {
+      if (entry.prefix == prefix) {
+        throw std::runtime_error("manifest_sharded_filter: prefix " + std::to_string(prefix) +
+                                 " already has a shard");
+      }
+    }
+  }
+
+  [[nodiscard]] std::string shard_name(std::uint32_t prefix) const {
+    std::stringstream name;
+    name << path_.stem().string() << '.' << std::hex << std::setfill('0')
+         << std::setw((manifest_.shard_bits + 3) / 4) << prefix << ".bin";
+    return name.str();
+  }
+
+  [[nodiscard]] const source_t* shard_for(std::uint64_t key) const {
+    const auto index = entry_of_[extract_prefix(key)];
+    return index == no_entry ? nullptr : &shard_at(index);
+  }
+
+  [[nodiscard]] const source_t& shard_at(std::uint32_t index) const {
+    std::call_once(once_[index], [this, index] { load_shard(index); });
+    return *loaded_[index];
+  }
+
+  void load_shard(std::uint32_t index) const {
+    const auto& entry = manifest_.shards[index];
+    const auto  file  = resolver_ ? resolver_(entry.name) : path_.parent_path() / entry.name;
+    if (!std::filesystem::exists(file) || std::filesystem::file_size(file) != entry.bytes) {
+      throw std::runtime_error("manifest_sharded_filter: shard file '" + file.string() +
+                               "' is missing or not of the size in the manifest");
+    }
+    auto shard = std::make_unique<source_t>();
+    shard->load(file, opts_);
+    loaded_[index] = std::move(shard);
+  }
+};
+
+using manifest_sharded_filter8_sink =
+    manifest_sharded_filter<binary_fuse8_t, mio::access_mode::write>;
+using manifest_sharded_filter8_source =
+    manifest_sharded_filter<binary_fuse8_t, mio::access_mode::read>;
+
+using manifest_sharded_filter16_sink =
+    manifest_sharded_filter<binary_fuse16_t, mio::access_mode::write>;
+using manifest_sharded_filter16_source =
+    manifest_sharded_filter<binary_fuse16_t, mio::access_mode::read>;
+
+} // namespace binfuse
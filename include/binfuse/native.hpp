@@ -0,0 +1,522 @@
+#pragma once
+
+#include "binaryfusefilter.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* binfuse native binary fuse filters
+ *
+ * A C++ implementation of the upstream binary_fuse(8|16) filters, with
+ * the fingerprint width as a template parameter, so that widths which
+ * upstream does not provide, ie 32bit for a ~2^-32 false positive rate,
+ * are available. Construction (the hypergraph peeling), hashing,
+ * memory layout and serialization format are those of upstream, so the
+ * 8 and 16 bit instantiations are interchangeable with upstream's, file
+ * for file.
+ *
+ * `binary_fuse_t<Fingerprint>` has the same members as the upstream
+ * c-structs and is used in exactly the same way, via `binfuse::ftype`:
+ * `binfuse::filter<binfuse::binary_fuse32_t>` etc.
+ */
+namespace binfuse {
+
+template <typename T>
+concept native_fingerprint = std::same_as<T, std::uint8_t> || std::same_as<T, std::uint16_t> ||
+                             std::same_as<T, std::uint32_t>;
+
+template <native_fingerprint Fingerprint>
+struct binary_fuse_t {
+  std::uint64_t Seed;
+  std::uint32_t Size;
+  std::uint32_t SegmentLength;
+  std::uint32_t SegmentLengthMask;
+  std::uint32_t SegmentCount;
+  std::uint32_t SegmentCountLength;
+  std::uint32_t ArrayLength;
+  Fingerprint*  Fingerprints;
+};
+
+using binary_fuse32_t = binary_fuse_t<std::uint32_t>;
+
+} // namespace binfuse
+
+namespace binfuse::native {
+
+template <native_fingerprint Fingerprint>
+using fuse_t = binary_fuse_t<Fingerprint>;
+
+template <native_fingerprint Fingerprint>
+[[nodiscard]] constexpr Fingerprint fingerprint(std::uint64_t hash) noexcept {
+  return static_cast<Fingerprint>(hash ^ (hash >> 32U));
+}
+
+template <native_fingerprint Fingerprint>
+[[nodiscard]] inline binary_hashes_t hash_batch(std::uint64_t             hash,
+                                                const fuse_t<Fingerprint>* fil) noexcept {
+  binary_hashes_t ans;
+  ans.h0 = static_cast<std::uint32_t>(binary_fuse_mulhi(hash, fil->SegmentCountLength));
+  ans.h1 = ans.h0 + fil->SegmentLength;
+  ans.h2 = ans.h1 + fil->SegmentLength;
+  ans.h1 ^= static_cast<std::uint32_t>(hash >> 18U) & fil->SegmentLengthMask;
+  ans.h2 ^= static_cast<std::uint32_t>(hash) & fil->SegmentLengthMask;
+  return ans;
+}
+
+template <native_fingerprint Fingerprint>
+[[nodiscard]] inline bool contains(std::uint64_t key, const fuse_t<Fingerprint>* fil) noexcept {
+  const std::uint64_t hash   = binary_fuse_mix_split(key, fil->Seed);
+  const auto          hashes = hash_batch(hash, fil);
+  const auto*         fps    = fil->Fingerprints;
+  return static_cast<Fingerprint>(fingerprint<Fingerprint>(hash) ^ fps[hashes.h0] ^
+                                  fps[hashes.h1] ^ fps[hashes.h2]) == 0;
+}
+
+// sets the geometry of a filter for `size` keys, ie all but the
+// `Fingerprints`, of which there will be `ArrayLength`
+template <native_fingerprint Fingerprint>
+inline void layout(std::uint32_t size, fuse_t<Fingerprint>* fil) {
+  constexpr std::uint32_t arity = 3;
+  fil->Size                     = size;
+  fil->SegmentLength      = size == 0 ? 4 : binary_fuse_calculate_segment_length(arity, size);
+  fil->SegmentLength      = std::min(fil->SegmentLength, 262144U);
+  fil->SegmentLengthMask  = fil->SegmentLength - 1;
+  const double size_factor = size <= 1 ? 0 : binary_fuse_calculate_size_factor(arity, size);
+  const auto   capacity    = size <= 1 ? 0U
+                                       : static_cast<std::uint32_t>(
+                                          std::round(static_cast<double>(size) * size_factor));
+  const std::uint32_t init_segment_count =
+      (capacity + fil->SegmentLength - 1) / fil->SegmentLength - (arity - 1);
+  fil->ArrayLength  = (init_segment_count + arity - 1) * fil->SegmentLength;
+  fil->SegmentCount = (fil->ArrayLength + fil->SegmentLength - 1) / fil->SegmentLength;
+  fil->SegmentCount = fil->SegmentCount <= arity - 1 ? 1 : fil->SegmentCount - (arity - 1);
+  fil->ArrayLength  = (fil->SegmentCount + arity - 1) * fil->SegmentLength;
+  fil->SegmentCountLength = fil->SegmentCount * fil->SegmentLength;
+}
+
+// malloc'd, to be interchangeable with upstream and freed by `free`
+template <native_fingerprint Fingerprint>
+inline bool allocate(std::uint32_t size, fuse_t<Fingerprint>* fil) {
+  layout(size, fil);
+  fil->Fingerprints =
+      static_cast<Fingerprint*>(std::calloc(fil->ArrayLength, sizeof(Fingerprint))); // NOLINT
+  return fil->Fingerprints != nullptr;
+}
+
+template <native_fingerprint Fingerprint>
+inline void free(fuse_t<Fingerprint>* fil) {
+  std::free(fil->Fingerprints); // NOLINT malloc'd, as upstream
+  *fil = {};
+}
+
+template <native_fingerprint Fingerprint>
+[[nodiscard]] inline std::size_t serialization_bytes(fuse_t<Fingerprint>* fil) {
+  return sizeof(fil->Seed) + sizeof(fil->Size) + sizeof(fil->SegmentLength) +
+         sizeof(fil->SegmentCount) + sizeof(fil->SegmentCountLength) + sizeof(fil->ArrayLength) +
+         sizeof(Fingerprint) * fil->ArrayLength;
+}
+
+template <native_fingerprint Fingerprint>
+inline std::size_t serialize(const fuse_t<Fingerprint>* fil, char* buffer) {
+  char* pos    = buffer;
+  auto  append = [&pos](const void* src, std::size_t bytes) {
+    std::memcpy(pos, src, bytes);
+    pos += bytes; // NOLINT pointer arithmetic
+  };
+  append(&fil->Seed, sizeof(fil->Seed));
+  append(&fil->Size, sizeof(fil->Size));
+  append(&fil->SegmentLength, sizeof(fil->SegmentLength));
+  append(&fil->SegmentCount, sizeof(fil->SegmentCount));
+  append(&fil->SegmentCountLength, sizeof(fil->SegmentCountLength));
+  append(&fil->ArrayLength, sizeof(fil->ArrayLength));
+  append(fil->Fingerprints, sizeof(Fingerprint) * fil->ArrayLength);
+  return static_cast<std::size_t>(pos - buffer);
+}
+
+template <native_fingerprint Fingerprint>
+inline const char* deserialize_header(fuse_t<Fingerprint>* fil, const char* buffer) {
+  auto extract = [&buffer](void* dest, std::size_t bytes) {
+    std::memcpy(dest, buffer, bytes);
+    buffer += bytes; // NOLINT pointer arithmetic
+  };
+  extract(&fil->Seed, sizeof(fil->Seed));
+  extract(&fil->Size, sizeof(fil->Size));
+  extract(&fil->SegmentLength, sizeof(fil->SegmentLength));
+  fil->SegmentLengthMask = fil->SegmentLength - 1;
+  extract(&fil->SegmentCount, sizeof(fil->SegmentCount));
+  extract(&fil->SegmentCountLength, sizeof(fil->SegmentCountLength));
+  extract(&fil->ArrayLength, sizeof(fil->ArrayLength));
+  return buffer;
+}
+
+// the temporary arrays of `populate`, which can be reused across
+// populates, see `binfuse::build_arena`. Only ever grow.
+struct scratch {
+  std::vector<std::uint64_t> reverse_order;
+  std::vector<std::uint32_t> alone;
+  std::vector<std::uint8_t>  t2count;
+  std::vector<std::uint8_t>  reverse_h;
+  std::vector<std::uint64_t> t2hash;
+  std::vector<std::uint32_t> start_pos;
+  std::vector<std::uint64_t> deduped;       // only if duplicates are found
+  std::vector<std::uint32_t> thread_counts; // `populate_parallel` only
+  std::vector<std::uint32_t> block_start;   // `populate_parallel` only
+
+  [[nodiscard]] std::size_t capacity_bytes() const {
+    return reverse_order.capacity() * sizeof(std::uint64_t) +
+           alone.capacity() * sizeof(std::uint32_t) + t2count.capacity() +
+           reverse_h.capacity() + t2hash.capacity() * sizeof(std::uint64_t) +
+           start_pos.capacity() * sizeof(std::uint32_t) +
+           deduped.capacity() * sizeof(std::uint64_t) +
+           (thread_counts.capacity() + block_start.capacity()) * sizeof(std::uint32_t);
+  }
+};
+
+template <native_fingerprint Fingerprint>
+inline bool populate_reusing(const std::uint64_t* keys_in, std::uint32_t size,
+                             fuse_t<Fingerprint>* fil, scratch& tmp);
+
+// The upstream construction: hashes are bucketed by segment for
+// locality, each slot tracks the xor of, and the count of, the keys
+// mapping to it (with which of their 3 slots it is in the low 2 bits),
+// and slots with a single key are peeled, until all keys are. Retries
+// with a new seed on failure. Duplicate keys are tolerated, and
+// dropped. `keys` are not modified.
+template <native_fingerprint Fingerprint>
+inline bool populate(const std::uint64_t* keys, std::uint32_t size, fuse_t<Fingerprint>* fil) {
+  scratch tmp;
+  return populate_reusing(keys, size, fil, tmp);
+}
+
+namespace phase {
+
+template <native_fingerprint Fingerprint>
+[[nodiscard]] inline std::uint32_t slot(const fuse_t<Fingerprint>* fil, unsigned index,
+                                        std::uint64_t hash) noexcept {
+  const auto hashes = hash_batch(hash, fil);
+  return index == 0 ? hashes.h0 : index == 1 ? hashes.h1 : hashes.h2;
+}
+
+// runs fn(0..threads-1) concurrently, fn(0) on the calling thread
+template <typename Func>
+inline void run_threads(unsigned threads, const Func& fn) {
+  std::vector<std::future<void>> futures;
+  for (unsigned t = 1; t < threads; ++t) {
+    futures.push_back(std::async(std::launch::async, [&fn, t] { fn(t); }));
+  }
+  fn(0);
+  for (auto& future: futures) future.get();
+}
+
+struct counted {
+  bool          error      = false; // a slot count overflowed
+  std::uint32_t duplicates = 0;
+
+  counted& operator+=(const counted& rhs) {
+    error = error || rhs.error;
+    duplicates += rhs.duplicates;
+    return *this;
+  }
+};
+
+// the hashes of all keys into `reverse_order`, roughly grouped by
+// their top `block_bits`, as upstream
+template <native_fingerprint Fingerprint>
+inline void bucket(const std::uint64_t* keys, std::uint32_t size, const fuse_t<Fingerprint>* fil,
+                   scratch& tmp, std::uint32_t block_bits) {
+  const std::uint32_t block = std::uint32_t{1} << block_bits;
+  for (std::uint32_t i = 0; i < block; ++i) {
+    tmp.start_pos[i] = static_cast<std::uint32_t>((std::uint64_t{i} * size) >> block_bits);
+  }
+  const std::uint64_t mask_block = block - 1;
+  for (std::uint32_t i = 0; i < size; ++i) {
+    const std::uint64_t hash          = binary_fuse_murmur64(keys[i] + fil->Seed);
+    std::uint64_t       segment_index = hash >> (64 - block_bits);
+    while (tmp.reverse_order[tmp.start_pos[segment_index]] != 0) {
+      segment_index = (segment_index + 1) & mask_block;
+    }
+    tmp.reverse_order[tmp.start_pos[segment_index]] = hash;
+    ++tmp.start_pos[segment_index];
+  }
+}
+
+// As `bucket`, but exactly sorted by the top `block_bits`, with a
+// counting sort on `threads`: each thread counts its share of the keys
+// per block, and then scatters them into its own range of each block.
+// `block_start` is where each block begins.
+template <native_fingerprint Fingerprint>
+inline void bucket_parallel(const std::uint64_t* keys, std::uint32_t size,
+                            const fuse_t<Fingerprint>* fil, scratch& tmp,
+                            std::uint32_t block_bits, unsigned threads) {
+  const std::uint32_t blocks = std::uint32_t{1} << block_bits;
+  const unsigned      shift  = 64 - block_bits;
+  auto&               counts = tmp.thread_counts;
+  counts.assign(std::size_t{threads} * blocks, 0);
+  tmp.block_start.assign(std::size_t{blocks} + 1, 0);
+
+  const auto share = [size, threads](unsigned t) {
+    return std::pair{static_cast<std::uint32_t>(std::uint64_t{size} * t / threads),
+                     static_cast<std::uint32_t>(std::uint64_t{size} * (t + 1) / threads)};
+  };
+  run_threads(threads, [&](unsigned t) {
+    auto* own = counts.data() + std::size_t{t} * blocks;
+    for (auto [i, end] = share(t); i != end; ++i) {
+      ++own[binary_fuse_murmur64(keys[i] + fil->Seed) >> shift];
+    }
+  });
+  std::uint32_t pos = 0;
+  for (std::uint32_t blk = 0; blk != blocks; ++blk) {
+    tmp.block_start[blk] = pos;
+    for (unsigned t = 0; t != threads; ++t) {
+      const auto count = counts[std::size_t{t} * blocks + blk];
+      counts[std::size_t{t} * blocks + blk] = pos;
+      pos += count;
+    }
+  }
+  tmp.block_start[blocks] = pos;
+  run_threads(threads, [&](unsigned t) {
+    auto* own = counts.data() + std::size_t{t} * blocks;
+    for (auto [i, end] = share(t); i != end; ++i) {
+      const std::uint64_t hash = binary_fuse_murmur64(keys[i] + fil->Seed);
+      tmp.reverse_order[own[hash >> shift]++] = hash;
+    }
+  });
+}
+
+// adds the bucketed hashes in [begin, end) to their 3 slots each
+template <native_fingerprint Fingerprint>
+inline counted count(const fuse_t<Fingerprint>* fil, scratch& tmp, std::uint32_t begin,
+                     std::uint32_t end) {
+  auto&   t2count = tmp.t2count;
+  auto&   t2hash  = tmp.t2hash;
+  counted res;
+  for (std::uint32_t i = begin; i < end; ++i) {
+    const std::uint64_t hash = tmp.reverse_order[i];
+    const auto          h0   = slot(fil, 0, hash);
+    const auto          h1   = slot(fil, 1, hash);
+    const auto          h2   = slot(fil, 2, hash);
+    t2count[h0] = static_cast<std::uint8_t>(t2count[h0] + 4);
+    t2hash[h0] ^= hash;
+    t2count[h1] = static_cast<std::uint8_t>((t2count[h1] + 4) ^ 1U);
+    t2hash[h1] ^= hash;
+    t2count[h2] = static_cast<std::uint8_t>((t2count[h2] + 4) ^ 2U);
+    t2hash[h2] ^= hash;
+    if ((t2hash[h0] & t2hash[h1] & t2hash[h2]) == 0) {
+      if ((t2hash[h0] == 0 && t2count[h0] == 8) || (t2hash[h1] == 0 && t2count[h1] == 8) ||
+          (t2hash[h2] == 0 && t2count[h2] == 8)) {
+        ++res.duplicates; // undo
+        t2count[h0] = static_cast<std::uint8_t>(t2count[h0] - 4);
+        t2hash[h0] ^= hash;
+        t2count[h1] = static_cast<std::uint8_t>((t2count[h1] - 4) ^ 1U);
+        t2hash[h1] ^= hash;
+        t2count[h2] = static_cast<std::uint8_t>((t2count[h2] - 4) ^ 2U);
+        t2hash[h2] ^= hash;
+      }
+    }
+    res.error = res.error || t2count[h0] < 4 || t2count[h1] < 4 || t2count[h2] < 4; // overflow
+  }
+  return res;
+}
+
+// As `count`, on `threads`, after `bucket_parallel`. A hash's slots are
+// all within 3 segments from that of its first slot, which rises with
+// the hash. So the blocks are cut into chunks of at least 5 segments
+// each, and all even chunks, then all odd chunks, are counted
+// concurrently, as no two of them share a slot.
+template <native_fingerprint Fingerprint>
+inline counted count_parallel(const fuse_t<Fingerprint>* fil, scratch& tmp,
+                              std::uint32_t size, std::uint32_t block_bits, unsigned threads) {
+  const std::uint32_t blocks = std::uint32_t{1} << block_bits;
+  const std::uint32_t chunks = std::min(2 * threads, fil->SegmentCount / 5);
+  if (chunks < 4) {
+    return count(fil, tmp, 0, size);
+  }
+  const auto chunk_start = [&](std::uint32_t chunk) {
+    return tmp.block_start[static_cast<std::uint64_t>(blocks) * chunk / chunks];
+  };
+  std::vector<counted> results(chunks);
+  for (std::uint32_t parity = 0; parity != 2; ++parity) {
+    const std::uint32_t in_phase = (chunks - parity + 1) / 2;
+    const auto          workers  = std::min<unsigned>(threads, in_phase);
+    run_threads(workers, [&](unsigned t) {
+      for (std::uint32_t chunk = parity + 2 * t; chunk < chunks; chunk += 2 * workers) {
+        results[chunk] = count(fil, tmp, chunk_start(chunk), chunk_start(chunk + 1));
+      }
+    });
+  }
+  counted total;
+  for (const auto& res: results) total += res;
+  return total;
+}
+
+} // namespace phase
+
+// The retry loop of `populate`, with the bucket and count phases on
+// `threads` if more than 1. Peeling and assigning the fingerprints are
+// sequential.
+template <native_fingerprint Fingerprint>
+inline bool populate_threaded(const std::uint64_t* keys_in, std::uint32_t size,
+                              fuse_t<Fingerprint>* fil, scratch& tmp, unsigned threads) {
+  if (size != fil->Size) {
+    return false;
+  }
+  std::uint64_t rng_counter = 0x726b2b9d438b9d4d;
+  fil->Seed                 = binary_fuse_rng_splitmix64(&rng_counter);
+  if (size == 0) {
+    return true;
+  }
+  constexpr int max_iterations = 100;
+
+  const std::uint64_t* keys     = keys_in;
+  const std::uint32_t  capacity = fil->ArrayLength;
+  const bool           parallel = threads > 1;
+
+  // assign() reuses existing capacity
+  auto& reverse_order = tmp.reverse_order;
+  auto& alone         = tmp.alone;
+  auto& t2count       = tmp.t2count;
+  auto& reverse_h     = tmp.reverse_h;
+  auto& t2hash        = tmp.t2hash;
+  auto& deduped       = tmp.deduped;
+  reverse_order.assign(std::size_t{size} + 1, 0);
+  alone.assign(capacity, 0);
+  t2count.assign(capacity, 0);
+  reverse_h.assign(size, 0);
+  t2hash.assign(capacity, 0);
+
+  std::uint32_t block_bits = 1;
+  while ((std::uint32_t{1} << block_bits) < fil->SegmentCount) ++block_bits;
+  tmp.start_pos.assign(std::size_t{1} << block_bits, 0);
+
+  auto slot  = [fil](unsigned index, std::uint64_t hash) { return phase::slot(fil, index, hash); };
+  auto reset = [&] {
+    std::fill(reverse_order.begin(), reverse_order.begin() + size, 0);
+    std::fill(t2count.begin(), t2count.end(), 0);
+    std::fill(t2hash.begin(), t2hash.end(), 0);
+    fil->Seed = binary_fuse_rng_splitmix64(&rng_counter);
+  };
+
+  std::array<std::uint32_t, 5> h012{};
+  reverse_order[size] = 1; // sentinel
+  for (int loop = 0;; ++loop) {
+    if (loop + 1 > max_iterations) {
+      std::memset(fil->Fingerprints, ~0, sizeof(Fingerprint) * fil->ArrayLength);
+      return false;
+    }
+    phase::counted counted;
+    if (parallel) {
+      phase::bucket_parallel(keys, size, fil, tmp, block_bits, threads);
+      counted = phase::count_parallel(fil, tmp, size, block_bits, threads);
+    } else {
+      phase::bucket(keys, size, fil, tmp, block_bits);
+      counted = phase::count(fil, tmp, 0, size);
+    }
+    if (counted.error) {
+      reset();
+      continue;
+    }
+
+    // queue the slots with a single key
+    std::uint32_t qsize = 0;
+    for (std::uint32_t i = 0; i < capacity; ++i) {
+      alone[qsize] = i;
+      qsize += (t2count[i] >> 2U) == 1 ? 1U : 0U;
+    }
+    std::uint32_t stack_size = 0;
+    while (qsize > 0) {
+      --qsize;
+      const std::uint32_t index = alone[qsize];
+      if ((t2count[index] >> 2U) == 1) {
+        const std::uint64_t hash = t2hash[index];
+        h012[1]                  = slot(1, hash);
+        h012[2]                  = slot(2, hash);
+        h012[3]                  = slot(0, hash);
+        h012[4]                  = h012[1];
+        const auto found         = static_cast<std::uint8_t>(t2count[index] & 3U);
+        reverse_h[stack_size]    = found;
+        reverse_order[stack_size] = hash;
+        ++stack_size;
+        for (unsigned other = 1; other != 3; ++other) {
+          const std::uint32_t other_index = h012[found + other];
+          alone[qsize]                    = other_index;
+          qsize += (t2count[other_index] >> 2U) == 2 ? 1U : 0U;
+          t2count[other_index] = static_cast<std::uint8_t>((t2count[other_index] - 4) ^
+                                                           ((found + other) % 3));
+          t2hash[other_index] ^= hash;
+        }
+      }
+    }
+    if (stack_size + counted.duplicates == size) {
+      size = stack_size; // success
+      break;
+    }
+    if (counted.duplicates > 0) {
+      if (keys != deduped.data()) {
+        deduped.assign(keys, keys + size); // NOLINT pointer arithmetic
+      }
+      std::sort(deduped.begin(), deduped.end());
+      deduped.erase(std::unique(deduped.begin(), deduped.end()), deduped.end());
+      keys                = deduped.data();
+      size                = static_cast<std::uint32_t>(deduped.size());
+      reverse_order[size] = 1;
+    }
+    reset();
+  }
+
+  for (std::uint32_t i = size - 1; i < size; --i) {
+    const std::uint64_t hash  = reverse_order[i];
+    const std::uint8_t  found = reverse_h[i];
+    h012[0]                   = slot(0, hash);
+    h012[1]                   = slot(1, hash);
+    h012[2]                   = slot(2, hash);
+    h012[3]                   = h012[0];
+    h012[4]                   = h012[1];
+    fil->Fingerprints[h012[found]] =
+        static_cast<Fingerprint>(fingerprint<Fingerprint>(hash) ^
+                                 fil->Fingerprints[h012[found + 1]] ^
+                                 fil->Fingerprints[h012[found + 2]]);
+  }
+  return true;
+}
+
+// as `populate`, with temporary arrays from `tmp`. `fil->Fingerprints`
+// must be zeroed.
+template <native_fingerprint Fingerprint>
+inline bool populate_reusing(const std::uint64_t* keys_in, std::uint32_t size,
+                             fuse_t<Fingerprint>* fil, scratch& tmp) {
+  return populate_threaded(keys_in, size, fil, tmp, 1);
+}
+
+// As `populate`, with the hashing, bucketing and counting phases on
+// `threads`. The result is a valid filter of the same layout and
+// format, but it is not bit for bit that of the sequential `populate`,
+// as the peeling order differs. `Fuse` is a native or upstream filter
+// struct, which is allocated (zeroed) for `size` keys.
+template <typename Fuse>
+inline bool populate_parallel(const std::uint64_t* keys, std::uint32_t size, Fuse* fil,
+                              unsigned threads) {
+  using fingerprint_t = std::remove_pointer_t<decltype(fil->Fingerprints)>;
+  scratch tmp;
+  if constexpr (std::same_as<Fuse, fuse_t<fingerprint_t>>) {
+    return populate_threaded(keys, size, fil, tmp, threads);
+  } else {
+    // the upstream structs have the same members
+    fuse_t<fingerprint_t> native{fil->Seed,         fil->Size,          fil->SegmentLength,
+                                 fil->SegmentLengthMask, fil->SegmentCount,
+                                 fil->SegmentCountLength, fil->ArrayLength, fil->Fingerprints};
+    const bool            done = populate_threaded(keys, size, &native, tmp, threads);
+    fil->Seed                  = native.Seed;
+    return done;
+  }
+}
+
+} // namespace binfuse::native
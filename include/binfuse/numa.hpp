@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace binfuse {
+
+/* binfuse::numa_topology
+ *
+ * The NUMA nodes of this machine and their CPUs, as read from
+ * /sys/devices/system/node. Where that is not available (not Linux, or
+ * no NUMA support) it is a single node with all CPUs, so that all of
+ * the below degrades to a single, unpinned, replica.
+ */
+class numa_topology {
+public:
+  // a single node, with `cpus` CPUs
+  explicit numa_topology(unsigned cpus = std::max(std::thread::hardware_concurrency(), 1U)) {
+    std::vector<unsigned> all(cpus);
+    for (unsigned cpu = 0; cpu != cpus; ++cpu) all[cpu] = cpu;
+    add_node(0, std::move(all));
+  }
+
+  // eg for tests: node i has the CPUs in node_cpus[i]
+  explicit numa_topology(const std::vector<std::vector<unsigned>>& node_cpus) {
+    if (node_cpus.empty()) {
+      throw std::runtime_error("numa_topology: no nodes");
+    }
+    for (unsigned node = 0; node != node_cpus.size(); ++node) add_node(node, node_cpus[node]);
+  }
+
+  // the online nodes with CPUs, in order, renumbered from 0 if sparse.
+  // Memory only nodes (eg CXL expanders) are ignored.
+  [[nodiscard]] static numa_topology detect() {
+    const std::filesystem::path        root("/sys/devices/system/node");
+    std::vector<std::vector<unsigned>> node_cpus;
+    for (const auto node: parse_cpu_list(read_line(root / "online"))) {
+      auto cpus = parse_cpu_list(read_line(root / ("node" + std::to_string(node)) / "cpulist"));
+      if (!cpus.empty()) node_cpus.push_back(std::move(cpus)); // skip memory only nodes
+    }
+    if (node_cpus.empty()) return numa_topology{};
+    return numa_topology{node_cpus};
+  }
+
+  // "0-3,8,10-11" => {0, 1, 2, 3, 8, 10, 11}
+  [[nodiscard]] static std::vector<unsigned> parse_cpu_list(const std::string& list) {
+    std::vector<unsigned> cpus;
+    std::stringstream     ranges(list);
+    std::string           range;
+    while (std::getline(ranges, range, ',')) {
+      if (range.empty()) continue;
+      const auto dash  = range.find('-');
+      const auto first = static_cast<unsigned>(std::stoul(range.substr(0, dash)));
+      const auto last  = dash == std::string::npos
+                             ? first
+                             : static_cast<unsigned>(std::stoul(range.substr(dash + 1)));
+      for (unsigned cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+  }
+
+  [[nodiscard]] std::size_t nodes() const { return node_cpus_.size(); }
+
+  [[nodiscard]] std::span<const unsigned> cpus(std::size_t node) const {
+    return node_cpus_.at(node);
+  }
+
+  // the node of `cpu`, or 0 if unknown, eg a CPU which came online later
+  [[nodiscard]] std::size_t node_of_cpu(unsigned cpu) const noexcept {
+    return cpu < cpu_node_.size() ? cpu_node_[cpu] : 0;
+  }
+
+  // the node the calling thread is running on right now. Cheap (vDSO),
+  // but a thread which is not pinned may be migrated at any time.
+  [[nodiscard]] std::size_t current_node() const noexcept {
+#if defined(__linux__)
+    if (nodes() == 1) return 0;
+    const int cpu = ::sched_getcpu();
+    return cpu < 0 ? 0 : node_of_cpu(static_cast<unsigned>(cpu));
+#else
+    return 0;
+#endif
+  }
+
+  // Pins the calling thread to the CPUs of `node`, so that memory it
+  // first touches is allocated there, under the default (local)
+  // policy. Returns false (and does nothing) where unsupported.
+  bool pin_to_node(std::size_t node) const {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu: cpus(node)) {
+      if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return ::sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+  }
+
+  // the node of the page containing `addr`, which must have been
+  // touched, or -1 where unknown. For checking placement.
+  [[nodiscard]] static int node_of_address(const void* addr) noexcept {
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+    constexpr unsigned long mpol_f_node = 1UL << 0U; // NOLINT from <numaif.h>
+    constexpr unsigned long mpol_f_addr = 1UL << 1U; // NOLINT
+    int                     node        = -1;
+    if (::syscall(SYS_get_mempolicy, &node, nullptr, 0, addr, mpol_f_node | mpol_f_addr) == 0) {
+      return node;
+    }
+#else
+    (void)addr;
+#endif
+    return -1;
+  }
+
+private:
+  // empty if not readable
+  static std::string read_line(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    std::string   line;
+    std::getline(file, line);
+    return line;
+  }
+
+  void add_node(unsigned node, std::vector<unsigned> cpus) {
+    for (const auto cpu: cpus) {
+      if (cpu >= cpu_node_.size()) cpu_node_.resize(cpu + 1, 0);
+      cpu_node_[cpu] = node;
+    }
+    node_cpus_.push_back(std::move(cpus));
+  }
+
+  std::vector<std::vector<unsigned>> node_cpus_;
+  std::vector<std::size_t>           cpu_node_;
+};
+
+/* binfuse::numa_replicated
+ *
+ * One copy of a `Source` (typically a `sharded_filter` source) per
+ * NUMA node, each in that node's local memory, with queries routed to
+ * the replica of the node they run on.
+ *
+ * A single mmap of a file is backed by one set of page cache pages,
+ * which live on whichever node first faulted them in, and on a multi
+ * socket machine every other node's queries then pay remote memory
+ * latency on each fingerprint fetch. Here, `open` is instead called
+ * once per node, on a thread pinned to that node, and must load the
+ * source into private memory, eg with `map_options::anonymous_copy`,
+ * so that the copy is first touched, and therefore allocated, on that
+ * node:
+ *
+ *     binfuse::numa_replicated<binfuse::sharded_filter8_source> filter([&] {
+ *       return std::make_unique<binfuse::sharded_filter8_source>(
+ *           path, 8, binfuse::load_mode::eager, binfuse::map_options{.anonymous_copy = true});
+ *     });
+ *     filter.contains(key); // on the local replica
+ *
+ * The replicas are loaded concurrently, and memory use is one copy
+ * per node. On a single node machine there is just one replica, and
+ * no pinning. Query threads are best pinned to a node, so that they
+ * are not migrated away from their replica mid query, and may then
+ * fetch theirs once, with `replica(node)`, rather than per query.
+ *
+ * Thread safety: as for `Source`. Replicas are immutable after
+ * construction.
+ */
+template <typename Source>
+class numa_replicated {
+public:
+  using open_t = std::function<std::unique_ptr<Source>()>;
+
+  explicit numa_replicated(const open_t& open, numa_topology topology = numa_topology::detect())
+      : topology_(std::move(topology)), replicas_(topology_.nodes()) {
+    if (replicas_.size() == 1) {
+      replicas_[0] = checked(open());
+      return;
+    }
+    std::vector<std::future<std::unique_ptr<Source>>> futures;
+    for (std::size_t node = 0; node != replicas_.size(); ++node) {
+      futures.push_back(std::async(std::launch::async, [this, &open, node] {
+        topology_.pin_to_node(node); // a fresh thread, best effort
+        return checked(open());
+      }));
+    }
+    for (std::size_t node = 0; node != replicas_.size(); ++node) {
+      replicas_[node] = futures[node].get(); // rethrows any load exception
+    }
+  }
+
+  [[nodiscard]] const numa_topology& topology() const { return topology_; }
+  [[nodiscard]] std::size_t          replicas() const { return replicas_.size(); }
+
+  [[nodiscard]] const Source& replica(std::size_t node) const { return *replicas_.at(node); }
+
+  // the replica of the node the calling thread is running on
+  [[nodiscard]] const Source& local() const {
+    return *replicas_[std::min(topology_.current_node(), replicas_.size() - 1)];
+  }
+
+  // convenience queries, on `local()`, for `Source`s which have them
+  [[nodiscard]] bool contains(std::uint64_t needle) const { return local().contains(needle); }
+
+  void contains_many(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out) const {
+    local().contains_many(keys, out);
+  }
+
+private:
+  static std::unique_ptr<Source> checked(std::unique_ptr<Source> source) {
+    if (source == nullptr) {
+      throw std::runtime_error("numa_replicated: open returned a null source");
+    }
+    return source;
+  }
+
+  numa_topology                        topology_;
+  std::vector<std::unique_ptr<Source>> replicas_;
+};
+
+} // namespace binfuse
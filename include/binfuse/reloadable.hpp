@@ -0,0 +1,166 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace binfuse {
+
+/* binfuse::reloadable
+ *
+ * A handle to a `Source` (typically a `sharded_filter` or
+ * `persistent_filter` source), which can be replaced by a freshly
+ * built file while queries continue, without downtime.
+ *
+ * A new `Source` is fully loaded first (in the background with
+ * `reload_async`), then published with an atomic pointer swap. The old
+ * one, ie its mmap, which all its fingerprint pointers refer to, is
+ * only destroyed once every reader which might still be using it has
+ * finished.
+ *
+ * Readers are tracked epoch style: the current and previous sources
+ * live in two slots, with a reader count for each, striped over cache
+ * lines by thread, so that readers on different cores rarely share a
+ * line. A reader registers with the slot of the current epoch. A
+ * reload fills the other slot, bumps the epoch, and waits for the old
+ * slot's count to drain. Readers never block or wait for a reload,
+ * they only retry their registration if it raced with one. Reloads
+ * are serialised.
+ *
+ * All `snapshot`s must be released before the `reloadable` is destroyed.
+ */
+template <typename Source>
+class reloadable {
+  struct alignas(64) counter {
+    std::atomic<std::int64_t> readers{0};
+  };
+  static constexpr std::size_t stripes = 16;
+  using generation_t                   = std::array<counter, stripes>;
+
+public:
+  // RAII read guard: the `Source` it refers to stays valid, even
+  // across reloads, until the snapshot is destroyed. Take one per
+  // query, or per batch of queries, on the querying thread.
+  class snapshot {
+  public:
+    snapshot(const snapshot& other)            = delete;
+    snapshot& operator=(const snapshot& other) = delete;
+    snapshot(snapshot&& other) noexcept
+        : source_(std::exchange(other.source_, nullptr)),
+          counter_(std::exchange(other.counter_, nullptr)) {}
+    snapshot& operator=(snapshot&& other) = delete;
+    ~snapshot() {
+      if (counter_ != nullptr) {
+        counter_->readers.fetch_sub(1, std::memory_order_release);
+      }
+    }
+
+    [[nodiscard]] const Source& operator*() const { return *source_; }
+    [[nodiscard]] const Source* operator->() const { return source_; }
+
+  private:
+    friend class reloadable;
+    snapshot(const Source* source, counter* cntr) : source_(source), counter_(cntr) {}
+
+    const Source* source_;
+    counter*      counter_;
+  };
+
+  explicit reloadable(std::unique_ptr<Source> source) {
+    if (source == nullptr) {
+      throw std::runtime_error("reloadable: initial source is null");
+    }
+    sources_[0].store(source.release());
+  }
+
+  reloadable(const reloadable& other)            = delete;
+  reloadable& operator=(const reloadable& other) = delete;
+  reloadable(reloadable&& other)                 = delete;
+  reloadable& operator=(reloadable&& other)      = delete;
+
+  ~reloadable() {
+    for (auto& source: sources_) delete source.load(); // NOLINT owning raw ptrs, for atomic swap
+  }
+
+  [[nodiscard]] snapshot acquire() const {
+    const auto stripe = std::hash<std::thread::id>{}(std::this_thread::get_id()) % stripes;
+    for (;;) {
+      const auto epoch = epoch_.load();
+      auto&      cntr  = generations_[epoch & 1U][stripe];
+      cntr.readers.fetch_add(1);
+      if (epoch_.load() == epoch) {
+        // registered: no publish can now destroy this generation's source
+        return {sources_[epoch & 1U].load(), &cntr};
+      }
+      cntr.readers.fetch_sub(1, std::memory_order_release); // raced with a publish: retry
+    }
+  }
+
+  // convenience single query, for `Source`s which have it
+  [[nodiscard]] bool contains(std::uint64_t needle) const { return acquire()->contains(needle); }
+
+  // Publishes `source`, then destroys the previous one, once no reader
+  // can still be using it. Blocks the caller (not the readers), until
+  // then.
+  void publish(std::unique_ptr<Source> source) {
+    if (source == nullptr) {
+      throw std::runtime_error("reloadable: can not publish a null source");
+    }
+    const std::lock_guard lock(reload_mutex_);
+    const auto            epoch = epoch_.load();
+    const auto            next  = (epoch + 1) & 1U;
+    wait_for_readers(generations_[next]); // only readers which are about to retry
+    sources_[next].store(source.release());
+    epoch_.store(epoch + 1); // publish: new readers now use `next`
+
+    wait_for_readers(generations_[epoch & 1U]); // in-flight readers of the old source
+    delete sources_[epoch & 1U].exchange(nullptr); // NOLINT unmaps the old file
+  }
+
+  // constructs a new `Source` from `args` (eg a path), and publishes it
+  template <typename... Args>
+  void reload(Args&&... args) {
+    publish(std::make_unique<Source>(std::forward<Args>(args)...));
+  }
+
+  // as `reload`, but all loading and waiting happens on a background
+  // thread. The future rethrows any exception from loading, in which
+  // case the current source stays in place.
+  template <typename... Args>
+  [[nodiscard]] std::future<void> reload_async(Args... args) {
+    return std::async(std::launch::async, [this, ... args = std::move(args)]() mutable {
+      reload(std::move(args)...);
+    });
+  }
+
+  // number of publishes so far
+  [[nodiscard]] std::uint64_t generation() const { return epoch_.load(); }
+
+private:
+  std::array<std::atomic<Source*>, 2> sources_{}; // indexed by epoch parity
+  std::atomic<std::uint64_t>          epoch_{0};
+  mutable std::array<generation_t, 2> generations_;
+  std::mutex                          reload_mutex_;
+
+  // The loads must be seq_cst, as are the readers' fetch_add and
+  // epoch_ load, and the store to epoch_ before this: then either the
+  // reader sees the new epoch and retries, or this sees its count.
+  // With acquire loads, this could read a stale 0.
+  static void wait_for_readers(const generation_t& generation) {
+    for (const auto& cntr: generation) {
+      while (cntr.readers.load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+
+} // namespace binfuse
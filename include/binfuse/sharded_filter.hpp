@@ -2,22 +2,40 @@
 
 #include "binaryfusefilter.h"
 #include "binfuse/filter.hpp"
+#include "binfuse/instrument.hpp"
 #include "mio/mmap.hpp"
 #include "mio/page.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <charconv>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iomanip>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace binfuse {
 
 // selecting the appropriate map for the access mode
@@ -27,57 +45,774 @@ struct sharded_mmap_base {
   using mmap_size_type = typename decltype(mmap)::size_type;
 };
 
+namespace detail {
+
+// LEB128, as in the packed `sharded_filter` format
+inline void write_varint(std::string& out, std::uint64_t value) {
+  do {
+    auto byte = static_cast<char>(value & 0x7FU);
+    value >>= 7U;
+    if (value != 0) byte = static_cast<char>(byte | '\x80');
+    out.push_back(byte);
+  } while (value != 0);
+}
+
+inline std::uint64_t read_varint(const char* data, std::size_t size, std::size_t& pos) {
+  std::uint64_t value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (pos == size) break;
+    const auto byte = static_cast<std::uint8_t>(data[pos++]);
+    value |= static_cast<std::uint64_t>(byte & 0x7FU) << shift;
+    if ((byte & 0x80U) == 0) return value;
+  }
+  throw std::runtime_error("corrupt packed file: truncated varint");
+}
+
+// fsyncs the directory containing `path`, so that a rename into it is
+// durable. Best effort: not all platforms and filesystems support it.
+inline void sync_directory(const std::filesystem::path& path) noexcept {
+#if defined(__unix__) || defined(__APPLE__)
+  auto dir = path.parent_path();
+  if (dir.empty()) dir = ".";
+  const int fd = ::open(dir.c_str(), O_RDONLY); // NOLINT vararg
+  if (fd >= 0) {
+    ::fsync(fd);
+    ::close(fd);
+  }
+#else
+  (void)path;
+#endif
+}
+
+/* detail::file_appender
+ *
+ * Writes a new file sequentially, for `sharded_filter::merge`. Ranges
+ * of other files are appended with copy_file_range where available,
+ * which stays in the kernel, and which the filesystem may turn into a
+ * reflink or a server side copy. Otherwise, or if that fails, eg
+ * across filesystems, they are written from memory.
+ */
+class file_appender {
+public:
+  explicit file_appender(const std::filesystem::path& path) : path_(path) {
+#if defined(__unix__) || defined(__APPLE__)
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644); // NOLINT vararg
+    if (fd_ < 0) {
+      throw std::runtime_error("failed to create: " + path.string());
+    }
+#else
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!out_) {
+      throw std::runtime_error("failed to create: " + path.string());
+    }
+#endif
+  }
+
+  file_appender(const file_appender& other)            = delete;
+  file_appender& operator=(const file_appender& other) = delete;
+  file_appender(file_appender&& other)                 = delete;
+  file_appender& operator=(file_appender&& other)      = delete;
+
+#if defined(__unix__) || defined(__APPLE__)
+  ~file_appender() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+#else
+  ~file_appender() = default;
+#endif
+
+  void append(const char* data, std::size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+    while (size > 0) {
+      const auto written = ::write(fd_, data, size);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) fail();
+      data += written; // NOLINT pointer arithmetic
+      size -= static_cast<std::size_t>(written);
+    }
+#else
+    out_.write(data, static_cast<std::streamsize>(size));
+    if (!out_) fail();
+#endif
+  }
+
+  // `size` bytes at `offset` of the file `handle`, whose contents are
+  // also at `data`, which is used if `handle` is invalid
+  void append_range(mio::file_handle_type handle, std::uintmax_t offset, const char* data,
+                    std::size_t size) {
+#if defined(__linux__)
+    if (handle != mio::invalid_handle && copy_ranges_) {
+      auto in_offset = static_cast<off_t>(offset);
+      while (size > 0) {
+        const auto copied = ::copy_file_range(handle, &in_offset, fd_, nullptr, size, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied <= 0) {
+          copy_ranges_ = false; // eg EXDEV, or unsupported: write the rest
+          break;
+        }
+        data += copied; // NOLINT pointer arithmetic
+        size -= static_cast<std::size_t>(copied);
+      }
+    }
+#else
+    (void)handle;
+    (void)offset;
+#endif
+    append(data, size);
+  }
+
+  void sync() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (::fsync(fd_) != 0) fail();
+#else
+    out_.flush();
+    if (!out_) fail();
+#endif
+  }
+
+private:
+  [[noreturn]] void fail() const { throw std::runtime_error("failed to write: " + path_.string()); }
+
+  std::filesystem::path path_;
+#if defined(__unix__) || defined(__APPLE__)
+  int fd_ = -1;
+#else
+  std::ofstream out_;
+#endif
+  bool copy_ranges_ = true;
+};
+
+} // namespace detail
+
+/* binfuse::shard_descriptor
+ *
+ * Packed, read-only descriptor of one shard: only the fields which
+ * the query kernel needs, with a pointer to the fingerprints in the
+ * mmap. Two descriptors fit in each cache line and none straddles
+ * one. An unpopulated shard has `fingerprints == nullptr`, except for
+ * the `sentinel()`, which `sharded_view` uses for unpopulated shards.
+ */
+template <filter_type FilterType>
+struct alignas(32) shard_descriptor {
+  using fingerprint_t = typename ftype<FilterType>::fingerprint_t;
+
+  std::uint64_t        seed                 = 0;
+  std::uint32_t        segment_length       = 0;
+  std::uint32_t        segment_length_mask  = 0;
+  std::uint32_t        segment_count_length = 0;
+  std::uint32_t        match_mask           = 0; // ~0 when populated, see `matches`
+  const fingerprint_t* fingerprints         = nullptr;
+
+  // Always false, for any needle: all its slots are 0, so it only
+  // ever reads the single zero fingerprint, and its `match_mask` is 0.
+  [[nodiscard]] static const shard_descriptor& sentinel() noexcept {
+    static constexpr fingerprint_t    zero_fingerprint = 0;
+    static constexpr shard_descriptor empty{0, 0, 0, 0, 0, &zero_fingerprint};
+    return empty;
+  }
+
+  // `buffer` points at a filter serialized by `filter::serialize`
+  // and must outlive this descriptor
+  [[nodiscard]] static shard_descriptor deserialize(const char* buffer) {
+    FilterType  fil{};
+    const char* fps = ftype<FilterType>::deserialize_header(&fil, buffer);
+    if (fil.Size == 0) {
+      return {}; // empty filter: no fingerprints can match
+    }
+    return {fil.Seed,
+            fil.SegmentLength,
+            fil.SegmentLengthMask,
+            fil.SegmentCountLength,
+            ~std::uint32_t{0},
+            reinterpret_cast<const fingerprint_t*>(fps)}; // NOLINT upstream API is char*
+  }
+
+  [[nodiscard]] bool is_populated() const noexcept { return fingerprints != nullptr; }
+
+  // the upstream query kernel only reads these fields, so
+  // reconstructing the c-struct on the stack costs nothing once
+  // inlined, and keeps results identical to `filter::contains`
+  [[nodiscard]] FilterType as_filter() const noexcept {
+    FilterType fil{};
+    fil.Seed               = seed;
+    fil.SegmentLength      = segment_length;
+    fil.SegmentLengthMask  = segment_length_mask;
+    fil.SegmentCountLength = segment_count_length;
+    fil.Fingerprints       = const_cast<fingerprint_t*>(fingerprints); // NOLINT upstream API
+    return fil;
+  }
+
+  // precondition: is_populated()
+  [[nodiscard]] bool contains(std::uint64_t needle) const noexcept {
+    const auto fil = as_filter();
+    return ftype<FilterType>::contains(needle, &fil);
+  }
+
+  // As `contains`, but without a branch on anything: precondition
+  // is_populated(), or the `sentinel()`, which never matches.
+  [[nodiscard]] bool matches(std::uint64_t needle) const noexcept {
+    return resolve_masked(locate(needle));
+  }
+
+  // batched query building blocks, see `filter::probe/resolve`
+  [[nodiscard]] typename filter<FilterType>::probe_t probe(std::uint64_t needle) const noexcept {
+    const auto prb = locate(needle);
+    detail::prefetch(&fingerprints[prb.slots.h0]);
+    detail::prefetch(&fingerprints[prb.slots.h1]);
+    detail::prefetch(&fingerprints[prb.slots.h2]);
+    return prb;
+  }
+
+  // as `probe`, without touching the fingerprints, eg to read them
+  // some other way
+  [[nodiscard]] typename filter<FilterType>::probe_t locate(std::uint64_t needle) const noexcept {
+    const auto          fil  = as_filter();
+    const std::uint64_t hash = binary_fuse_mix_split(needle, seed);
+    return {hash, ftype<FilterType>::hash_batch(hash, &fil)};
+  }
+
+  [[nodiscard]] bool resolve(const typename filter<FilterType>::probe_t& prb) const noexcept {
+    return (ftype<FilterType>::fingerprint(prb.hash) ^ fingerprints[prb.slots.h0] ^
+            fingerprints[prb.slots.h1] ^ fingerprints[prb.slots.h2]) == 0;
+  }
+
+  // `resolve`, for `matches`
+  [[nodiscard]] bool
+  resolve_masked(const typename filter<FilterType>::probe_t& prb) const noexcept {
+    return (match_mask & static_cast<std::uint32_t>(resolve(prb))) != 0;
+  }
+};
+
+/* binfuse::sharded_view
+ *
+ * A "compiled", read-only view of a loaded `sharded_filter`, for the
+ * hottest query paths. Every shard is resolved once, up front, and
+ * unpopulated ones are replaced by the always-false
+ * `shard_descriptor::sentinel()`. Queries are then branch-free,
+ * `noexcept` and fully inlinable, with results identical to the
+ * filter's.
+ *
+ * Produced by `sharded_filter::compile()`. The view points into the
+ * filter's memory, so the filter must outlive it, unmodified. It is
+ * thread-safe like a source.
+ */
+template <filter_type FilterType>
+class sharded_view {
+public:
+  using shard_descriptor_t = shard_descriptor<FilterType>;
+  using probe_t            = typename filter<FilterType>::probe_t;
+
+  // `shards` holds one populated or sentinel descriptor per prefix
+  sharded_view(std::vector<shard_descriptor_t> shards, std::uint8_t shard_bits)
+      : shards_(std::move(shards)), shift_(64U - shard_bits) {
+    if (shard_bits == 0 || shard_bits > 32 || shards_.size() != std::size_t{1} << shard_bits) {
+      throw std::runtime_error("sharded_view: need one shard per prefix");
+    }
+  }
+
+  [[nodiscard]] bool contains(std::uint64_t needle) const noexcept {
+    return shards_[needle >> shift_].matches(needle);
+  }
+
+  // as `sharded_filter::contains_many`, without any branches on the
+  // shards
+  void contains_many(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out) const {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("contains_many: output span is smaller than keys span.");
+    }
+    constexpr auto window_size = filter<FilterType>::batch_window;
+
+    // NOLINTBEGIN uninitialised, always written first
+    std::array<const shard_descriptor_t*, window_size> shards;
+    std::array<probe_t, window_size>                   probes;
+    // NOLINTEND
+    for (std::size_t base = 0; base < keys.size(); base += window_size) {
+      const auto window = std::min(window_size, keys.size() - base);
+      for (std::size_t i = 0; i != window; ++i) {
+        shards[i] = &shards_[keys[base + i] >> shift_];
+        detail::prefetch(shards[i]);
+      }
+      for (std::size_t i = 0; i != window; ++i) probes[i] = shards[i]->probe(keys[base + i]);
+      for (std::size_t i = 0; i != window; ++i) {
+        out[base + i] = shards[i]->resolve_masked(probes[i]) ? 1 : 0;
+      }
+    }
+  }
+
+  [[nodiscard]] std::uint8_t shard_bits() const noexcept {
+    return static_cast<std::uint8_t>(64U - shift_);
+  }
+
+private:
+  std::vector<shard_descriptor_t> shards_;
+  unsigned                        shift_;
+};
+
+/* binfuse::query_stats
+ *
+ * Optional per-thread query counters. Each query thread owns one (from
+ * `sharded_filter::make_stats`) and passes it to the query overloads,
+ * which increment it with plain, non-atomic adds. Aggregate them with
+ * `+=` once the threads are done (or whenever, while they are paused).
+ * Sharing one instance between threads is a data race.
+ *
+ * `shard_hits` counts queries per shard prefix, to find skewed shards,
+ * costs 8 bytes per shard, and is empty (ie not collected) unless
+ * requested.
+ */
+struct alignas(64) query_stats { // own cache line: no false sharing between threads
+  std::uint64_t              queries   = 0;
+  std::uint64_t              positives = 0;
+  std::vector<std::uint64_t> shard_hits;
+
+  query_stats& operator+=(const query_stats& rhs) {
+    queries += rhs.queries;
+    positives += rhs.positives;
+    if (shard_hits.size() < rhs.shard_hits.size()) {
+      shard_hits.resize(rhs.shard_hits.size());
+    }
+    for (std::size_t i = 0; i != rhs.shard_hits.size(); ++i) {
+      shard_hits[i] += rhs.shard_hits[i];
+    }
+    return *this;
+  }
+
+  // ratio of the busiest shard's hits to the mean, 1.0 = perfectly even
+  [[nodiscard]] double shard_skew() const {
+    if (queries == 0 || shard_hits.empty()) {
+      return 0.0;
+    }
+    const auto busiest = *std::max_element(shard_hits.begin(), shard_hits.end());
+    return static_cast<double>(busiest) * static_cast<double>(shard_hits.size()) /
+           static_cast<double>(queries);
+  }
+
+  void record(std::uint32_t prefix, bool found) noexcept {
+    ++queries;
+    positives += found ? 1U : 0U;
+    if (prefix < shard_hits.size()) {
+      ++shard_hits[prefix];
+    }
+  }
+};
+
+/* binfuse::build_plan
+ *
+ * Chooses `shard_bits` and build parallelism for a `sharded_filter`,
+ * so that the shard populates in flight stay within `memory_budget`
+ * bytes, at `populate_options::bytes_per_key`. Pass the plan's
+ * `shard_bits` to the sink, and the plan to `add_sorted`,
+ * `stream_prepare` or `ingest_prepare`, which then hold back further
+ * shard builds while the budget is used up.
+ *
+ * The largest shard is estimated, with a safety margin, from the
+ * highest prefix count in a sample of the keys, or assuming uniform
+ * keys from just a count. Skew is handled by choosing more
+ * shard_bits, until the largest shard fits. The smallest such
+ * shard_bits is chosen, then more while this gives more shards in
+ * flight (up to `threads`), as long as shards keep at least
+ * `min_shard_keys`. A prefix too hot to fit the budget even at
+ * `max_shard_bits` throws.
+ */
+struct build_plan {
+  std::uint8_t  shard_bits     = 8;
+  unsigned      threads        = 1;
+  std::size_t   memory_budget  = 0; // bytes, of shard populates in flight. 0 = unlimited
+  std::uint64_t max_shard_keys = 0; // estimated, with the safety margin
+
+  static constexpr std::uint8_t  max_shard_bits = 24; // as `sharded_filter`
+  static constexpr std::uint64_t min_shard_keys = 1UL << 20;
+  static constexpr std::size_t   bytes_per_key  = populate_options::bytes_per_key;
+
+  // assuming uniformly distributed keys
+  [[nodiscard]] static build_plan
+  for_count(std::uint64_t keys, std::size_t memory_budget,
+            unsigned threads = std::thread::hardware_concurrency()) {
+    return choose(keys, memory_budget, threads, [keys](unsigned bits) {
+      return with_margin(static_cast<double>(keys) / static_cast<double>(1UL << bits), 1.0);
+    });
+  }
+
+  // from a `sample` of the `keys` keys, in any order, eg every 1000th
+  [[nodiscard]] static build_plan
+  for_sample(std::span<const std::uint64_t> sample, std::uint64_t keys, std::size_t memory_budget,
+             unsigned threads = std::thread::hardware_concurrency()) {
+    if (sample.empty()) {
+      return for_count(keys, memory_budget, threads);
+    }
+    std::vector<std::uint64_t> sorted(sample.begin(), sample.end());
+    std::sort(sorted.begin(), sorted.end());
+    const double scale = static_cast<double>(keys) / static_cast<double>(sorted.size());
+    return choose(keys, memory_budget, threads, [&sorted, scale](unsigned bits) {
+      std::size_t busiest = 0;
+      const auto  shift   = 64 - bits;
+      for (std::size_t begin = 0, i = 1; i <= sorted.size(); ++i) {
+        if (i == sorted.size() || sorted[i] >> shift != sorted[begin] >> shift) {
+          busiest = std::max(busiest, i - begin);
+          begin   = i;
+        }
+      }
+      return with_margin(static_cast<double>(busiest), scale);
+    });
+  }
+
+  // samples `keys` with a fixed stride, in one pass
+  [[nodiscard]] static build_plan
+  for_keys(std::span<const std::uint64_t> keys, std::size_t memory_budget,
+           unsigned threads = std::thread::hardware_concurrency()) {
+    constexpr std::size_t      sample_size = 1UL << 20;
+    const std::size_t          stride      = std::max<std::size_t>(keys.size() / sample_size, 1);
+    std::vector<std::uint64_t> sample;
+    sample.reserve(keys.size() / stride + 1);
+    for (std::size_t i = 0; i < keys.size(); i += stride) sample.push_back(keys[i]);
+    return for_sample(sample, keys.size(), memory_budget, threads);
+  }
+
+private:
+  // a count of `count` in a sample scaled by `scale`, plus ~4 standard
+  // deviations of the (poisson) sampling error
+  static std::uint64_t with_margin(double count, double scale) {
+    return static_cast<std::uint64_t>((count + 4 * std::sqrt(count) + 1) * scale);
+  }
+
+  template <typename LargestShard>
+  static build_plan choose(std::uint64_t keys, std::size_t memory_budget, unsigned threads,
+                           const LargestShard& largest_shard) {
+    if (memory_budget == 0) {
+      throw std::runtime_error("build_plan: memory_budget must be > 0");
+    }
+    threads = std::max(threads, 1U);
+    const auto in_flight = [&](std::uint64_t shard_keys) {
+      return memory_budget / std::max<std::size_t>(shard_keys * bytes_per_key, 1);
+    };
+    build_plan plan{.memory_budget = memory_budget};
+    unsigned   bits     = 1;
+    plan.max_shard_keys = largest_shard(bits);
+    while (in_flight(plan.max_shard_keys) == 0) { // not even one shard fits
+      if (bits == max_shard_bits) {
+        throw std::runtime_error(
+            "build_plan: a shard of ~" + std::to_string(plan.max_shard_keys) +
+            " keys, even with max_shard_bits, exceeds the memory budget of " +
+            std::to_string(memory_budget) + " bytes. The keys are too skewed.");
+      }
+      plan.max_shard_keys = largest_shard(++bits);
+    }
+    while (bits < max_shard_bits && in_flight(plan.max_shard_keys) < threads &&
+           (keys >> (bits + 1)) >= min_shard_keys) {
+      const auto smaller = largest_shard(bits + 1);
+      if (in_flight(smaller) <= in_flight(plan.max_shard_keys)) break; // skew: no better
+      plan.max_shard_keys = smaller;
+      ++bits;
+    }
+    plan.shard_bits = static_cast<std::uint8_t>(bits);
+    plan.threads =
+        static_cast<unsigned>(std::clamp<std::size_t>(in_flight(plan.max_shard_keys), 1, threads));
+    return plan;
+  }
+};
+
+// how a `sharded_filter` source prepares its shards on load
+//
+// eager: all shard headers are deserialized and validated on load.
+//
+// lazy: only the file header is checked on load. Each shard is
+// deserialized and validated on its first query, exactly once, in a
+// thread-safe manner. Opening is then almost free, regardless of the
+// number of shards. Sinks always load eagerly.
+enum class load_mode { eager, lazy };
+
 /* sharded_bin_fuse_filter.
  *
  * Wraps a set of `binfuse::filter`s.
  * Saves/loads them to/from an mmap'd file via mio::mmap.
  * Directs `contains` queries to the apropriate sub-filter.
  *
+ * Thread safety: once loaded, all const member functions of a source
+ * may be called concurrently from any number of threads. The read path
+ * takes no locks and writes no shared state: the mmap and shards table
+ * are immutable after load. The only exception is lazy mode, where each
+ * shard's table entry is written exactly once under its own
+ * std::once_flag, after which that shard's queries are read-only again.
+ * Per-thread instrumentation goes in caller owned `query_stats`.
+ * Sinks, and `set_filename` on a source, are not thread-safe.
+ *
+ * `Instrument` is an optional, process wide, instrumentation policy,
+ * see instrument.hpp, which is a no-op by default. Shards count as
+ * one query each in the batch paths, and only single-key `contains`
+ * is latency sampled. The shards themselves are uninstrumented
+ * `filter`s, so `add_shard` accepts the same filters either way.
  */
-template <filter_type FilterType, mio::access_mode AccessMode>
+template <filter_type FilterType, mio::access_mode AccessMode,
+          instrumentation_policy Instrument = no_instrumentation>
 class sharded_filter : private sharded_mmap_base<AccessMode> {
 public:
-  using shard_filter_t = filter<FilterType>;
+  using shard_filter_t     = filter<FilterType>;
+  using shard_descriptor_t = shard_descriptor<FilterType>;
 
   static constexpr std::uint32_t nbits = sizeof(typename ftype<FilterType>::fingerprint_t) * 8;
 
   sharded_filter() = default;
-  explicit sharded_filter(std::filesystem::path path, std::uint8_t shard_bits = 8)
-      : filepath_(std::move(path)), shard_bits_(shard_bits) {
-    load();
+  // `opts` only apply to sources
+  explicit sharded_filter(std::filesystem::path path, std::uint8_t shard_bits = 8,
+                          load_mode mode = load_mode::eager, const map_options& opts = {})
+      : filepath_(std::move(path)), shard_bits_(shard_bits), lazy_(is_lazy(mode)) {
+    load(opts);
+  }
+
+  sharded_filter(const sharded_filter& other)          = delete;
+  sharded_filter& operator=(const sharded_filter& rhs) = delete;
+
+  sharded_filter(sharded_filter&& other) noexcept            = default;
+  sharded_filter& operator=(sharded_filter&& rhs) noexcept = default;
+
+  ~sharded_filter() {
+    if constexpr (AccessMode == mio::access_mode::write) {
+      discard_pending(); // eg after a throw mid build: in flight shards use arenas_
+      remove_spill_files();
+      trim_file();
+    }
   }
 
   // make a default constructor possible
-  void set_filename(std::filesystem::path path, std::uint8_t shard_bits = 8) {
+  void set_filename(std::filesystem::path path, std::uint8_t shard_bits = 8,
+                    load_mode mode = load_mode::eager, const map_options& opts = {}) {
     filepath_   = std::move(path);
     shard_bits_ = shard_bits;
-    load();
+    lazy_       = is_lazy(mode);
+    load(opts);
   }
 
   [[nodiscard]] bool contains(std::uint64_t needle) const {
-    const auto prefix = extract_prefix(needle);
     // we know prefix is always < max_shards() by definition
-    const auto& filter = filters[prefix];
-    if (!filter.is_populated()) {
-      // this filter has not been populated. no fingerprint pointer
-      // has been set and an upstream `contain` call will throw
-      return false;
+    const auto prefix = extract_prefix(needle);
+    return instrument_.query(prefix, [this, prefix, needle] {
+      const auto& shard = shard_at(prefix);
+      return shard.is_populated() && shard.contains(needle);
+    });
+  }
+
+  // as above, recording the query into this thread's `stats`
+  [[nodiscard]] bool contains(std::uint64_t needle, query_stats& stats) const {
+    const auto prefix = extract_prefix(needle);
+    const auto found  = contains(needle);
+    stats.record(prefix, found);
+    return found;
+  }
+
+  // stats for one query thread, optionally with per-shard hit counts
+  [[nodiscard]] query_stats make_stats(bool per_shard = true) const {
+    query_stats stats;
+    if (per_shard) {
+      stats.shard_hits.resize(max_shards());
+    }
+    return stats;
+  }
+
+  [[nodiscard]] const Instrument& instrument() const { return instrument_; }
+
+  // eg to share one `instrumentation` between many filters. Resets its
+  // per-shard counts, if it had a different number of shards.
+  void set_instrument(Instrument instrument) {
+    instrument_ = std::move(instrument);
+    instrument_.shards(max_shards());
+  }
+
+  // Batched `contains`: writes 1 to `out[i]` if `keys[i]` is
+  // contained, 0 otherwise. `out` must be at least as large as `keys`.
+  //
+  // Each window of keys is processed in 3 passes: prefixes (prefetch
+  // the shard's filter), fingerprint slots (prefetch those), and
+  // finally resolve. This keeps many of the dependent cache misses of
+  // `contains` in flight at once.
+  void contains_many(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out) const {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("contains_many: output span is smaller than keys span.");
+    }
+    constexpr auto window_size = shard_filter_t::batch_window;
+
+    // NOLINTBEGIN uninitialised, always written first
+    std::array<const shard_descriptor_t*, window_size>        shards;
+    std::array<typename shard_filter_t::probe_t, window_size> probes;
+    // NOLINTEND
+    for (std::size_t base = 0; base < keys.size(); base += window_size) {
+      const auto window = std::min(window_size, keys.size() - base);
+      for (std::size_t i = 0; i != window; ++i) {
+        const auto prefix = extract_prefix(keys[base + i]);
+        instrument_.count(prefix);
+        shards[i] = &shard_at(prefix);
+        detail::prefetch(shards[i]);
+      }
+      for (std::size_t i = 0; i != window; ++i) {
+        if (shards[i]->is_populated()) {
+          probes[i] = shards[i]->probe(keys[base + i]);
+        }
+      }
+      for (std::size_t i = 0; i != window; ++i) {
+        out[base + i] = shards[i]->is_populated() && shards[i]->resolve(probes[i]) ? 1 : 0;
+      }
     }
-    return filter.contains(needle);
+  }
+
+  // as above, recording all queries into this thread's `stats`
+  void contains_many(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out,
+                     query_stats& stats) const {
+    contains_many(keys, out);
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      stats.record(extract_prefix(keys[i]), out[i] != 0);
+    }
+  }
+
+  // Cache blocked batch query, for large offline jobs: same results
+  // as `contains_many`, but `keys` are first radix partitioned by (up
+  // to `partition_bits` of) their prefix. Each partition, ie a run of
+  // adjacent shards in the file, is then queried while its pages are
+  // hot, with the next partition's shards read ahead. Results are
+  // scattered back into `out` in the original order. Partitioning and
+  // querying are spread over `threads`, each querying a contiguous
+  // range of partitions, so that file access stays mostly sequential.
+  // Needs 17 bytes of scratch memory per key.
+  void contains_partitioned(std::span<const std::uint64_t> keys, std::span<std::uint8_t> out,
+                            unsigned threads = std::thread::hardware_concurrency()) const {
+    if (out.size() < keys.size()) {
+      throw std::runtime_error("contains_partitioned: output span is smaller than keys span.");
+    }
+    const unsigned    pbits   = std::min<unsigned>(shard_bits_, partition_bits);
+    const std::size_t parts   = std::size_t{1} << pbits;
+    const std::size_t workers = std::clamp<std::size_t>(threads, 1, keys.size() / 4096 + 1);
+    const auto chunk = [&](std::size_t worker) { // [begin, end) of this worker's keys
+      return std::pair{keys.size() * worker / workers, keys.size() * (worker + 1) / workers};
+    };
+    const auto partition = [&](std::uint64_t key) { return key >> (sizeof(key) * 8 - pbits); };
+
+    // per (worker, partition) counts, then turned into scatter offsets
+    std::vector<std::size_t> offsets(workers * parts);
+    run_parallel(workers, [&](std::size_t worker) {
+      const auto [begin, end] = chunk(worker);
+      auto* counts            = &offsets[worker * parts];
+      for (std::size_t i = begin; i != end; ++i) ++counts[partition(keys[i])];
+    });
+    std::vector<std::size_t> part_begin(parts + 1);
+    std::size_t              running = 0;
+    for (std::size_t p = 0; p != parts; ++p) {
+      part_begin[p] = running;
+      for (std::size_t worker = 0; worker != workers; ++worker) {
+        running += std::exchange(offsets[worker * parts + p], running);
+      }
+    }
+    part_begin[parts] = running;
+
+    std::vector<std::uint64_t> sorted(keys.size());
+    std::vector<std::uint64_t> order(keys.size()); // original index of each sorted key
+    run_parallel(workers, [&](std::size_t worker) {
+      const auto [begin, end] = chunk(worker);
+      auto* next              = &offsets[worker * parts];
+      for (std::size_t i = begin; i != end; ++i) {
+        const auto pos = next[partition(keys[i])]++;
+        sorted[pos]    = keys[i];
+        order[pos]     = i;
+      }
+    });
+
+    std::vector<std::uint8_t> found(keys.size());
+    const std::uint32_t       shards_per_part = 1U << (shard_bits_ - pbits);
+    run_parallel(workers, [&](std::size_t worker) {
+      const auto [begin, end] = chunk(worker);
+      // partitions starting in this worker's share of sorted keys
+      auto part = static_cast<std::size_t>(
+          std::lower_bound(part_begin.begin(), part_begin.end(), begin) - part_begin.begin());
+      for (; part < parts && part_begin[part] < end; ++part) {
+        const auto count = part_begin[part + 1] - part_begin[part];
+        if (count == 0) continue;
+        if (part + 1 < parts && part_begin[part + 2] != part_begin[part + 1]) {
+          for (std::uint32_t i = 0; i != shards_per_part; ++i) {
+            will_need(static_cast<std::uint32_t>(part + 1) * shards_per_part + i);
+          }
+        }
+        contains_many(std::span(sorted).subspan(part_begin[part], count),
+                      std::span(found).subspan(part_begin[part], count));
+      }
+    });
+
+    run_parallel(workers, [&](std::size_t worker) {
+      const auto [begin, end] = chunk(worker);
+      for (std::size_t i = begin; i != end; ++i) out[order[i]] = found[i];
+    });
+  }
+
+  // Checks `keys` for false negatives, eg after a build: batched, in
+  // parallel and optionally sampled, see `verify_options`.
+  [[nodiscard]] verify_result verify(std::span<const std::uint64_t> keys,
+                                     const verify_options& opts = {}) const {
+    return detail::verify_keys(keys, opts, [this](auto batch, auto out) {
+      contains_many(batch, out);
+    });
   }
 
   [[nodiscard]] std::uint32_t extract_prefix(std::uint64_t key) const {
     return static_cast<std::uint32_t>(key >> (sizeof(key) * 8 - shard_bits_));
   }
 
-  void stream_prepare()
+  // A branch-free, read-only view of all shards, for the hottest query
+  // paths, see `sharded_view`. In lazy mode, this loads all shards.
+  [[nodiscard]] sharded_view<FilterType> compile() const {
+    std::vector<shard_descriptor_t> shards(max_shards());
+    for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+      const auto& shard = shard_at(prefix);
+      shards[prefix]    = shard.is_populated() ? shard : shard_descriptor_t::sentinel();
+    }
+    return {std::move(shards), shard_bits_};
+  }
+
+  // For readers which bypass the mmap, eg `async_query`: the shard
+  // descriptor for `key`, the file handle of the mapping and the file
+  // offset of a pointer into it. The handle is `mio::invalid_handle`
+  // when the source is served from anonymous memory (an
+  // `anonymous_copy` or a packed file).
+  [[nodiscard]] const shard_descriptor_t& shard_for(std::uint64_t key) const {
+    return shard_at(extract_prefix(key));
+  }
+
+  [[nodiscard]] mio::file_handle_type file_handle() const {
+    return anon_copy_.empty() ? this->mmap.file_handle() : mio::invalid_handle;
+  }
+
+  [[nodiscard]] std::uint64_t file_offset(const void* ptr) const {
+    return static_cast<std::uint64_t>(static_cast<const char*>(ptr) - map_data());
+  }
+
+  // Streaming API: keys must be `stream_add`ed in ascending order.
+  //
+  // With `threads` > 1, each completed shard is populated
+  // asynchronously while further keys are streamed in. At most
+  // `threads` shards are in flight at any one time, which bounds peak
+  // memory. Shards are still written to the file in prefix order.
+  //
+  // All bulk builds (stream, ingest and `add_sorted`) populate each
+  // shard with one of this sink's `build_arena`s, one per shard in
+  // flight, which are kept for the sink's lifetime. So after the
+  // largest shards, building allocates nothing.
+  //
+  // With a `memory_budget` (bytes, see `build_plan`), further shards
+  // are also held back while the shards in flight would exceed it, and
+  // arenas are released to stay within it.
+  void stream_prepare(unsigned threads = 1, std::size_t memory_budget = 0)
     requires(AccessMode == mio::access_mode::write)
   {
+    discard_pending();
+    stream_threads_ = std::max(threads, 1U);
+    build_budget_   = memory_budget;
     stream_keys_.clear();
     stream_last_prefix_ = 0;
     stream_last_key_    = 0;
   }
 
+  void stream_prepare(const build_plan& plan)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    check_plan(plan);
+    stream_prepare(plan.threads, plan.memory_budget);
+  }
+
   void stream_add(std::uint64_t key)
     requires(AccessMode == mio::access_mode::write)
   {
@@ -87,9 +822,7 @@ public:
     stream_last_key_ = key;
     auto prefix      = extract_prefix(key);
     if (prefix != stream_last_prefix_) {
-
-      add_shard(shard_filter_t(stream_keys_), stream_last_prefix_);
-      stream_keys_.clear();
+      build_stream_shard();
       stream_last_prefix_ = prefix;
     }
     stream_keys_.emplace_back(key);
@@ -99,10 +832,150 @@ public:
     requires(AccessMode == mio::access_mode::write)
   {
     if (!stream_keys_.empty()) {
-      add_shard(shard_filter_t(stream_keys_), stream_last_prefix_);
+      build_stream_shard();
+    }
+    write_pending_shards();
+  }
+
+  // Ingest API: keys may be `ingest_add`ed in any order.
+  //
+  // Keys are bucketed by their (up to `spill_bits`) high bits into
+  // temporary spill files in `spill_dir` (default: next to the filter
+  // file), with buffered sequential writes. `ingest_finalize` then
+  // reads back one bucket at a time, partitions it by prefix, without
+  // sorting, and builds its shards with up to `threads` in flight.
+  // Peak RAM is about twice the largest bucket, ie the largest shard
+  // for shard_bits <= spill_bits. Needs free disk space for 8 bytes
+  // per key.
+  void ingest_prepare(unsigned threads = 1, const std::filesystem::path& spill_dir = {},
+                      std::size_t memory_budget = 0)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    remove_spill_files();
+    stream_threads_ = std::max(threads, 1U);
+    build_budget_   = memory_budget;
+    spill_bits_     = std::min(shard_bits_, spill_bits);
+    const auto dir  = !spill_dir.empty()                  ? spill_dir
+                      : filepath_.parent_path().empty() ? std::filesystem::path(".")
+                                                        : filepath_.parent_path();
+    spill_.resize(std::size_t{1} << spill_bits_);
+    for (std::size_t i = 0; i != spill_.size(); ++i) {
+      auto& bucket = spill_[i];
+      bucket.path  = dir / (filepath_.filename().string() + ".spill." + std::to_string(i));
+      bucket.file.open(bucket.path, std::ios::binary | std::ios::trunc);
+      if (!bucket.file) {
+        throw std::runtime_error("sharded_filter: ingest: cannot create spill file: " +
+                                 bucket.path.string());
+      }
+      bucket.buffer.reserve(spill_buffer_keys);
+    }
+  }
+
+  void ingest_prepare(const build_plan& plan, const std::filesystem::path& spill_dir = {})
+    requires(AccessMode == mio::access_mode::write)
+  {
+    check_plan(plan);
+    ingest_prepare(plan.threads, spill_dir, plan.memory_budget);
+  }
+
+  void ingest_add(std::uint64_t key)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (spill_.empty()) {
+      throw std::runtime_error("sharded_filter: ingest_add: call ingest_prepare first");
+    }
+    auto& bucket = spill_[key >> (sizeof(key) * 8 - spill_bits_)];
+    bucket.buffer.push_back(key);
+    if (bucket.buffer.size() == spill_buffer_keys) {
+      flush_spill(bucket);
+    }
+  }
+
+  void ingest_finalize()
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (spill_.empty()) {
+      throw std::runtime_error("sharded_filter: ingest_finalize: call ingest_prepare first");
+    }
+    for (auto& bucket: spill_) {
+      flush_spill(bucket);
+      bucket.file.close();
+    }
+    discard_pending();
+    const std::uint32_t shards_per_bucket = 1U << (shard_bits_ - spill_bits_);
+    std::vector<std::uint64_t> spilled;
+    std::vector<std::uint64_t> keys;
+    std::vector<std::size_t>   starts(shards_per_bucket + 1);
+    try {
+      for (std::size_t i = 0; i != spill_.size(); ++i) {
+        read_spill(spill_[i], spilled);
+
+        // counting partition by prefix, into `keys`
+        const auto first_prefix = static_cast<std::uint32_t>(i) * shards_per_bucket;
+        std::fill(starts.begin(), starts.end(), 0);
+        for (auto key: spilled) ++starts[extract_prefix(key) - first_prefix + 1];
+        for (std::size_t p = 0; p != shards_per_bucket; ++p) starts[p + 1] += starts[p];
+        keys.resize(spilled.size());
+        auto next = starts;
+        for (auto key: spilled) keys[next[extract_prefix(key) - first_prefix]++] = key;
+
+        for (std::uint32_t p = 0; p != shards_per_bucket; ++p) {
+          if (starts[p + 1] != starts[p]) {
+            build_shard(std::span<const std::uint64_t>(keys).subspan(starts[p],
+                                                                     starts[p + 1] - starts[p]),
+                        first_prefix + p);
+          }
+        }
+        write_pending_shards(); // before `keys` is reused
+      }
+    } catch (...) {
+      discard_pending(); // before `keys`, which they read, is destroyed
+      throw;
+    }
+    remove_spill_files();
+  }
+
+  // Bulk build from all `keys`, which must be sorted ascending. Shards
+  // are populated directly from the per-prefix ranges of `keys`,
+  // without copying, with up to `threads` shards in flight at once,
+  // and optionally within a `memory_budget`, as `stream_prepare`.
+  void add_sorted(std::span<const std::uint64_t> keys,
+                  unsigned    threads       = std::thread::hardware_concurrency(),
+                  std::size_t memory_budget = 0)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (!std::is_sorted(keys.begin(), keys.end())) { // before anything is built
+      throw std::runtime_error("sharded_filter: add_sorted: key out of order");
+    }
+    discard_pending();
+    stream_threads_   = std::max(threads, 1U);
+    build_budget_     = memory_budget;
+    std::size_t start = 0;
+    try {
+      for (std::size_t i = 1; i <= keys.size(); ++i) {
+        if (i == keys.size() || extract_prefix(keys[i]) != extract_prefix(keys[start])) {
+          build_shard(keys.subspan(start, i - start), extract_prefix(keys[start]));
+          start = i;
+        }
+      }
+      write_pending_shards();
+    } catch (...) {
+      discard_pending(); // `keys` need not outlive this call
+      throw;
     }
   }
 
+  void add_sorted(std::span<const std::uint64_t> keys, const build_plan& plan)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    check_plan(plan);
+    add_sorted(keys, plan.threads, plan.memory_budget);
+  }
+
+  // The new shard is serialized at the end of the data. The file is
+  // grown geometrically, so that it is only remapped (and the
+  // shard descriptors rebased) O(log(shards)) times. Any slack at end
+  // of file is trimmed when this sink is destroyed.
   void add_shard(const shard_filter_t& new_filter, std::uint32_t prefix)
     requires(AccessMode == mio::access_mode::write)
   {
@@ -110,50 +983,326 @@ public:
       throw std::runtime_error("sharded filter has reached max_shards of " +
                                std::to_string(max_shards()));
     }
+    if (new_filter.is_partitioned()) {
+      throw std::runtime_error("a partitioned filter can not be added as a shard, prefix = " +
+                               std::to_string(prefix) + ". Use more shard_bits.");
+    }
+    if (filter_offset(prefix) != empty_offset) {
+      throw std::runtime_error("there is already a filter in this file for prefix = " +
+                               std::to_string(prefix));
+    }
 
-    std::uintmax_t new_size = ensure_header();
+    [[maybe_unused]] const auto faults = instrument_.faults(fault_site::add_shard);
 
     const std::size_t size_req          = new_filter.serialization_bytes();
-    const offset_t    new_filter_offset = new_size; // place new filter at end
-    new_size += size_req;
+    const offset_t    new_filter_offset = data_end_; // place new filter at end
+    reserve(new_filter_offset + size_req);
+
+    {
+      [[maybe_unused]] const auto scope = instrument_.phase(build_phase::serialize);
+      new_filter.serialize(
+          &this->mmap[static_cast<mmap_size_t>(new_filter_offset)]); // insert the data
+    }
+    copy_to_map(new_filter_offset, filter_index_offset(prefix));  // then set up the index ptr
+    shards_table_[prefix] =
+        shard_descriptor_t::deserialize(&this->mmap[static_cast<mmap_size_t>(new_filter_offset)]);
+    data_end_ += size_req;
+    ++shards_;
+  }
+
+  // Replaces the shard for `prefix` with `new_filter`, eg because its
+  // keys changed, or adds it, if there is none yet. The new shard is
+  // appended at the end of the data, and synced to disk before its
+  // index entry is switched over with one aligned 8 byte store, so
+  // that, even after a crash, the file refers to either the old or the
+  // new shard, never to a partial one. The space of the old shard
+  // becomes free, but is not reused: a source in another process may
+  // still be reading it through its own mapping. Only `compact`,
+  // which replaces the file, reclaims it.
+  void replace_shard(const shard_filter_t& new_filter, std::uint32_t prefix)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (prefix >= max_shards()) {
+      throw std::runtime_error("replace_shard: prefix out of range: " + std::to_string(prefix));
+    }
+    if (filter_offset(prefix) == empty_offset) {
+      add_shard(new_filter, prefix);
+      return;
+    }
+    if (new_filter.is_partitioned()) {
+      throw std::runtime_error("a partitioned filter can not be added as a shard, prefix = " +
+                               std::to_string(prefix) + ". Use more shard_bits.");
+    }
 
+    const std::size_t size_req   = new_filter.serialization_bytes();
+    const offset_t    new_offset = data_end_; // append only, see above
+    reserve(new_offset + size_req);
+    data_end_ += size_req;
+    {
+      [[maybe_unused]] const auto scope = instrument_.phase(build_phase::serialize);
+      new_filter.serialize(&this->mmap[static_cast<mmap_size_t>(new_offset)]);
+    }
+    sync(); // the new shard is on disk, before the index refers to it
+    std::atomic_ref<offset_t>(
+        *reinterpret_cast<offset_t*>(&this->mmap[filter_index_offset(prefix)])) // NOLINT aligned
+        .store(new_offset);
     sync();
-    std::filesystem::resize_file(filepath_, new_size);
-    map_whole_file();
+    shards_table_[prefix] =
+        shard_descriptor_t::deserialize(&this->mmap[static_cast<mmap_size_t>(new_offset)]);
+  }
 
-    auto old_filter_offset = get_from_map<offset_t>(filter_index_offset(prefix));
+  // bytes in the data section which are not used by any shard, ie
+  // which `compact` would reclaim
+  [[nodiscard]] std::uintmax_t free_bytes() const
+    requires(AccessMode == mio::access_mode::write)
+  {
+    std::uintmax_t used = 0;
+    for (const auto& [start, end]: shard_extents()) used += end - start;
+    return data_end_ - (header_length() + index_length()) - used;
+  }
 
-    if (old_filter_offset != empty_offset) {
-      throw std::runtime_error("there is already a filter in this file for prefix = " +
-                               std::to_string(prefix));
+  // Rewrites the file with all shards contiguous, in prefix order,
+  // which reclaims all free space. A complete new file is written and
+  // synced alongside, and then renamed over the old one, so a crash
+  // leaves either the old or the new file intact. Sources which have
+  // the old file open keep reading it, until they reopen.
+  void compact()
+    requires(AccessMode == mio::access_mode::write)
+  {
+    auto tmp_path = filepath_;
+    tmp_path += ".compact";
+    {
+      std::vector<offset_t> index(max_shards(), empty_offset);
+      offset_t              new_end = header_length() + index_length();
+      for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+        if (auto offset = filter_offset(prefix); offset != empty_offset) {
+          index[prefix] = new_end;
+          new_end += serialization_bytes_at(offset);
+        }
+      }
+      {
+        const std::ofstream touch(tmp_path);
+      }
+      std::filesystem::resize_file(tmp_path, new_end);
+      std::error_code err;
+      mio::mmap_sink  out;
+      out.map(tmp_path.string(), err);
+      if (err) {
+        throw std::runtime_error("sharded_bin_fuse_filter:: compact: mmap.map(): " + err.message());
+      }
+      memcpy(out.data(), map_data(), header_length());
+      memcpy(out.data() + index_start(), index.data(), index_length());
+      for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+        if (index[prefix] != empty_offset) {
+          const auto offset = filter_offset(prefix);
+          memcpy(out.data() + index[prefix], map_data() + offset, serialization_bytes_at(offset));
+        }
+      }
+      out.sync(err);
+      if (err) {
+        throw std::runtime_error("sharded_bin_fuse_filter:: compact: mmap.sync(): " +
+                                 err.message());
+      }
     }
-    copy_to_map(new_filter_offset, filter_index_offset(prefix)); // set up the index ptr
-    new_filter.serialize(
-        &this->mmap[static_cast<mmap_size_t>(new_filter_offset)]); // insert the data
-    index[prefix] = new_filter_offset;
-    ++shards_;
-    sync(); // save all changes
-    // because has been re-mapped above, need to reload all filters as ptrs to
-    // Fingerprints will likely have changed
-    load_filters();
+    sync();
+    this->mmap.unmap(); // required before replacing the file on some platforms
+    std::filesystem::rename(tmp_path, filepath_);
+    detail::sync_directory(filepath_); // the rename itself is durable
+    ensure_header();                   // remap and reload the shards
+  }
+
+  // Writes a packed copy of this filter to `packed_path`, for
+  // transfer or cold storage: the index, which is mostly empty for
+  // sparse files, becomes a compact varint table, and free space and
+  // growth slack are dropped. The fingerprints themselves are random,
+  // and stored as is. A source opened on a packed file unpacks it, in
+  // parallel, into anonymous memory (huge pages with
+  // `map_options::huge_pages`) and is then used as normal.
+  void save_packed(const std::filesystem::path& packed_path) const {
+    std::vector<std::pair<std::uint32_t, std::size_t>> shards; // prefix, bytes
+    std::uint64_t                                      total = 0;
+    for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+      if (auto offset = filter_offset(prefix); offset != empty_offset) {
+        shards.emplace_back(prefix, serialization_bytes_at(offset));
+        total += shards.back().second;
+      }
+    }
+    std::string header(packed_header_length, '\0');
+    const auto  tag   = packed_tag();
+    const auto  bits  = static_cast<std::uint32_t>(shard_bits_);
+    const auto  count = static_cast<std::uint32_t>(shards.size());
+    memcpy(header.data(), tag.data(), tag.size());
+    memcpy(&header[16], &bits, sizeof(bits));
+    memcpy(&header[20], &count, sizeof(count));
+    memcpy(&header[24], &total, sizeof(total));
+
+    std::string   table;
+    std::uint64_t last = 0;
+    for (const auto& [prefix, bytes]: shards) {
+      detail::write_varint(table, prefix + 1 - last);
+      detail::write_varint(table, bytes);
+      last = prefix + 1;
+    }
+
+    std::ofstream out(packed_path, std::ios::binary | std::ios::trunc);
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    out.write(table.data(), static_cast<std::streamsize>(table.size()));
+    for (const auto& [prefix, bytes]: shards) {
+      out.write(&map_data()[filter_offset(prefix)], static_cast<std::streamsize>(bytes));
+    }
+    if (!out) {
+      throw std::runtime_error("save_packed: failed to write: " + packed_path.string());
+    }
+  }
+
+  // Merges sharded filter files which were built independently, eg
+  // on the nodes of a build cluster, each with its own prefixes, into
+  // a new file at `output`. All inputs must be of this type and have
+  // `shard_bits`, and no prefix may be in more than one of them. Only
+  // the header and index are built; the shards are copied as is, in
+  // prefix order, without deserializing them, see
+  // `detail::file_appender`. The output is written alongside, synced
+  // and then renamed into place, and is removed again on failure.
+  static void merge(std::span<const std::filesystem::path> inputs,
+                    const std::filesystem::path& output, std::uint8_t shard_bits = 8)
+    requires(AccessMode == mio::access_mode::read)
+  {
+    if (inputs.empty()) {
+      throw std::runtime_error("merge: no inputs");
+    }
+    std::vector<sharded_filter> sources; // lazy: only the headers are checked
+    sources.reserve(inputs.size());
+    for (const auto& input: inputs) sources.emplace_back(input, shard_bits, load_mode::lazy);
+
+    const auto&                        first = sources.front();
+    std::vector<const sharded_filter*> owner(first.max_shards(), nullptr);
+    std::vector<offset_t>              index(first.max_shards(), empty_offset);
+    std::vector<std::size_t>           sizes(first.max_shards(), 0);
+    offset_t                           end = first.header_length() + first.index_length();
+    for (std::size_t i = 0; i != sources.size(); ++i) {
+      for (std::uint32_t prefix = 0; prefix != first.max_shards(); ++prefix) {
+        if (sources[i].filter_offset(prefix) == empty_offset) continue;
+        if (owner[prefix] != nullptr) {
+          throw std::runtime_error("merge: prefix " + std::to_string(prefix) +
+                                   " is in more than one input, eg " + inputs[i].string());
+        }
+        owner[prefix] = &sources[i];
+      }
+    }
+    for (std::uint32_t prefix = 0; prefix != first.max_shards(); ++prefix) {
+      if (const auto* src = owner[prefix]; src != nullptr) {
+        // the inputs are lazy, so this is where their shards are validated
+        sizes[prefix] = src->checked_serialization_bytes(prefix, src->filter_offset(prefix));
+        index[prefix] = end;
+        end += sizes[prefix];
+      }
+    }
+
+    auto tmp_path = output;
+    tmp_path += ".merge";
+    try {
+      {
+        detail::file_appender out(tmp_path);
+        out.append(first.map_data(), first.header_length()); // the same for all inputs
+        out.append(reinterpret_cast<const char*>(index.data()), // NOLINT reinterpret_cast
+                   first.index_length());
+        for (std::uint32_t prefix = 0; prefix != first.max_shards(); ++prefix) {
+          if (const auto* src = owner[prefix]; src != nullptr) {
+            const auto offset = src->filter_offset(prefix);
+            out.append_range(src->file_handle(), offset, &src->map_data()[offset], sizes[prefix]);
+          }
+        }
+        out.sync();
+      }
+      std::filesystem::rename(tmp_path, output);
+    } catch (...) {
+      std::error_code err;
+      std::filesystem::remove(tmp_path, err); // best effort
+      throw;
+    }
+    detail::sync_directory(output);
   }
 
-  [[nodiscard]] std::size_t shards() const { return shards_; }
+  // Hint to the OS that the given shard will be queried soon, eg
+  // because it is known to be hot. Its pages are read ahead
+  // asynchronously (where supported) and, in lazy mode, it is loaded
+  // now rather than on first query.
+  void will_need(std::uint32_t prefix) const {
+    if (prefix >= max_shards()) {
+      throw std::runtime_error("will_need: prefix out of range: " + std::to_string(prefix));
+    }
+    (void)shard_at(prefix);
+    if (auto offset = filter_offset(prefix); offset != empty_offset) {
+      advise_will_need(offset, serialization_bytes_at(offset));
+    }
+  }
+
+  // in lazy mode this counts the populated index entries
+  [[nodiscard]] std::size_t shards() const { return lazy_ ? count_shards() : shards_; }
   [[nodiscard]] std::size_t size() const { return size_; }
 
 private:
-  std::vector<std::uintmax_t> index;
-  std::vector<shard_filter_t> filters;
-  std::filesystem::path       filepath_;
-  std::uint8_t                shard_bits_ = 8;
-  std::uint32_t               shards_     = 0;
-  std::uint64_t               size_       = 0;
+  // radix of `contains_partitioned`: 64k partitions
+  static constexpr unsigned partition_bits = 16;
+
+  // runs fn(0..workers-1) concurrently, fn(0) on the calling thread
+  template <typename Func>
+  static void run_parallel(std::size_t workers, const Func& fn) {
+    std::vector<std::future<void>> futures;
+    futures.reserve(workers - 1);
+    for (std::size_t worker = 1; worker < workers; ++worker) {
+      futures.push_back(std::async(std::launch::async, fn, worker));
+    }
+    fn(0);
+    for (auto& future: futures) future.get();
+  }
+
+  // one per prefix, read-only after load. In lazy mode, each entry is
+  // written exactly once, under its `shard_once_` flag.
+  mutable std::vector<shard_descriptor_t>   shards_table_;
+  mutable std::unique_ptr<std::once_flag[]> shard_once_; // NOLINT lazy mode only
+  detail::anonymous_buffer                  anon_copy_;  // map_options::anonymous_copy only
+  std::filesystem::path                     filepath_;
+  std::uint8_t                              shard_bits_ = 8;
+  bool                                      lazy_       = false;
+  std::uint32_t                             shards_     = 0;
+  std::uint64_t                             size_       = 0;
+  std::uintmax_t                            data_end_   = 0; // sink: where next shard goes
+
+  [[no_unique_address]] Instrument instrument_;
 
   std::vector<std::uint64_t> stream_keys_;
   std::uint32_t              stream_last_prefix_ = 0;
   std::uint64_t              stream_last_key_    = 0;
+  unsigned                   stream_threads_     = 1;
+
+  // before `pending_`, so that they are also destroyed after it
+  std::vector<std::unique_ptr<build_arena>> arenas_;      // at most one per shard in flight
+  std::vector<build_arena*>                 free_arenas_; // not used by any pending shard
+
+  struct pending_shard {
+    std::uint32_t               prefix;
+    std::future<shard_filter_t> filter;
+    build_arena*                arena; // which `filter` borrows from
+    std::size_t                 bytes; // estimated populate memory
+  };
+  std::deque<pending_shard> pending_; // in prefix order
+
+  std::size_t build_budget_    = 0; // bytes, 0 = unlimited
+  std::size_t in_flight_bytes_ = 0; // of `pending_`
 
-  using offset_t                     = typename decltype(index)::value_type;
+  // ingest API: one spill file per bucket of adjacent prefixes
+  static constexpr std::uint8_t spill_bits        = 8;
+  static constexpr std::size_t  spill_buffer_keys = 8192; // 64kB per bucket
+  struct spill_bucket {
+    std::filesystem::path      path;
+    std::ofstream              file;
+    std::vector<std::uint64_t> buffer;
+  };
+  std::vector<spill_bucket> spill_;
+  std::uint8_t              spill_bits_ = 0;
+
+  using offset_t                     = std::uintmax_t;
   using mmap_size_t                  = sharded_mmap_base<AccessMode>::mmap_size_type;
   static constexpr auto empty_offset = static_cast<offset_t>(-1);
 
@@ -164,25 +1313,45 @@ private:
    *
    * file structure is as follows:
    *
-   * header [0 -> 16) : small number of bytes identifying the type of file, the
-   * type of filters contained and how many shards are contained.
+   * header [0 -> header_length() ) : identifies the type of file, the
+   * type of filters contained and how many shards are contained. There
+   * are 2 versions:
+   *
+   *   legacy [0 -> 16): human readable tag only, eg "sbinfuse08-0256",
+   *   used whenever max_shards() fits in the 4 digits.
+   *
+   *   v2 [0 -> 32): human readable tag "sbinfuse08-v002", followed
+   *   by binary fields: [16 -> 20) uint32 shard_bits, [20 -> 24)
+   *   reserved (zero), [24 -> 32) uint64 max_shards. Used for
+   *   shard_bits > 13.
    *
-   * index [16 -> 16 + 8 * max_shards() ): table of offsets to each
-   * filter in the body. The offsets in the table are relative to the
-   * start of the file.
+   * index [header_length() -> header_length() + 8 * max_shards() ):
+   * table of offsets to each filter in the body. The offsets in the
+   * table are relative to the start of the file.
    *
-   * body [16 + 8 * max_shards() -> end ): the filters: each one has
-   * the filter_struct_fields (ie the "header") followed by the large
-   * array of (8 or 16bit) fingerprints. The offsets in the index will
-   * point the start of the filter_heade, so that deserialize can be
-   * called directly on that.
+   * body [header_length() + 8 * max_shards() -> end ): the filters:
+   * each one has the filter_struct_fields (ie the "header") followed
+   * by the large array of (8, 16 or 32bit) fingerprints. The offsets in
+   * the index will point the start of the filter_heade, so that
+   * deserialize can be called directly on that.
    *
    */
 
-  static constexpr std::size_t header_start  = 0;
-  static constexpr std::size_t header_length = 16;
+  static constexpr std::size_t header_start         = 0;
+  static constexpr std::size_t legacy_header_length = 16;
+  static constexpr std::size_t v2_header_length     = 32;
 
-  static constexpr std::size_t index_start = header_start + header_length;
+  static constexpr std::uint32_t legacy_max_shards = 9999; // 4 ascii digits
+  static constexpr std::uint8_t  max_shard_bits    = 24;
+  static_assert(build_plan::max_shard_bits == max_shard_bits);
+
+  [[nodiscard]] bool has_v2_header() const { return max_shards() > legacy_max_shards; }
+
+  [[nodiscard]] std::size_t header_length() const {
+    return has_v2_header() ? v2_header_length : legacy_header_length;
+  }
+
+  [[nodiscard]] std::size_t index_start() const { return header_start + header_length(); }
 
   template <typename T>
   void copy_to_map(T value, offset_t offset)
@@ -200,29 +1369,58 @@ private:
   template <typename T>
   [[nodiscard]] T get_from_map(offset_t offset) const {
     T value;
-    memcpy(&value, &this->mmap[static_cast<mmap_size_t>(offset)], sizeof(T));
+    memcpy(&value, &map_data()[offset], sizeof(T));
     return value;
   }
 
   [[nodiscard]] std::string get_str_from_map(offset_t offset, std::size_t strsize) const {
     std::string value;
     value.resize(strsize);
-    memcpy(value.data(), &this->mmap[static_cast<mmap_size_t>(offset)], strsize);
+    memcpy(value.data(), &map_data()[offset], strsize);
     return value;
   }
 
+  // all reads go via these, so that they can be served from an
+  // `anonymous_copy` of the file
+  [[nodiscard]] const char* map_data() const {
+    return anon_copy_.empty() ? this->mmap.data() : anon_copy_.data();
+  }
+
+  [[nodiscard]] std::size_t map_size() const {
+    return anon_copy_.empty() ? this->mmap.size() : anon_copy_.size();
+  }
+
   [[nodiscard]] std::uint32_t max_shards() const { return 1U << shard_bits_; }
 
   [[nodiscard]] std::size_t index_length() const { return sizeof(offset_t) * max_shards(); }
 
   [[nodiscard]] std::size_t filter_index_offset(std::uint32_t prefix) const {
-    return index_start + sizeof(offset_t) * prefix;
+    return index_start() + sizeof(offset_t) * prefix;
   }
 
   [[nodiscard]] offset_t filter_offset(std::uint32_t prefix) const {
     return get_from_map<offset_t>(filter_index_offset(prefix));
   }
 
+  // [start, end) of every shard in the file, in file order
+  [[nodiscard]] std::vector<std::pair<offset_t, offset_t>> shard_extents() const {
+    std::vector<std::pair<offset_t, offset_t>> extents;
+    for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+      if (auto offset = filter_offset(prefix); offset != empty_offset) {
+        extents.emplace_back(offset, offset + serialization_bytes_at(offset));
+      }
+    }
+    std::sort(extents.begin(), extents.end());
+    return extents;
+  }
+
+  // size of the serialized filter at `offset`, from its header
+  [[nodiscard]] std::size_t serialization_bytes_at(offset_t offset) const {
+    FilterType fil{};
+    ftype<FilterType>::deserialize_header(&fil, &map_data()[offset]);
+    return ftype<FilterType>::serialization_bytes(&fil);
+  }
+
   [[nodiscard]] std::string type_id() const {
     std::string       type_id;
     std::stringstream type_id_stream(type_id);
@@ -233,7 +1431,8 @@ private:
   void sync()
     requires(AccessMode == mio::access_mode::write)
   {
-    std::error_code err;
+    [[maybe_unused]] const auto scope = instrument_.phase(build_phase::sync);
+    std::error_code             err;
     this->mmap.sync(err); // ensure any existing map is sync'd
     if (err) {
       throw std::runtime_error("sharded_bin_fuse_filter:: mmap.map(): " + err.message());
@@ -256,9 +1455,20 @@ private:
     }
   }
 
+  void check_shard_bits() const {
+    if (shard_bits_ == 0 || shard_bits_ > max_shard_bits) {
+      throw std::runtime_error("shard_bits must be in range [1, " + std::to_string(max_shard_bits) +
+                               "], found: " + std::to_string(shard_bits_));
+    }
+  }
+
   void check_max_shards() const {
-    std::uint32_t check_max_shards = 0;
-    std::from_chars(&this->mmap[11], &this->mmap[15], check_max_shards);
+    std::uint64_t check_max_shards = 0;
+    if (map_size() >= v2_header_length && get_str_from_map(10, 5) == "-v002") {
+      check_max_shards = get_from_map<std::uint64_t>(24);
+    } else {
+      std::from_chars(&map_data()[11], &map_data()[15], check_max_shards);
+    }
     if (check_max_shards != max_shards()) {
       throw std::runtime_error("wrong capacity: expected: " + std::to_string(max_shards()) +
                                ", found: " + std::to_string(check_max_shards));
@@ -283,85 +1493,438 @@ private:
     return existing_filesize;
   }
 
+  // the complete header, header_length() bytes
+  [[nodiscard]] std::string header_bytes() const {
+    std::string       header(header_length(), '\0');
+    std::stringstream tagstream;
+    if (has_v2_header()) {
+      tagstream << type_id() << "-v002";
+      const auto bits     = static_cast<std::uint32_t>(shard_bits_);
+      const auto capacity = static_cast<std::uint64_t>(max_shards());
+      memcpy(&header[16], &bits, sizeof(bits)); // [20, 24) reserved, zero
+      memcpy(&header[24], &capacity, sizeof(capacity));
+    } else {
+      tagstream << type_id() << '-' << std::setfill('0') << std::setw(4) << max_shards();
+    }
+    const auto tag = tagstream.str();
+    memcpy(header.data(), tag.data(), tag.size());
+    return header;
+  }
+
   void create_filetag()
     requires(AccessMode == mio::access_mode::write)
   {
-    std::string       tagstr;
-    std::stringstream tagstream(tagstr);
-    tagstream << type_id() << '-' << std::setfill('0') << std::setw(4) << max_shards();
-    copy_str_to_map(tagstream.str(), 0);
+    copy_str_to_map(header_bytes(), 0);
+  }
+
+  /*
+   * packed transfer format, see `save_packed`:
+   *
+   * [0 -> 16) tag, eg "zbinfuse08-pk01"
+   * [16 -> 20) uint32 shard_bits, [20 -> 24) uint32 number of shards,
+   * [24 -> 32) uint64 total bytes of all shards
+   * shard table: for each shard in prefix order, 2 LEB128 varints:
+   * the prefix gap to the previous shard (+1), and its size in bytes
+   * data: the serialized shards, in the same order, back to back
+   */
+  static constexpr std::size_t packed_header_length = 32;
+
+  [[nodiscard]] std::string packed_tag() const { return "z" + type_id().substr(1) + "-pk01"; }
+
+  [[nodiscard]] bool has_packed_tag() const {
+    const auto tag = packed_tag();
+    return map_size() >= packed_header_length && get_str_from_map(0, tag.size()) == tag;
+  }
+
+  // rebuilds the unpacked file image in anonymous (huge page) memory,
+  // copying the shards in parallel, and then unmaps the packed file
+  void unpack(const map_options& opts) {
+    const char* packed = this->mmap.data();
+    const auto  size   = this->mmap.size();
+    if (size < packed_header_length) {
+      throw std::runtime_error("corrupt packed file: truncated header");
+    }
+    const auto bits  = get_from_map<std::uint32_t>(16);
+    const auto count = get_from_map<std::uint32_t>(20);
+    const auto total = get_from_map<std::uint64_t>(24);
+    if (bits != shard_bits_) { // unvalidated, so not shifted into a capacity
+      throw std::runtime_error("wrong shard_bits: expected: " + std::to_string(shard_bits_) +
+                               ", found: " + std::to_string(bits));
+    }
+    if (count > max_shards()) {
+      throw std::runtime_error("corrupt packed file: more shards than prefixes");
+    }
+    struct packed_shard {
+      std::uint32_t prefix;
+      std::size_t   from; // in packed file
+      std::size_t   to;   // in unpacked image
+      std::size_t   bytes;
+    };
+    std::vector<packed_shard> shards(count);
+    std::size_t               pos    = packed_header_length;
+    std::uint64_t             prefix = 0;
+    std::size_t               to     = header_length() + index_length();
+    for (auto& shard: shards) {
+      prefix += detail::read_varint(packed, size, pos);
+      const auto bytes = detail::read_varint(packed, size, pos);
+      if (prefix == 0 || prefix > max_shards()) {
+        throw std::runtime_error("corrupt packed file: shard prefix out of range");
+      }
+      if (bytes > size) {
+        throw std::runtime_error("corrupt packed file: shard larger than the file");
+      }
+      shard = {static_cast<std::uint32_t>(prefix - 1), 0, to, bytes};
+      to += bytes;
+    }
+    if (to - (header_length() + index_length()) != total || total > size - pos) {
+      throw std::runtime_error("corrupt packed file: shards do not match its size");
+    }
+    for (auto& shard: shards) {
+      shard.from = pos;
+      pos += shard.bytes;
+    }
+
+    detail::anonymous_buffer image(to, opts.huge_pages);
+    const auto               header = header_bytes();
+    memcpy(image.data(), header.data(), header.size());
+    std::vector<offset_t> index(max_shards(), empty_offset);
+    for (const auto& shard: shards) index[shard.prefix] = shard.to;
+    memcpy(image.data() + index_start(), index.data(), index_length());
+    const std::size_t workers =
+        std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, shards.size() / 4 + 1);
+    run_parallel(workers, [&](std::size_t worker) {
+      for (std::size_t i = worker; i < shards.size(); i += workers) {
+        memcpy(image.data() + shards[i].to, packed + shards[i].from, shards[i].bytes);
+      }
+    });
+    this->mmap.unmap();
+    anon_copy_ = std::move(image);
   }
 
   void create_index()
     requires(AccessMode == mio::access_mode::write)
   {
-    index.resize(max_shards(), empty_offset);
-    memcpy(&this->mmap[index_start], index.data(), index.size() * sizeof(offset_t));
+    for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+      copy_to_map(empty_offset, filter_index_offset(prefix));
+    }
+  }
+
+  // `keys` must outlive the build, ie until the shard is written, or
+  // discarded: callers which pass borrowed keys `discard_pending` on error
+  void build_shard(std::span<const std::uint64_t> keys, std::uint32_t prefix)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    build_shard(keys, prefix, acquire_arena(keys.size()));
   }
 
-  void load_index() {
-    index.resize(max_shards(), empty_offset);
-    memcpy(index.data(), &this->mmap[index_start], index.size() * sizeof(offset_t));
-    shards_ = static_cast<std::uint32_t>(
-        count_if(index.begin(), index.end(), [](auto a) { return a != empty_offset; }));
+  // populates from the streamed keys, which are swapped into the
+  // arena, and replaced by its previous (cleared) key buffer, so that
+  // both keep their capacity
+  void build_stream_shard()
+    requires(AccessMode == mio::access_mode::write)
+  {
+    auto& arena = acquire_arena(stream_keys_.size());
+    std::swap(arena.keys(), stream_keys_);
+    stream_keys_.clear();
+    build_shard(arena.keys(), stream_last_prefix_, arena);
   }
 
-  void load_filters() {
-    // always "load" all, even if as yet unpopulated
-    filters.clear();
-    filters.resize(max_shards()); // default constructed, which zeroes all values
-    for (uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
-      if (auto offset = index[prefix]; offset != empty_offset) {
-        filters[prefix].deserialize(&this->mmap[static_cast<mmap_size_t>(offset)]);
+  void build_shard(std::span<const std::uint64_t> keys, std::uint32_t prefix, build_arena& arena)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (stream_threads_ == 1) {
+      {
+        shard_filter_t shard;
+        {
+          [[maybe_unused]] const auto scope = instrument_.phase(build_phase::populate);
+          shard.populate(keys, arena);
+        }
+        add_shard(shard, prefix);
       }
+      free_arenas_.push_back(&arena);
+      return;
     }
+    const std::size_t bytes = shard_bytes(keys.size());
+    pending_.push_back({prefix,
+                        std::async(std::launch::async,
+                                   [keys, &arena, instrument = instrument_] {
+                                     shard_filter_t              shard;
+                                     [[maybe_unused]] const auto scope =
+                                         instrument.phase(build_phase::populate);
+                                     shard.populate(keys, arena);
+                                     return shard;
+                                   }),
+                        &arena, bytes});
+    in_flight_bytes_ += bytes;
   }
 
-  // only does something for AccessMode = read
-  // if you write a filter, you must reopen it in read mode
-  void load() {
-    if constexpr (AccessMode == mio::access_mode::write) {
-      if (!std::filesystem::exists(filepath_)) {
-        ensure_file();
-        ensure_header();
-        return;
+  [[nodiscard]] static std::size_t shard_bytes(std::size_t keys) {
+    return keys * build_plan::bytes_per_key;
+  }
+
+  // A free arena for a shard of `keys`, first writing the oldest
+  // pending shards, while `stream_threads_` are already in flight, or
+  // adding this shard would exceed `build_budget_`. A shard over
+  // budget on its own is built alone. To stay within budget, the
+  // memory of other free arenas is released.
+  [[nodiscard]] build_arena& acquire_arena(std::size_t keys)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    const std::size_t bytes = shard_bytes(keys);
+    while (!pending_.empty() &&
+           (pending_.size() >= stream_threads_ ||
+            (build_budget_ != 0 && in_flight_bytes_ + bytes > build_budget_))) {
+      write_oldest_pending_shard(); // blocks until the oldest is populated
+    }
+    if (free_arenas_.empty()) {
+      arenas_.push_back(std::make_unique<build_arena>());
+      free_arenas_.push_back(arenas_.back().get());
+    }
+    auto* arena = free_arenas_.back();
+    free_arenas_.pop_back();
+    if (build_budget_ != 0) {
+      std::size_t retained = in_flight_bytes_ + std::max(bytes, arena->capacity_bytes());
+      for (auto* idle: free_arenas_) {
+        retained += idle->capacity_bytes();
+        if (retained > build_budget_) {
+          retained -= idle->capacity_bytes();
+          *idle = build_arena{};
+        }
       }
     }
+    return *arena;
+  }
+
+  void check_plan(const build_plan& plan) const {
+    if (plan.shard_bits != shard_bits_) {
+      throw std::runtime_error("sharded_filter: build_plan is for shard_bits = " +
+                               std::to_string(plan.shard_bits) + ", but this filter has " +
+                               std::to_string(shard_bits_));
+    }
+  }
+
+  void write_oldest_pending_shard()
+    requires(AccessMode == mio::access_mode::write)
+  {
+    auto oldest = std::move(pending_.front());
+    pending_.pop_front();
+    in_flight_bytes_ -= oldest.bytes;
+    oldest.filter.wait();
+    // free, once this function returns and the shard is discarded
+    free_arenas_.push_back(oldest.arena);
+    add_shard(oldest.filter.get(), oldest.prefix); // rethrows any populate exception
+  }
+
+  // waits for, and drops, any shards still in flight
+  void discard_pending()
+    requires(AccessMode == mio::access_mode::write)
+  {
+    pending_.clear(); // futures of std::async block until complete
+    in_flight_bytes_ = 0;
+    free_arenas_.clear();
+    for (const auto& arena: arenas_) free_arenas_.push_back(arena.get());
+  }
+
+  void write_pending_shards()
+    requires(AccessMode == mio::access_mode::write)
+  {
+    while (!pending_.empty()) {
+      write_oldest_pending_shard();
+    }
+  }
+
+  static void flush_spill(spill_bucket& bucket) {
+    bucket.file.write(reinterpret_cast<const char*>(bucket.buffer.data()), // NOLINT
+                      static_cast<std::streamsize>(bucket.buffer.size() * sizeof(std::uint64_t)));
+    if (!bucket.file) {
+      throw std::runtime_error("sharded_filter: ingest: failed to write spill file: " +
+                               bucket.path.string());
+    }
+    bucket.buffer.clear();
+  }
+
+  // reads back and deletes the bucket's spill file
+  static void read_spill(spill_bucket& bucket, std::vector<std::uint64_t>& keys) {
+    keys.resize(std::filesystem::file_size(bucket.path) / sizeof(std::uint64_t));
+    std::ifstream file(bucket.path, std::ios::binary);
+    file.read(reinterpret_cast<char*>(keys.data()), // NOLINT
+              static_cast<std::streamsize>(keys.size() * sizeof(std::uint64_t)));
+    if (!file) {
+      throw std::runtime_error("sharded_filter: ingest: failed to read spill file: " +
+                               bucket.path.string());
+    }
+    file.close();
+    std::filesystem::remove(bucket.path);
+  }
+
+  void remove_spill_files() noexcept {
+    for (auto& bucket: spill_) {
+      bucket.file.close();
+      std::error_code err;
+      std::filesystem::remove(bucket.path, err); // best effort
+    }
+    spill_.clear();
+  }
+
+  // builds the flat descriptor table directly from the index and
+  // shard headers in the mmap. Always "loads" all, even if as yet
+  // unpopulated. In lazy mode, only prepares the table.
+  void load_shards_table() {
+    shards_table_.assign(max_shards(), shard_descriptor_t{});
+    if (lazy_) {
+      shard_once_ = std::make_unique<std::once_flag[]>(max_shards()); // NOLINT
+      return;
+    }
+    shards_ = 0;
+    for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+      load_shard(prefix);
+      shards_ += filter_offset(prefix) != empty_offset ? 1U : 0U;
+    }
+  }
+
+  void load_shard(std::uint32_t prefix) const {
+    if (auto offset = filter_offset(prefix); offset != empty_offset) {
+      (void)checked_serialization_bytes(prefix, offset);
+      shards_table_[prefix] = shard_descriptor_t::deserialize(&map_data()[offset]);
+    }
+  }
+
+  // `serialization_bytes_at(offset)`, once the shard's header, and
+  // then the whole shard, are known to be within the file
+  [[nodiscard]] std::size_t checked_serialization_bytes(std::uint32_t prefix,
+                                                        offset_t      offset) const {
+    const std::size_t size = map_size();
+    if (offset > size || size - offset < shard_filter_t::upstream_header_bytes ||
+        size - offset < serialization_bytes_at(offset)) {
+      throw std::runtime_error("corrupt file: shard for prefix = " + std::to_string(prefix) +
+                               " extends beyond end of file");
+    }
+    return serialization_bytes_at(offset);
+  }
+
+  [[nodiscard]] const shard_descriptor_t& shard_at(std::uint32_t prefix) const {
+    if (lazy_) {
+      std::call_once(shard_once_[prefix], [this, prefix] { load_shard(prefix); });
+    }
+    return shards_table_[prefix];
+  }
+
+  [[nodiscard]] std::size_t count_shards() const {
+    std::size_t count = 0;
+    for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+      count += filter_offset(prefix) != empty_offset ? 1U : 0U;
+    }
+    return count;
+  }
+
+  [[nodiscard]] static bool is_lazy(load_mode mode) {
+    return AccessMode == mio::access_mode::read && mode == load_mode::lazy;
+  }
+
+  void advise_will_need(offset_t offset, std::size_t length) const {
+#if defined(__unix__) || defined(__APPLE__)
+    const auto  aligned = mio::make_offset_page_aligned(static_cast<std::size_t>(offset));
+    const char* start   = map_data() + aligned;
+    // NOLINTNEXTLINE const_cast: madvise does not modify the mapping
+    ::madvise(const_cast<char*>(start), offset - aligned + length, MADV_WILLNEED);
+#else
+    (void)offset;
+    (void)length;
+#endif
+  }
+
+  // if you write a filter, you must reopen it in read mode, or query
+  // the sink directly
+  void load(const map_options& opts) {
+    check_shard_bits();
+    instrument_.shards(max_shards());
+    [[maybe_unused]] const auto faults = instrument_.faults(fault_site::load);
+    if constexpr (AccessMode == mio::access_mode::write) {
+      ensure_header();
+      return;
+    }
+    anon_copy_ = {};
     map_whole_file(); // read mode will fail here if not exists
-    check_type_id();
-    check_max_shards();
-    load_index();
-    load_filters();
+    if (has_packed_tag()) {
+      unpack(opts);
+    } else {
+      if (map_size() < header_length() + index_length()) { // before any index entry is read
+        throw std::runtime_error("corrupt file: shorter than its header and index");
+      }
+      check_type_id();
+      check_max_shards();
+    }
+    if (opts.anonymous_copy && anon_copy_.empty()) {
+      detail::anonymous_buffer copy(this->mmap.size(), opts.huge_pages);
+      memcpy(copy.data(), this->mmap.data(), this->mmap.size());
+      this->mmap.unmap();
+      anon_copy_ = std::move(copy);
+    }
+    detail::advise(map_data(), map_size(), opts);
+    load_shards_table();
   }
 
-  // returns new_filesize
-  std::uintmax_t ensure_header()
+  // creates or checks the header, loads the index and sets `data_end_`
+  void ensure_header()
     requires(AccessMode == mio::access_mode::write)
   {
     const std::uintmax_t existing_filesize = ensure_file();
-    std::uintmax_t       new_size          = existing_filesize;
-    if (existing_filesize < header_length + index_length()) {
+    if (existing_filesize < header_length() + index_length()) {
       if (existing_filesize != 0) {
         throw std::runtime_error("corrupt file: header and index half written?!");
       }
-      // existing_size == 0 here
-      new_size += header_length + index_length();
-      std::filesystem::resize_file(filepath_, new_size);
+      std::filesystem::resize_file(filepath_, header_length() + index_length());
       map_whole_file();
       create_filetag();
       create_index();
       sync(); // write to disk
-      load_filters();
-      shards_ = 0;
+      load_shards_table();
     } else {
       // we have a header already
       map_whole_file();
       check_type_id();
       check_max_shards();
-      load_index();
-      load_filters();
+      load_shards_table();
+    }
+    // there may be slack at the end of the file, if a sink was not
+    // destroyed cleanly, so find the true end of the data
+    data_end_ = header_length() + index_length();
+    for (std::uint32_t prefix = 0; prefix != max_shards(); ++prefix) {
+      if (auto offset = filter_offset(prefix); offset != empty_offset) {
+        data_end_ = std::max(data_end_, offset + serialization_bytes_at(offset));
+      }
+    }
+  }
+
+  // grow file geometrically to fit at least `size` bytes. Rebase all
+  // shard descriptors if remapped.
+  void reserve(std::uintmax_t size)
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (size <= this->mmap.size()) {
+      return;
+    }
+    sync();
+    std::filesystem::resize_file(filepath_, std::max<std::uintmax_t>(size, 2 * this->mmap.size()));
+    map_whole_file();
+    // ptrs to Fingerprints will likely have changed
+    load_shards_table();
+  }
+
+  // flush and remove any geometric growth slack. Runs in the
+  // destructor, so must not throw.
+  void trim_file() noexcept
+    requires(AccessMode == mio::access_mode::write)
+  {
+    if (!this->mmap.is_mapped()) {
+      return; // never loaded, or moved from
+    }
+    std::error_code err;
+    this->mmap.sync(err);
+    this->mmap.unmap(); // required before truncation on some platforms
+    if (!err && data_end_ != 0) {
+      std::filesystem::resize_file(filepath_, data_end_, err); // best effort
     }
-    return new_size;
   }
 };
 
@@ -374,4 +1937,8 @@ using sharded_filter16_sink = sharded_filter<binary_fuse16_t, mio::access_mode::
 
 using sharded_filter16_source = sharded_filter<binary_fuse16_t, mio::access_mode::read>;
 
+using sharded_filter32_sink = sharded_filter<binary_fuse32_t, mio::access_mode::write>;
+
+using sharded_filter32_source = sharded_filter<binary_fuse32_t, mio::access_mode::read>;
+
 } // namespace binfuse
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "binaryfusefilter.h"
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#if !defined(BINFUSE_DISABLE_SIMD) && (defined(__GNUC__) || defined(__clang__)) &&              \
+    (defined(__x86_64__) || defined(__i386__))
+#define BINFUSE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/* binfuse::detail simd kernels
+ *
+ * Vectorised batch query kernels for `filter::contains_many`. They
+ * compute exactly what the upstream `binary_fuse(8|16)_contain` does,
+ * for 4 (AVX2) or 8 (AVX-512) keys at once: the murmur mix, the 3
+ * segment indexes, gathering the fingerprints and the xor compare.
+ *
+ * The kernels are compiled with function level target attributes and
+ * selected at runtime, so no special compiler flags are needed. Where
+ * not supported (other compilers/architectures, or defining
+ * BINFUSE_DISABLE_SIMD) the scalar path is used.
+ *
+ * Fingerprints are gathered as 8 byte words from 8 byte aligned
+ * addresses, and the wanted fingerprint shifted out. Aligned words
+ * never cross a page boundary, so the few bytes read beyond either end
+ * of the fingerprint array can never fault, even at the end of an
+ * mmap'd file.
+ */
+namespace binfuse {
+
+// instruction set used by `filter::contains_many`
+enum class simd_level { scalar, avx2, avx512 };
+
+// the best level supported by this cpu, detected once
+
+[[nodiscard]] inline simd_level detect_simd_level() {
+#ifdef BINFUSE_SIMD_X86
+  static const simd_level level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+      return simd_level::avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return simd_level::avx2;
+    }
+    return simd_level::scalar;
+  }();
+  return level;
+#else
+  return simd_level::scalar;
+#endif
+}
+
+} // namespace binfuse
+
+namespace binfuse::detail {
+
+// the subset of the filter, which the kernels need
+struct simd_params {
+  std::uint64_t seed;
+  std::uint64_t segment_count_length;
+  std::uint64_t segment_length;
+  std::uint64_t segment_length_mask;
+  std::uint64_t fingerprint_mask;
+  const char*   base;          // fingerprints, rounded down to 8 byte alignment
+  std::uint64_t base_offset;   // fingerprints - base
+  int           fp_shift;      // log2(sizeof(fingerprint))
+};
+
+#ifdef BINFUSE_SIMD_X86
+
+// AVX2 has no 64bit lo multiply: compose from 32x32->64 multiplies
+__attribute__((target("avx2"))) inline __m256i mullo64_avx2(__m256i lhs, __m256i rhs) {
+  const __m256i lolo  = _mm256_mul_epu32(lhs, rhs);
+  const __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(lhs, _mm256_srli_epi64(rhs, 32)),
+                                         _mm256_mul_epu32(_mm256_srli_epi64(lhs, 32), rhs));
+  return _mm256_add_epi64(lolo, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) inline __m256i gather_fp_avx2(const simd_params& prm,
+                                                               __m256i idx) {
+  const __m256i offset =
+      _mm256_add_epi64(_mm256_set1_epi64x(static_cast<long long>(prm.base_offset)),
+                       _mm256_slli_epi64(idx, prm.fp_shift));
+  const __m256i words  = _mm256_i64gather_epi64(
+      reinterpret_cast<const long long*>(prm.base), // NOLINT intrinsic API
+      _mm256_andnot_si256(_mm256_set1_epi64x(7), offset), 1);
+  const __m256i shift = _mm256_slli_epi64(_mm256_and_si256(offset, _mm256_set1_epi64x(7)), 3);
+  return _mm256_srlv_epi64(words, shift);
+}
+
+// processes keys in blocks of 4, returns number of keys processed
+__attribute__((target("avx2"))) inline std::size_t
+contains_many_avx2(const simd_params& prm, const std::uint64_t* keys, std::uint8_t* out,
+                   std::size_t count) {
+  const __m256i seed  = _mm256_set1_epi64x(static_cast<long long>(prm.seed));
+  const __m256i mix1  = _mm256_set1_epi64x(static_cast<long long>(0xff51afd7ed558ccdULL));
+  const __m256i mix2  = _mm256_set1_epi64x(static_cast<long long>(0xc4ceb9fe1a85ec53ULL));
+  const __m256i scl   = _mm256_set1_epi64x(static_cast<long long>(prm.segment_count_length));
+  const __m256i sl    = _mm256_set1_epi64x(static_cast<long long>(prm.segment_length));
+  const __m256i mask  = _mm256_set1_epi64x(static_cast<long long>(prm.segment_length_mask));
+  const __m256i fmask = _mm256_set1_epi64x(static_cast<long long>(prm.fingerprint_mask));
+
+  std::size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i hash = _mm256_add_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), seed); // NOLINT
+    hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+    hash = mullo64_avx2(hash, mix1);
+    hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+    hash = mullo64_avx2(hash, mix2);
+    hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 33));
+
+    // mulhi(hash, scl) with scl < 2^32 cannot overflow this sum
+    const __m256i lo = _mm256_mul_epu32(hash, scl);
+    const __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(hash, 32), scl);
+    const __m256i h0 = _mm256_srli_epi64(_mm256_add_epi64(hi, _mm256_srli_epi64(lo, 32)), 32);
+    __m256i       h1 = _mm256_add_epi64(h0, sl);
+    __m256i       h2 = _mm256_add_epi64(h1, sl);
+    h1 = _mm256_xor_si256(h1, _mm256_and_si256(_mm256_srli_epi64(hash, 18), mask));
+    h2 = _mm256_xor_si256(h2, _mm256_and_si256(hash, mask));
+
+    __m256i fp = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 32));
+    fp         = _mm256_xor_si256(fp, gather_fp_avx2(prm, h0));
+    fp         = _mm256_xor_si256(fp, gather_fp_avx2(prm, h1));
+    fp         = _mm256_xor_si256(fp, gather_fp_avx2(prm, h2));
+    fp         = _mm256_and_si256(fp, fmask);
+
+    const auto hits = static_cast<unsigned>(
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(fp, _mm256_setzero_si256()))));
+    for (unsigned lane = 0; lane != 4; ++lane) {
+      out[i + lane] = static_cast<std::uint8_t>((hits >> lane) & 1U);
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx512f,avx512dq"))) inline __m512i
+gather_fp_avx512(const simd_params& prm, __m512i idx) {
+  const __m512i offset =
+      _mm512_add_epi64(_mm512_set1_epi64(static_cast<long long>(prm.base_offset)),
+                       _mm512_slli_epi64(idx, static_cast<unsigned>(prm.fp_shift)));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion" // gcc's gather macro passes a signed mask
+  const __m512i words =
+      _mm512_i64gather_epi64(_mm512_andnot_si512(_mm512_set1_epi64(7), offset), prm.base, 1);
+#pragma GCC diagnostic pop
+  const __m512i shift = _mm512_slli_epi64(_mm512_and_si512(offset, _mm512_set1_epi64(7)), 3);
+  return _mm512_srlv_epi64(words, shift);
+}
+
+// processes keys in blocks of 8, returns number of keys processed
+__attribute__((target("avx512f,avx512dq"))) inline std::size_t
+contains_many_avx512(const simd_params& prm, const std::uint64_t* keys, std::uint8_t* out,
+                     std::size_t count) {
+  const __m512i seed  = _mm512_set1_epi64(static_cast<long long>(prm.seed));
+  const __m512i mix1  = _mm512_set1_epi64(static_cast<long long>(0xff51afd7ed558ccdULL));
+  const __m512i mix2  = _mm512_set1_epi64(static_cast<long long>(0xc4ceb9fe1a85ec53ULL));
+  const __m512i scl   = _mm512_set1_epi64(static_cast<long long>(prm.segment_count_length));
+  const __m512i sl    = _mm512_set1_epi64(static_cast<long long>(prm.segment_length));
+  const __m512i mask  = _mm512_set1_epi64(static_cast<long long>(prm.segment_length_mask));
+  const __m512i fmask = _mm512_set1_epi64(static_cast<long long>(prm.fingerprint_mask));
+
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m512i hash = _mm512_add_epi64(_mm512_loadu_si512(keys + i), seed);
+    hash         = _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 33));
+    hash         = _mm512_mullo_epi64(hash, mix1);
+    hash         = _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 33));
+    hash         = _mm512_mullo_epi64(hash, mix2);
+    hash         = _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 33));
+
+    const __m512i lo = _mm512_mul_epu32(hash, scl);
+    const __m512i hi = _mm512_mul_epu32(_mm512_srli_epi64(hash, 32), scl);
+    const __m512i h0 = _mm512_srli_epi64(_mm512_add_epi64(hi, _mm512_srli_epi64(lo, 32)), 32);
+    __m512i       h1 = _mm512_add_epi64(h0, sl);
+    __m512i       h2 = _mm512_add_epi64(h1, sl);
+    h1 = _mm512_xor_si512(h1, _mm512_and_si512(_mm512_srli_epi64(hash, 18), mask));
+    h2 = _mm512_xor_si512(h2, _mm512_and_si512(hash, mask));
+
+    __m512i fp = _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 32));
+    fp         = _mm512_xor_si512(fp, gather_fp_avx512(prm, h0));
+    fp         = _mm512_xor_si512(fp, gather_fp_avx512(prm, h1));
+    fp         = _mm512_xor_si512(fp, gather_fp_avx512(prm, h2));
+    fp         = _mm512_and_si512(fp, fmask);
+
+    const auto hits = static_cast<unsigned>(_mm512_testn_epi64_mask(fp, fp));
+    for (unsigned lane = 0; lane != 8; ++lane) {
+      out[i + lane] = static_cast<std::uint8_t>((hits >> lane) & 1U);
+    }
+  }
+  return i;
+}
+
+#endif // BINFUSE_SIMD_X86
+
+// Runs the best (or the given) kernel over a prefix of `keys`, and
+// returns how many keys were processed. The caller handles the
+// remainder, or all keys if 0 is returned.
+template <typename FilterType, typename FingerprintType>
+[[nodiscard]] std::size_t contains_many_simd(const FilterType&               fil,
+                                             std::span<const std::uint64_t> keys,
+                                             std::span<std::uint8_t>        out,
+                                             simd_level level = detect_simd_level()) {
+  static_assert(sizeof(FingerprintType) == 1 || sizeof(FingerprintType) == 2 ||
+                sizeof(FingerprintType) == 4);
+#ifdef BINFUSE_SIMD_X86
+  const auto fps = reinterpret_cast<std::uintptr_t>(fil.Fingerprints); // NOLINT
+  if (level == simd_level::scalar || fps % sizeof(FingerprintType) != 0) {
+    return 0; // a misaligned 16/32bit fingerprint could straddle 2 aligned words
+  }
+  const simd_params prm{
+      .seed                 = fil.Seed,
+      .segment_count_length = fil.SegmentCountLength,
+      .segment_length       = fil.SegmentLength,
+      .segment_length_mask  = fil.SegmentLengthMask,
+      .fingerprint_mask     = (1ULL << (8 * sizeof(FingerprintType))) - 1,
+      .base                 = reinterpret_cast<const char*>(fps & ~std::uintptr_t{7}), // NOLINT
+      .base_offset          = fps & 7U,
+      .fp_shift             = std::countr_zero(sizeof(FingerprintType)),
+  };
+  if (level == simd_level::avx512) {
+    return contains_many_avx512(prm, keys.data(), out.data(), keys.size());
+  }
+  return contains_many_avx2(prm, keys.data(), out.data(), keys.size());
+#else
+  (void)fil;
+  (void)keys;
+  (void)out;
+  (void)level;
+  return 0;
+#endif
+}
+
+} // namespace binfuse::detail
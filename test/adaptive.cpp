@@ -0,0 +1,118 @@
+#include "binfuse/adaptive.hpp"
+#include "helpers.hpp"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <vector>
+
+namespace {
+
+std::vector<std::size_t> shard_sizes(const binfuse::adaptive_index& index,
+                                     const std::vector<std::uint64_t>& keys) {
+  std::vector<std::size_t> sizes(index.shards());
+  for (const auto key: keys) ++sizes[index.shard(key)];
+  return sizes;
+}
+
+} // namespace
+
+TEST(binfuse_adaptive, plan_splits_dense) { // NOLINT
+  // a dense range of small ids: all under one top-bits prefix
+  std::vector<std::uint64_t> keys(100'000);
+  std::iota(keys.begin(), keys.end(), 1'000'000);
+
+  const auto index =
+      binfuse::adaptive_index::plan(keys, {.index_bits = 10, .target_shard_keys = 4096});
+  EXPECT_GE(index.shards(), keys.size() / 4096);
+  const auto sizes = shard_sizes(index, keys);
+  EXPECT_LE(*std::max_element(sizes.begin(), sizes.end()), 2 * 4096);
+}
+
+TEST(binfuse_adaptive, plan_merges_sparse) { // NOLINT
+  auto keys = load_sample();
+  std::sort(keys.begin(), keys.end());
+
+  const auto index =
+      binfuse::adaptive_index::plan(keys, {.index_bits = 10, .target_shard_keys = 1024});
+  EXPECT_LT(index.shards(), 1024U);
+  const auto sizes = shard_sizes(index, keys);
+  EXPECT_LE(*std::max_element(sizes.begin(), sizes.end()), 1024U);
+  EXPECT_EQ(std::accumulate(sizes.begin(), sizes.end(), std::size_t{0}), keys.size());
+}
+
+TEST(binfuse_adaptive, build_and_load) { // NOLINT
+  auto keys = load_sample();
+  std::sort(keys.begin(), keys.end());
+  const std::filesystem::path filename("tmp/adaptive8.bin");
+  {
+    binfuse::adaptive_sharded_filter8_sink sink(filename);
+    sink.build(keys, {.index_bits = 8, .target_shard_keys = 1000});
+    EXPECT_TRUE(sink.verify(keys));
+  }
+  {
+    const binfuse::adaptive_sharded_filter8_source source(filename);
+    EXPECT_GT(source.shards(), 1U);
+    EXPECT_EQ(source.index_bits(), 8);
+    EXPECT_TRUE(source.verify(keys));
+    EXPECT_LT(estimate_false_positive_rate(source), 0.005);
+
+    std::vector<std::uint64_t> needles(keys.begin(), keys.begin() + 100);
+    for (std::uint64_t i = 0; i != 100; ++i) needles.push_back(i * 0x9E3779B97F4A7C15ULL);
+    std::vector<std::uint8_t> found(needles.size());
+    source.contains_many(needles, found);
+    for (std::size_t i = 0; i != needles.size(); ++i) {
+      EXPECT_EQ(found[i] != 0, source.contains(needles[i]));
+    }
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST(binfuse_adaptive, dense_range) { // NOLINT
+  std::vector<std::uint64_t> keys(200'000);
+  std::iota(keys.begin(), keys.end(), 0);
+  const std::filesystem::path filename("tmp/adaptive16.bin");
+  {
+    binfuse::adaptive_sharded_filter16_sink sink(filename);
+    sink.build(keys, {.index_bits = 10, .target_shard_keys = 10'000, .threads = 4});
+  }
+  {
+    const binfuse::adaptive_sharded_filter16_source source(filename);
+    EXPECT_GE(source.shards(), 20U);
+    EXPECT_TRUE(source.verify(keys));
+    EXPECT_FALSE(source.contains(1ULL << 40)); // empty shard: sentinel
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST(binfuse_adaptive, rejects) { // NOLINT
+  const std::filesystem::path filename("tmp/adaptive_bad.bin");
+  {
+    binfuse::adaptive_sharded_filter8_sink   sink(filename);
+    const std::vector<std::uint64_t> unsorted{3, 2, 1};
+    EXPECT_THROW(sink.build(unsorted), std::runtime_error);
+    std::vector<std::uint64_t> keys(10'000);
+    std::iota(keys.begin(), keys.end(), 0);
+    sink.build(keys, {.index_bits = 4, .target_shard_keys = 100});
+  }
+  // wrong fingerprint size
+  EXPECT_THROW(binfuse::adaptive_sharded_filter16_source{filename}, std::runtime_error);
+
+  // a corrupt first shard offset: within the header, or wrapping around
+  const auto set_first_offset = [&](std::uint64_t offset) {
+    std::fstream file(filename, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(32 + 16 * 16);
+    file.write(reinterpret_cast<const char*>(&offset), sizeof(offset)); // NOLINT reinterpret_cast
+  };
+  for (const auto offset: {std::uint64_t{8}, ~std::uint64_t{0} - 4}) {
+    set_first_offset(offset);
+    EXPECT_THROW(binfuse::adaptive_sharded_filter8_source{filename}, std::runtime_error);
+  }
+
+  // truncated, mid shard table
+  std::filesystem::resize_file(filename, 32 + 16 * 16 + 4);
+  EXPECT_THROW(binfuse::adaptive_sharded_filter8_source{filename}, std::runtime_error);
+  std::filesystem::remove(filename);
+}
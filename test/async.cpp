@@ -0,0 +1,117 @@
+#include "binfuse/async.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include "helpers.hpp"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <random>
+#include <span>
+#include <vector>
+
+namespace {
+
+// eagerly started coroutine, which nobody awaits
+struct detached {
+  struct promise_type {
+    detached            get_return_object() { return {}; }
+    std::suspend_never  initial_suspend() noexcept { return {}; }
+    std::suspend_never  final_suspend() noexcept { return {}; }
+    void                return_void() {}
+    [[noreturn]] void   unhandled_exception() { std::terminate(); }
+  };
+};
+
+detached lookup_all(binfuse::async_query8& query, const std::vector<std::uint64_t>& keys,
+                    std::size_t begin, std::size_t step, std::vector<std::uint8_t>& found) {
+  for (std::size_t i = begin; i < keys.size(); i += step) {
+    found[i] = co_await query.contains_async(keys[i]) ? 1 : 0;
+  }
+}
+
+std::vector<std::uint64_t> with_random_keys(std::vector<std::uint64_t> keys) {
+  std::mt19937_64 gen(42); // NOLINT fixed seed
+  const auto      count = keys.size();
+  for (std::size_t i = 0; i != count; ++i) keys.push_back(gen());
+  return keys;
+}
+
+} // namespace
+
+TEST(binfuse_async, callbacks) { // NOLINT
+  const std::filesystem::path filename("tmp/async_callbacks.bin");
+  {
+    const auto keys = load_sample();
+    {
+      binfuse::sharded_filter8_sink sink(filename, 4);
+      sink.add_sorted(keys);
+    }
+    const binfuse::sharded_filter8_source source(filename, 4);
+    const auto                            queries = with_random_keys(keys);
+
+    binfuse::async_query8     query(source, 8); // small depth: slots are reused
+    std::vector<std::uint8_t> found(queries.size(), 2);
+    for (std::size_t i = 0; i != queries.size(); ++i) {
+      query.contains_async(queries[i], [&found, i](bool is_found) { found[i] = is_found ? 1 : 0; });
+      EXPECT_LE(query.pending(), 8);
+    }
+    query.run();
+    EXPECT_EQ(query.pending(), 0);
+    for (std::size_t i = 0; i != queries.size(); ++i) {
+      EXPECT_EQ(found[i], source.contains(queries[i]) ? 1 : 0);
+    }
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST(binfuse_async, coroutines) { // NOLINT
+  const std::filesystem::path filename("tmp/async_coroutines.bin");
+  {
+    const auto keys = load_sample();
+    {
+      binfuse::sharded_filter8_sink sink(filename, 8);
+      sink.add_sorted(keys);
+    }
+    const binfuse::sharded_filter8_source source(filename, 8, binfuse::load_mode::lazy);
+    const auto                            queries = with_random_keys(keys);
+
+    binfuse::async_query8     query(source, 32);
+    std::vector<std::uint8_t> found(queries.size(), 2);
+    constexpr std::size_t     coroutines = 16;
+    for (std::size_t c = 0; c != coroutines; ++c) lookup_all(query, queries, c, coroutines, found);
+    query.run();
+    for (std::size_t i = 0; i != queries.size(); ++i) {
+      EXPECT_EQ(found[i], source.contains(queries[i]) ? 1 : 0);
+    }
+    const auto positives = std::span(found).first(keys.size());
+    EXPECT_EQ(std::count(positives.begin(), positives.end(), 1), keys.size()); // no false negatives
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST(binfuse_async, synchronous_fallback) { // NOLINT
+  const std::filesystem::path filename("tmp/async_fallback.bin");
+  {
+    const auto keys = load_sample();
+    {
+      binfuse::sharded_filter8_sink sink(filename, 2);
+      sink.add_sorted(keys);
+    }
+    // served from anonymous memory: nothing to read from the file
+    const binfuse::sharded_filter8_source source(filename, 2, binfuse::load_mode::eager,
+                                                 {.anonymous_copy = true});
+    binfuse::async_query8 query(source);
+    EXPECT_FALSE(query.is_async());
+
+    std::size_t found = 0;
+    for (auto key: keys) {
+      query.contains_async(key, [&found](bool is_found) { found += is_found ? 1U : 0U; });
+    }
+    EXPECT_EQ(query.pending(), 0);
+    EXPECT_EQ(found, keys.size());
+  }
+  std::filesystem::remove(filename);
+}
@@ -2,12 +2,22 @@
 #include "binaryfusefilter.h"
 #include "helpers.hpp"
 #include "gtest/gtest.h"
+#include <algorithm>
 #include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <random>
 #include <span>
+#include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 TEST(binfuse_filter, default_construct) { // NOLINT
   binfuse::filter8 filter;
   EXPECT_FALSE(filter.is_populated());
@@ -31,6 +41,26 @@ TEST(binfuse_filter, construct_from_upstream) { // NOLINT
   EXPECT_TRUE(filter.contains(0x0000000000000002));
 }
 
+TEST(binfuse_filter, contains_many) { // NOLINT
+  binfuse::filter8 filter(std::vector<std::uint64_t>{
+      0x0000000000000000,
+      0x0000000000000001,
+      0x0000000000000002,
+  });
+
+  const std::vector<std::uint64_t> needles{
+      0x0000000000000002, 0x0000000000000000, 0x0000000000000001};
+  std::vector<std::uint8_t> found(needles.size());
+  filter.contains_many(needles, found);
+  EXPECT_EQ(found, std::vector<std::uint8_t>(needles.size(), 1));
+
+  std::vector<std::uint8_t> too_small(needles.size() - 1);
+  EXPECT_THROW(filter.contains_many(needles, too_small), std::runtime_error);
+
+  binfuse::filter8 empty;
+  EXPECT_THROW(empty.contains_many(needles, found), std::runtime_error);
+}
+
 TEST(binfuse_filter, default_construct_persistent) { // NOLINT
   binfuse::filter8_sink filter_sink;
   EXPECT_FALSE(filter_sink.is_populated());
@@ -90,6 +120,33 @@ TEST(binfuse_filter, save_load16) { // NOLINT
   std::filesystem::remove("tmp/filter16.bin");
 }
 
+TEST(binfuse_filter, load_map_options) { // NOLINT
+  {
+    binfuse::filter8_sink filter_sink(std::vector<std::uint64_t>{
+        0x0000000000000000,
+        0x0000000000000001,
+        0x0000000000000002,
+    });
+    filter_sink.save("tmp/filter8.bin");
+
+    binfuse::filter8_source pinned;
+    pinned.load("tmp/filter8.bin", {.random_access = true, .prefault = true, .lock = true});
+    EXPECT_TRUE(pinned.contains(0x0000000000000001));
+
+    // the copy does not depend on the file after load
+    binfuse::filter8_source copied;
+    copied.load("tmp/filter8.bin", {.huge_pages = true, .anonymous_copy = true});
+    std::filesystem::remove("tmp/filter8.bin");
+    EXPECT_TRUE(copied.contains(0x0000000000000000));
+    EXPECT_TRUE(copied.contains(0x0000000000000001));
+    EXPECT_TRUE(copied.contains(0x0000000000000002));
+
+    binfuse::filter8_source moved = std::move(copied);
+    EXPECT_TRUE(moved.contains(0x0000000000000002));
+  }
+  std::filesystem::remove("tmp/filter8.bin");
+}
+
 TEST(binfuse_filter, move) { // NOLINT
   {
     binfuse::filter8_sink filter_sink(std::vector<std::uint64_t>{
@@ -127,6 +184,289 @@ TEST(binfuse_filter, large16) { // NOLINT
   EXPECT_LE(estimate_false_positive_rate(filter), 0.00005);
 }
 
+TEST(binfuse_filter, large32) { // NOLINT
+  auto keys   = load_sample();
+  auto filter = binfuse::filter32(keys);
+  EXPECT_TRUE(filter.verify(keys));
+  EXPECT_LE(estimate_false_positive_rate(filter), 0.000005);
+}
+
+TEST(binfuse_filter, native_duplicates) { // NOLINT
+  auto keys = load_sample();
+  keys.insert(keys.end(), keys.begin(), keys.begin() + 100);
+  auto filter = binfuse::filter32(keys);
+  EXPECT_TRUE(filter.verify(keys));
+}
+
+TEST(binfuse_filter, verify_report) { // NOLINT
+  const auto             keys = load_sample();
+  const binfuse::filter8 filter(keys);
+
+  const auto all = filter.verify(keys, {.threads = 3});
+  EXPECT_TRUE(all.ok());
+  EXPECT_EQ(all.checked, keys.size());
+  EXPECT_TRUE(all.offending.empty());
+
+  const auto sampled = filter.verify(keys, {.threads = 2, .sample = 0.1, .seed = 7});
+  EXPECT_TRUE(sampled);
+  EXPECT_GT(sampled.checked, keys.size() / 20);
+  EXPECT_LT(sampled.checked, keys.size() / 5);
+  EXPECT_EQ(filter.verify(keys, {.threads = 1, .sample = 0.1, .seed = 7}).checked,
+            sampled.checked); // same subset, whatever the threads
+
+  // random keys are (almost all) false negatives, reported in order
+  std::mt19937_64            gen(42); // NOLINT fixed seed
+  std::vector<std::uint64_t> absent(10'000);
+  for (auto& key: absent) key = gen();
+  std::vector<std::uint64_t> expected;
+  for (auto key: absent) {
+    if (!filter.contains(key)) expected.push_back(key);
+  }
+  const auto res = filter.verify(absent, {.threads = 4, .max_reported = 100});
+  EXPECT_FALSE(res.ok());
+  EXPECT_EQ(res.checked, absent.size());
+  EXPECT_EQ(res.false_negatives, expected.size());
+  expected.resize(100);
+  EXPECT_EQ(res.offending, expected);
+}
+
+TEST(binfuse_filter, arena) { // NOLINT
+  const auto           keys = load_sample();
+  binfuse::build_arena arena;
+  {
+    binfuse::filter8 filter;
+    filter.populate(keys, arena);
+    EXPECT_TRUE(filter.verify(keys));
+    EXPECT_LE(estimate_false_positive_rate(filter), 0.005);
+  }
+  const auto capacity = arena.capacity_bytes();
+  EXPECT_GT(capacity, 0);
+  for (std::size_t size = keys.size() / 2; size > 1000; size /= 2) {
+    const auto       part = std::span(keys).first(size);
+    binfuse::filter16 filter;
+    filter.populate(part, arena);
+    EXPECT_TRUE(filter.verify(part));
+    EXPECT_EQ(arena.capacity_bytes(), capacity); // smaller builds reuse the memory
+  }
+}
+
+TEST(binfuse_filter, populate_parallel) { // NOLINT
+  std::vector<std::uint64_t> keys(300'000);
+  std::mt19937_64            rng(42); // NOLINT fixed seed
+  std::generate(keys.begin(), keys.end(), rng);
+  keys.push_back(keys.front()); // duplicates are dropped
+  for (const unsigned threads: {2U, 3U, 8U}) {
+    binfuse::filter16 filter;
+    filter.populate(keys, {.threads = threads, .parallel_keys = 1000});
+    EXPECT_TRUE(filter.verify(keys));
+    EXPECT_LE(estimate_false_positive_rate(filter), 0.0001);
+  }
+  binfuse::filter32 filter; // native, too
+  filter.populate(keys, {.threads = 4, .parallel_keys = 1000});
+  EXPECT_TRUE(filter.verify(keys));
+
+  const std::vector<std::uint64_t> small{1, 2, 3}; // too few segments to count in parallel
+  binfuse::filter8                 few;
+  few.populate(small, {.threads = 4, .parallel_keys = 1});
+  EXPECT_TRUE(few.verify(small));
+}
+
+TEST(binfuse_filter, native_matches_upstream_format) { // NOLINT
+  // an 8bit native filter, deserialized and queried by upstream
+  auto                            keys = load_sample();
+  binfuse::binary_fuse_t<uint8_t> native{};
+  ASSERT_TRUE(binfuse::native::allocate(static_cast<std::uint32_t>(keys.size()), &native));
+  ASSERT_TRUE(
+      binfuse::native::populate(keys.data(), static_cast<std::uint32_t>(keys.size()), &native));
+
+  std::vector<char> buffer(binfuse::native::serialization_bytes(&native));
+  EXPECT_EQ(binfuse::native::serialize(&native, buffer.data()), buffer.size());
+
+  binary_fuse8_t upstream{};
+  binary_fuse8_allocate(static_cast<std::uint32_t>(keys.size()), &upstream);
+  EXPECT_EQ(binary_fuse8_serialization_bytes(&upstream), buffer.size()); // same geometry
+  binary_fuse8_free(&upstream);
+
+  const char* fps = binary_fuse8_deserialize_header(&upstream, buffer.data());
+  upstream.Fingerprints = reinterpret_cast<std::uint8_t*>(const_cast<char*>(fps)); // NOLINT
+  for (auto key: keys) EXPECT_TRUE(binary_fuse8_contain(key, &upstream));
+  EXPECT_EQ(upstream.Seed, native.Seed);
+  EXPECT_EQ(upstream.SegmentLengthMask, native.SegmentLengthMask);
+  binfuse::native::free(&native);
+}
+
+TEST(binfuse_filter, large_contains_many) { // NOLINT
+  auto       keys   = load_sample();
+  const auto filter = binfuse::filter16(keys);
+
+  std::vector<std::uint8_t> found(keys.size());
+  filter.contains_many(keys, found);
+  EXPECT_EQ(std::count(found.begin(), found.end(), 1), keys.size());
+
+  // batched results must agree exactly with scalar ones, including false positives
+  auto                       gen = std::mt19937_64(std::random_device{}());
+  std::vector<std::uint64_t> random_keys(100'000);
+  for (auto& key: random_keys) key = gen();
+  found.resize(random_keys.size());
+  filter.contains_many(random_keys, found);
+  for (std::size_t i = 0; i != random_keys.size(); ++i) {
+    EXPECT_EQ(found[i] == 1, filter.contains(random_keys[i]));
+  }
+}
+
+template <typename FilterType>
+void check_simd_levels(const FilterType& filter) {
+  auto gen = std::mt19937_64(std::random_device{}());
+  // odd count, to exercise the scalar remainder
+  std::vector<std::uint64_t> random_keys(100'003);
+  for (auto& key: random_keys) key = gen();
+
+  std::vector<std::uint8_t> expected(random_keys.size());
+  filter.contains_many(random_keys, expected, binfuse::simd_level::scalar);
+  for (auto level: {binfuse::simd_level::avx2, binfuse::simd_level::avx512}) {
+    if (level > binfuse::detect_simd_level()) continue;
+    std::vector<std::uint8_t> found(random_keys.size());
+    filter.contains_many(random_keys, found, level);
+    EXPECT_EQ(found, expected);
+  }
+}
+
+TEST(binfuse_filter, contains_many_simd) { // NOLINT
+  auto keys = load_sample();
+  check_simd_levels(binfuse::filter8(keys));
+  check_simd_levels(binfuse::filter16(keys));
+  check_simd_levels(binfuse::filter32(keys));
+
+  // fingerprints end exactly at the end of the mapping
+  const std::filesystem::path filter_path("tmp/filter_simd.bin");
+  {
+    binfuse::filter8_sink(keys).save(filter_path);
+    binfuse::filter8_source filter_source;
+    filter_source.load(filter_path);
+    check_simd_levels(filter_source);
+  }
+  std::filesystem::remove(filter_path);
+}
+
+TEST(binfuse_filter, partitioned) { // NOLINT
+  auto keys = load_sample();
+  // force partitioning, on a small scale
+  const binfuse::populate_options opts{.max_part_keys = keys.size() / 5, .threads = 3};
+
+  std::vector<std::uint64_t> sorted_keys = keys;
+  std::sort(sorted_keys.begin(), sorted_keys.end());
+  for (const auto& input: {keys, sorted_keys}) {
+    const binfuse::filter8 filter(input, opts);
+    EXPECT_TRUE(filter.is_partitioned());
+    EXPECT_GE(filter.parts(), 8);
+    EXPECT_EQ(filter.size(), keys.size());
+    EXPECT_TRUE(filter.verify(keys));
+    EXPECT_LE(estimate_false_positive_rate(filter), 0.005);
+
+    std::vector<std::uint8_t> found(keys.size());
+    filter.contains_many(keys, found);
+    EXPECT_EQ(std::count(found.begin(), found.end(), 1), keys.size());
+  }
+
+  // a memory budget which only allows one part at a time
+  const binfuse::filter16 filter16(keys, {.max_part_keys = keys.size() / 5, .memory_budget = 1});
+  EXPECT_TRUE(filter16.verify(keys));
+  EXPECT_LE(estimate_false_positive_rate(filter16), 0.00005);
+
+  // keys which can not be split by their high bits
+  const std::vector<std::uint64_t> skewed{0, 1, 2, 3, 4, 5, 6, 7};
+  EXPECT_THROW(binfuse::filter8(skewed, {.max_part_keys = 4}), std::runtime_error);
+}
+
+TEST(binfuse_filter, partitioned_persistent) { // NOLINT
+  auto                        keys = load_sample();
+  const std::filesystem::path filter_path("tmp/filter_parts.bin");
+  {
+    binfuse::filter16_sink sink(keys, {.max_part_keys = keys.size() / 3});
+    ASSERT_TRUE(sink.is_partitioned());
+    sink.save(filter_path);
+
+    for (const bool anonymous_copy: {false, true}) {
+      binfuse::filter16_source source;
+      source.load(filter_path, {.anonymous_copy = anonymous_copy});
+      EXPECT_TRUE(source.is_partitioned());
+      EXPECT_EQ(source.parts(), sink.parts());
+      EXPECT_EQ(source.size(), keys.size());
+      EXPECT_TRUE(source.verify(keys));
+      EXPECT_LE(estimate_false_positive_rate(source), 0.00005);
+    }
+
+    // must not be confused with a single filter
+    binfuse::filter8_source wrong_type;
+    EXPECT_THROW(wrong_type.load(filter_path), std::runtime_error);
+  }
+  std::filesystem::remove(filter_path);
+}
+
+template <typename FilterType>
+std::vector<char> concat_segments(const FilterType& filter) {
+  std::vector<char> bytes;
+  const auto        segs = filter.serialize_segments();
+  for (auto segment: segs.segments()) {
+    bytes.insert(bytes.end(), segment.begin(), segment.end());
+  }
+  return bytes;
+}
+
+TEST(binfuse_filter, serialize_segments) { // NOLINT
+  static_assert(!std::is_copy_constructible_v<binfuse::serialized_segments>);
+  static_assert(std::is_nothrow_move_constructible_v<binfuse::serialized_segments>);
+  auto keys = load_sample();
+  for (std::size_t max_part_keys: {keys.size(), keys.size() / 3}) { // single and partitioned
+    const binfuse::filter16 filter(keys, {.max_part_keys = max_part_keys});
+    std::vector<char>       expected(filter.serialization_bytes());
+    filter.serialize(expected.data());
+    EXPECT_EQ(concat_segments(filter), expected);
+    EXPECT_EQ(filter.serialize_segments().size(), expected.size());
+  }
+
+  const binfuse::filter8 filter(keys);
+  auto                   received = concat_segments(filter);
+  binfuse::filter8       copy;
+  copy.deserialize(std::span<const char>(received)); // in place, from the "received" buffer
+  EXPECT_TRUE(copy.verify(keys));
+
+  binfuse::filter8 truncated;
+  EXPECT_THROW(truncated.deserialize(std::span<const char>(received).first(received.size() - 1)),
+               std::runtime_error);
+  EXPECT_THROW(truncated.deserialize(std::span<const char>(received).first(10)),
+               std::runtime_error);
+}
+
+TEST(binfuse_filter, serialize_segments_write_to) { // NOLINT
+  auto                        keys = load_sample();
+  const binfuse::filter8      filter(keys);
+  const std::filesystem::path path("tmp/filter_segments.bin");
+  {
+    std::ofstream out(path, std::ios::binary);
+    filter.serialize_segments().write_to(out);
+  }
+  const auto from_stream = std::filesystem::file_size(path);
+#if defined(__unix__) || defined(__APPLE__)
+  {
+    const int fd = ::open(path.c_str(), O_WRONLY | O_TRUNC); // NOLINT vararg
+    ASSERT_GE(fd, 0);
+    filter.serialize_segments().write_to(fd);
+    ::close(fd);
+  }
+#endif
+  EXPECT_EQ(std::filesystem::file_size(path), filter.serialization_bytes());
+  EXPECT_EQ(from_stream, filter.serialization_bytes());
+
+  std::vector<char> buffer(filter.serialization_bytes());
+  std::ifstream(path, std::ios::binary)
+      .read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  binfuse::filter8 received;
+  received.deserialize(std::span<const char>(buffer));
+  EXPECT_TRUE(received.verify(keys));
+  std::filesystem::remove(path);
+}
+
 TEST(binfuse_filter, large8_persistent) { // NOLINT
   auto                        keys = load_sample();
   const std::filesystem::path filter_path("tmp/filter.bin");
@@ -154,3 +494,20 @@ TEST(binfuse_filter, large16_persistent) { // NOLINT
   }
   std::filesystem::remove(filter_path);
 }
+
+TEST(binfuse_filter, large32_persistent) { // NOLINT
+  auto                        keys = load_sample();
+  const std::filesystem::path filter_path("tmp/filter.bin");
+  {
+    auto filter_sink = binfuse::filter32_sink(keys);
+    filter_sink.save(filter_path);
+    auto filter_source = binfuse::filter32_source();
+    filter_source.load(filter_path);
+    EXPECT_TRUE(filter_source.verify(keys));
+    EXPECT_LE(estimate_false_positive_rate(filter_source), 0.000005);
+
+    auto wrong_type = binfuse::filter16_source();
+    EXPECT_THROW(wrong_type.load(filter_path), std::runtime_error); // "binfuse32" tag
+  }
+  std::filesystem::remove(filter_path);
+}
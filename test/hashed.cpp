@@ -0,0 +1,118 @@
+#include "binfuse/hashed.hpp"
+#include "binfuse/adaptive.hpp"
+#include "binfuse/filter.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include "helpers.hpp"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <filesystem>
+#include <numeric>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+// "key-0", "key-1", ..., of varying lengths
+std::vector<std::string> make_strings(std::size_t count, std::string_view prefix = "key-") {
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  for (std::size_t i = 0; i != count; ++i) {
+    keys.push_back(std::string(prefix) + std::to_string(i) + std::string(i % 37, 'x'));
+  }
+  return keys;
+}
+
+} // namespace
+
+TEST(binfuse_hashed, hash_many_matches_single) { // NOLINT
+  const binfuse::fast_hash hasher;
+  auto                     strings = make_strings(1000);
+  strings.emplace_back(""); // empty
+  std::vector<std::uint64_t> ints(1003);
+  std::iota(ints.begin(), ints.end(), 0);
+
+  std::vector<std::uint64_t> out(strings.size());
+  hasher.hash_many(std::span<const std::string>(strings), out);
+  for (std::size_t i = 0; i != strings.size(); ++i) EXPECT_EQ(out[i], hasher(strings[i]));
+
+  for (auto level: {binfuse::simd_level::scalar, binfuse::simd_level::avx2,
+                    binfuse::simd_level::avx512}) {
+    if (level > binfuse::detect_simd_level()) continue;
+    out.assign(ints.size(), 0);
+    hasher.hash_many(std::span<const std::uint64_t>(ints), out, level);
+    for (std::size_t i = 0; i != ints.size(); ++i) EXPECT_EQ(out[i], hasher(ints[i]));
+  }
+  EXPECT_EQ(hasher(std::string_view("abc")), hasher(std::string("abc")));
+  EXPECT_NE(hasher(std::string_view("a")), hasher(std::string_view("a\0", 2)));
+}
+
+TEST(binfuse_hashed, hash_spreads_top_bits) { // NOLINT
+  const binfuse::fast_hash   hasher;
+  std::set<std::uint64_t>    prefixes;
+  for (std::uint64_t id = 0; id != 10'000; ++id) prefixes.insert(hasher(id) >> 56U);
+  EXPECT_EQ(prefixes.size(), 256); // sequential ids over all prefixes
+
+  std::set<std::uint64_t> hashes;
+  for (const auto& key: make_strings(100'000)) hashes.insert(hasher(key));
+  EXPECT_EQ(hashes.size(), 100'000);
+}
+
+TEST(binfuse_hashed, filter) { // NOLINT
+  auto keys = make_strings(100'000);
+  keys.push_back(keys.front()); // duplicates are fine
+
+  binfuse::hashed_filter<binfuse::filter8> fil;
+  fil.populate(keys);
+  EXPECT_TRUE(fil.filter().is_populated());
+  for (const auto& key: keys) EXPECT_TRUE(fil.contains(key));
+  EXPECT_TRUE(fil.contains(std::string_view("key-0")));
+
+  const auto                misses = make_strings(100'000, "miss-");
+  std::vector<std::uint8_t> found(misses.size());
+  fil.contains_many(misses, found);
+  std::size_t false_positives = 0;
+  for (std::size_t i = 0; i != misses.size(); ++i) {
+    EXPECT_EQ(found[i] != 0, fil.contains(misses[i]));
+    false_positives += found[i];
+  }
+  EXPECT_LT(false_positives, 1000); // ~1/256
+
+  found.resize(keys.size());
+  fil.contains_many(keys, found);
+  EXPECT_EQ(std::count(found.begin(), found.end(), 1), keys.size());
+}
+
+TEST(binfuse_hashed, sharded) { // NOLINT
+  std::vector<std::uint64_t> ids(200'000); // sequential: all in prefix 0, unhashed
+  std::iota(ids.begin(), ids.end(), 1);
+  const std::filesystem::path filename("tmp/hashed_sharded.bin");
+  {
+    binfuse::hashed_filter sink(binfuse::sharded_filter8_sink(filename, 4));
+    sink.populate(ids);
+    EXPECT_EQ(sink.filter().shards(), 16);
+  }
+  {
+    const binfuse::hashed_filter source(binfuse::sharded_filter8_source(filename, 4));
+    std::vector<std::uint8_t>    found(ids.size());
+    source.contains_many(ids, found);
+    EXPECT_EQ(std::count(found.begin(), found.end(), 1), ids.size());
+    EXPECT_TRUE(source.contains(std::uint64_t{42}));
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST(binfuse_hashed, adaptive) { // NOLINT
+  const auto                  keys = make_strings(50'000);
+  const std::filesystem::path filename("tmp/hashed_adaptive.bin");
+  {
+    binfuse::hashed_filter sink{binfuse::adaptive_sharded_filter16_sink(filename)};
+    sink.populate(keys);
+  }
+  {
+    const binfuse::hashed_filter source{binfuse::adaptive_sharded_filter16_source(filename)};
+    for (const auto& key: keys) EXPECT_TRUE(source.contains(key));
+  }
+  std::filesystem::remove(filename);
+}
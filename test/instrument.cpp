@@ -0,0 +1,83 @@
+#include "binfuse/instrument.hpp"
+#include "binfuse/filter.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include "helpers.hpp"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <filesystem>
+#include <numeric>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// the default policy costs no space
+static_assert(std::is_empty_v<binfuse::no_instrumentation>);
+static_assert(sizeof(binfuse::filter8) ==
+              sizeof(binfuse::filter<binary_fuse8_t, binfuse::no_instrumentation>));
+
+using instrumented_filter8 = binfuse::filter<binary_fuse8_t, binfuse::instrumentation>;
+using instrumented_sink8 =
+    binfuse::sharded_filter<binary_fuse8_t, mio::access_mode::write, binfuse::instrumentation>;
+using instrumented_source8 =
+    binfuse::sharded_filter<binary_fuse8_t, mio::access_mode::read, binfuse::instrumentation>;
+
+TEST(binfuse_instrument, filter) { // NOLINT
+  const auto           keys = load_sample();
+  instrumented_filter8 filter;
+  filter.set_instrument(binfuse::instrumentation(1)); // sample every query
+  filter.populate(keys);
+  EXPECT_TRUE(filter.verify(keys));
+
+  const auto snap = filter.instrument().snapshot();
+  EXPECT_EQ(snap.queries, keys.size());
+  EXPECT_EQ(snap.shard_queries.size(), 1);
+  EXPECT_EQ(snap.latency_samples(), keys.size());
+  EXPECT_GT(snap.latency_percentile(0.99), 0);
+  EXPECT_LE(snap.latency_percentile(0.5), snap.latency_percentile(0.999));
+  EXPECT_EQ(snap.phase(binfuse::build_phase::allocate).count, 1);
+  EXPECT_EQ(snap.phase(binfuse::build_phase::populate).count, 1);
+  EXPECT_EQ(snap.phase(binfuse::build_phase::serialize).count, 0);
+}
+
+TEST(binfuse_instrument, sharded) { // NOLINT
+  const std::filesystem::path filename("tmp/instrument_sharded.bin");
+  {
+    const auto keys = load_sample();
+    {
+      instrumented_sink8 sink(filename, 4);
+      sink.add_sorted(keys);
+      const auto snap = sink.instrument().snapshot();
+      EXPECT_EQ(snap.phase(binfuse::build_phase::populate).count, 16);
+      EXPECT_EQ(snap.phase(binfuse::build_phase::serialize).count, 16);
+      EXPECT_EQ(snap.fault(binfuse::fault_site::add_shard).calls, 16);
+      EXPECT_GT(snap.phase(binfuse::build_phase::sync).count, 0);
+    }
+    const binfuse::instrumentation shared(8);
+    instrumented_source8           source(filename, 4);
+    EXPECT_EQ(source.instrument().snapshot().fault(binfuse::fault_site::load).calls, 1);
+    source.set_instrument(shared);
+
+    std::vector<std::uint8_t> found(keys.size());
+    source.contains_many(keys, found);
+    EXPECT_EQ(std::accumulate(found.begin(), found.end(), std::size_t{0}), keys.size());
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t) {
+      threads.emplace_back([&source, &keys] {
+        for (auto key: keys) EXPECT_TRUE(source.contains(key));
+      });
+    }
+    for (auto& thread: threads) thread.join();
+
+    const auto snap = shared.snapshot(); // via the shared handle
+    EXPECT_EQ(snap.queries, 5 * keys.size());
+    ASSERT_EQ(snap.shard_queries.size(), 16);
+    std::vector<std::uint64_t> expected(16);
+    for (auto key: keys) expected[key >> 60U] += 5;
+    EXPECT_EQ(snap.shard_queries, expected);
+    EXPECT_EQ(snap.sample_every, 8);
+    EXPECT_GE(snap.latency_samples(), 4 * keys.size() / 8);
+    EXPECT_LE(snap.latency_samples(), 4 * keys.size() / 8 + 4);
+  }
+  std::filesystem::remove(filename);
+}
@@ -0,0 +1,130 @@
+#include "binfuse/manifest.hpp"
+#include "helpers.hpp"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// the sample keys, grouped by their top `shard_bits`
+std::vector<std::vector<std::uint64_t>> shard_keys(const std::vector<std::uint64_t>& keys,
+                                                   std::uint8_t                        shard_bits) {
+  std::vector<std::vector<std::uint64_t>> shards(std::size_t{1} << shard_bits);
+  for (const auto key: keys) shards[key >> (64U - shard_bits)].push_back(key);
+  return shards;
+}
+
+void remove_manifest(const std::filesystem::path& manifest_path) {
+  const auto dir = manifest_path.parent_path();
+  if (std::filesystem::exists(manifest_path)) {
+    for (const auto& entry: binfuse::manifest::read(manifest_path).shards) {
+      std::filesystem::remove(dir / entry.name);
+    }
+  }
+  std::filesystem::remove(manifest_path);
+}
+
+} // namespace
+
+TEST(binfuse_manifest, read_write) { // NOLINT
+  const std::filesystem::path path("tmp/manifest_rw.txt");
+  binfuse::manifest           written{.nbits = 16, .shard_bits = 12, .shards = {}};
+  written.add({.prefix = 0xabc, .bytes = 100, .name = "with space.bin"});
+  written.add({.prefix = 0x001, .bytes = 200, .name = "b.bin"});
+  EXPECT_EQ(written.shards.front().prefix, 1U); // ordered
+  EXPECT_THROW(written.add({.prefix = 1, .bytes = 1, .name = "dup.bin"}), std::runtime_error);
+  EXPECT_THROW(written.add({.prefix = 4096, .bytes = 1, .name = "x.bin"}), std::runtime_error);
+  written.write(path);
+
+  const auto read = binfuse::manifest::read(path);
+  EXPECT_EQ(read.nbits, 16U);
+  EXPECT_EQ(read.shard_bits, 12);
+  EXPECT_EQ(read.shards, written.shards);
+
+  std::ofstream(path) << "mbinfuse08-v001\nshard_bits 8\n01 12\n"; // no name
+  EXPECT_THROW(binfuse::manifest::read(path), std::runtime_error);
+  std::ofstream(path) << "sbinfuse08-v001\n";
+  EXPECT_THROW(binfuse::manifest::read(path), std::runtime_error);
+  std::filesystem::remove(path);
+}
+
+TEST(binfuse_manifest, build_and_load) { // NOLINT
+  const auto                  keys = load_sample();
+  const std::filesystem::path path("tmp/manifest8.txt");
+  remove_manifest(path);
+  const auto shards = shard_keys(keys, 4);
+  {
+    binfuse::manifest_sharded_filter8_sink sink(path, 4);
+    for (std::uint32_t prefix = 0; prefix != 8; ++prefix) {
+      if (!shards[prefix].empty()) sink.add_shard(shards[prefix], prefix);
+    }
+    EXPECT_THROW(sink.add_shard(shards[0], 0), std::runtime_error); // already added
+    EXPECT_THROW(sink.add_shard(shards[9], 8), std::runtime_error); // wrong prefix
+  }
+  {
+    // resumed, eg by another build step
+    binfuse::manifest_sharded_filter8_sink sink(path, 4);
+    for (std::uint32_t prefix = 8; prefix != 16; ++prefix) {
+      if (!shards[prefix].empty()) sink.add_shard(shards[prefix], prefix);
+    }
+    EXPECT_THROW(binfuse::manifest_sharded_filter8_sink(path, 5), std::runtime_error);
+  }
+  {
+    const binfuse::manifest_sharded_filter8_source source(path);
+    EXPECT_EQ(source.shard_bits(), 4);
+    EXPECT_EQ(source.loaded_shards(), source.shards());
+    EXPECT_TRUE(source.verify(keys));
+    EXPECT_LT(estimate_false_positive_rate(source), 0.005);
+  }
+  EXPECT_THROW(binfuse::manifest_sharded_filter16_source{path}, std::runtime_error);
+  remove_manifest(path);
+}
+
+TEST(binfuse_manifest, assemble_and_lazy) { // NOLINT
+  const auto                  keys = load_sample();
+  const std::filesystem::path path("tmp/manifest_assembled.txt");
+  remove_manifest(path);
+  const auto shards = shard_keys(keys, 2);
+  {
+    binfuse::manifest_sharded_filter16_sink sink(path, 2);
+    for (std::uint32_t prefix = 0; prefix != 4; ++prefix) {
+      // built "elsewhere", as a plain persistent filter
+      const auto             name = "elsewhere." + std::to_string(prefix) + ".bin";
+      binfuse::filter16_sink shard(shards[prefix]);
+      shard.save(path.parent_path() / name);
+      sink.add_shard_file(prefix, name);
+    }
+  }
+  {
+    std::atomic<int>                                resolved{0};
+    const binfuse::manifest_sharded_filter16_source source(
+        path, binfuse::load_mode::lazy, {}, [&](const std::string& name) {
+          ++resolved; // eg a download
+          return path.parent_path() / name;
+        });
+    EXPECT_EQ(source.loaded_shards(), 0U);
+    EXPECT_TRUE(source.contains(shards[1].front()));
+    EXPECT_EQ(source.loaded_shards(), 1U);
+    EXPECT_EQ(resolved, 1);
+    source.load_all(4);
+    EXPECT_EQ(source.loaded_shards(), 4U);
+    EXPECT_EQ(resolved, 4);
+    EXPECT_TRUE(source.verify(keys));
+  }
+  {
+    // a truncated shard file is rejected, on first use if lazy
+    const auto name = binfuse::manifest::read(path).shards[2].name;
+    std::filesystem::resize_file(path.parent_path() / name, 100);
+    EXPECT_THROW(binfuse::manifest_sharded_filter16_source{path}, std::runtime_error);
+    const binfuse::manifest_sharded_filter16_source lazy(path, binfuse::load_mode::lazy);
+    EXPECT_TRUE(lazy.contains(shards[0].front()));
+    EXPECT_THROW((void)lazy.contains(shards[2].front()), std::runtime_error);
+  }
+  remove_manifest(path);
+}
@@ -0,0 +1,77 @@
+#include "binfuse/numa.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include "helpers.hpp"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+TEST(binfuse_numa, parse_cpu_list) { // NOLINT
+  using topology = binfuse::numa_topology;
+  EXPECT_EQ(topology::parse_cpu_list("0-3,8,10-11"),
+            (std::vector<unsigned>{0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(topology::parse_cpu_list("5"), std::vector<unsigned>{5});
+  EXPECT_TRUE(topology::parse_cpu_list("").empty()); // eg a memory only node
+}
+
+TEST(binfuse_numa, topology) { // NOLINT
+  const auto detected = binfuse::numa_topology::detect();
+  ASSERT_GE(detected.nodes(), 1U);
+  std::set<unsigned> cpus;
+  for (std::size_t node = 0; node != detected.nodes(); ++node) {
+    for (const auto cpu: detected.cpus(node)) {
+      EXPECT_TRUE(cpus.insert(cpu).second); // each cpu on one node
+      EXPECT_EQ(detected.node_of_cpu(cpu), node);
+    }
+  }
+  EXPECT_LT(detected.current_node(), detected.nodes());
+
+  const binfuse::numa_topology two({{0, 2}, {1, 3}});
+  EXPECT_EQ(two.nodes(), 2U);
+  EXPECT_EQ(two.node_of_cpu(3), 1U);
+  EXPECT_EQ(two.node_of_cpu(99), 0U); // unknown
+  EXPECT_THROW(binfuse::numa_topology(std::vector<std::vector<unsigned>>{}), std::runtime_error);
+
+  const int local = 42;
+  EXPECT_GE(binfuse::numa_topology::node_of_address(&local), -1);
+}
+
+TEST(binfuse_numa, replicated) { // NOLINT
+  auto keys = load_sample();
+  std::sort(keys.begin(), keys.end());
+  const std::filesystem::path filename("tmp/numa_replicated.bin");
+  {
+    binfuse::sharded_filter8_sink sink(filename, 2);
+    sink.add_sorted(keys);
+  }
+  {
+    const binfuse::numa_topology single;
+    const auto                   all_cpus = single.cpus(0);
+    // two "nodes", both with all CPUs, so the pinning always succeeds
+    const binfuse::numa_topology topology(
+        {{all_cpus.begin(), all_cpus.end()}, {all_cpus.begin(), all_cpus.end()}});
+    const binfuse::numa_replicated<binfuse::sharded_filter8_source> replicated(
+        [&] {
+          return std::make_unique<binfuse::sharded_filter8_source>(
+              filename, 2, binfuse::load_mode::eager, binfuse::map_options{.anonymous_copy = true});
+        },
+        topology);
+    ASSERT_EQ(replicated.replicas(), 2U);
+    EXPECT_NE(&replicated.replica(0), &replicated.replica(1)); // separate copies
+    for (std::size_t node = 0; node != replicated.replicas(); ++node) {
+      EXPECT_TRUE(replicated.replica(node).verify(keys));
+    }
+    for (const auto key: keys) EXPECT_TRUE(replicated.contains(key));
+    std::vector<std::uint8_t> found(keys.size());
+    replicated.contains_many(keys, found);
+    EXPECT_EQ(std::count(found.begin(), found.end(), 1), keys.size());
+  }
+  EXPECT_THROW((binfuse::numa_replicated<binfuse::sharded_filter8_source>(
+                   [] { return std::unique_ptr<binfuse::sharded_filter8_source>{}; })),
+               std::runtime_error);
+  std::filesystem::remove(filename);
+}
@@ -0,0 +1,88 @@
+#include "binfuse/reloadable.hpp"
+#include "binfuse/filter.hpp"
+#include "binfuse/sharded_filter.hpp"
+#include "helpers.hpp"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+TEST(binfuse_reloadable, null_source) { // NOLINT
+  EXPECT_THROW(binfuse::reloadable<binfuse::filter8>(nullptr), std::runtime_error);
+
+  binfuse::reloadable<binfuse::filter8> handle(std::make_unique<binfuse::filter8>(
+      std::vector<std::uint64_t>{0x0000000000000000, 0x0000000000000001}));
+  EXPECT_THROW(handle.publish(nullptr), std::runtime_error);
+  EXPECT_TRUE(handle.contains(0x0000000000000001));
+}
+
+TEST(binfuse_reloadable, snapshot_survives_publish) { // NOLINT
+  binfuse::reloadable<binfuse::filter8> handle(std::make_unique<binfuse::filter8>(
+      std::vector<std::uint64_t>{0x0000000000000000, 0x0000000000000001}));
+
+  std::thread publisher;
+  {
+    auto snap = handle.acquire();
+    publisher = std::thread([&] {
+      handle.publish(std::make_unique<binfuse::filter8>(
+          std::vector<std::uint64_t>{0x0000000000000002, 0x0000000000000003}));
+    });
+    // publish must wait for this snapshot, before destroying the old filter
+    while (handle.generation() == 0) std::this_thread::yield();
+    EXPECT_TRUE(snap->contains(0x0000000000000001));
+    EXPECT_TRUE(handle.contains(0x0000000000000003)); // new readers see the new filter
+  }
+  publisher.join();
+  EXPECT_FALSE(handle.contains(0x0000000000000001));
+}
+
+TEST(binfuse_reloadable, reload_under_load) { // NOLINT
+  auto                        keys = load_sample();
+  const std::filesystem::path filter_a("tmp/reloadable_a.bin");
+  const std::filesystem::path filter_b("tmp/reloadable_b.bin");
+  {
+    {
+      binfuse::sharded_filter8_sink sink_a(filter_a, 4);
+      sink_a.add_sorted(keys);
+      binfuse::sharded_filter8_sink sink_b(filter_b, 6); // different geometry, same keys
+      sink_b.add_sorted(keys);
+    }
+
+    binfuse::reloadable<binfuse::sharded_filter8_source> handle(
+        std::make_unique<binfuse::sharded_filter8_source>(filter_a, 4));
+
+    std::atomic<bool>        stop{false};
+    std::vector<std::size_t> misses(3);
+    std::vector<std::thread> readers;
+    for (std::size_t t = 0; t != misses.size(); ++t) {
+      readers.emplace_back([&, t] {
+        while (!stop) {
+          const auto snap = handle.acquire();
+          for (auto key: keys) misses[t] += snap->contains(key) ? 0U : 1U;
+        }
+      });
+    }
+    for (int i = 0; i != 10; ++i) {
+      if (i % 2 == 0) {
+        handle.reload_async(filter_b, std::uint8_t{6}).get();
+      } else {
+        handle.reload(filter_a, std::uint8_t{4});
+      }
+    }
+    stop = true;
+    for (auto& reader: readers) reader.join();
+    for (auto count: misses) EXPECT_EQ(count, 0);
+    EXPECT_EQ(handle.generation(), 10);
+
+    // a failed load leaves the current source in place
+    EXPECT_THROW(handle.reload_async("tmp/does_not_exist.bin", std::uint8_t{4}).get(),
+                 std::runtime_error);
+    EXPECT_TRUE(handle.contains(keys.front()));
+  }
+  std::filesystem::remove(filter_a);
+  std::filesystem::remove(filter_b);
+}
@@ -4,10 +4,17 @@
 #include "helpers.hpp"
 #include "mio/page.hpp"
 #include "gtest/gtest.h"
+#include <algorithm>
 #include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <random>
 #include <span>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
 TEST(binfuse_sfilter, default_construct) { // NOLINT
@@ -106,6 +113,41 @@ TEST(binfuse_sfilter, missing_shard) { // NOLINT
   std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
 }
 
+TEST(binfuse_sfilter, contains_many) { // NOLINT
+  {
+    binfuse::filter8 tiny_high(
+        std::vector<std::uint64_t>{0x8000000000000000, 0x8000000000000001, 0x8000000000000002});
+
+    binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+    sink.add_shard(tiny_high, 1); // prefix = 0 is missing
+
+    binfuse::sharded_filter8_source source("tmp/sharded_filter8_tiny.bin", 1);
+
+    const std::vector<std::uint64_t> needles{
+        0x8000000000000002, 0x0000000000000000, 0x8000000000000000, 0x8000000000000001};
+    std::vector<std::uint8_t> found(needles.size());
+    source.contains_many(needles, found);
+    EXPECT_EQ(found, (std::vector<std::uint8_t>{1, 0, 1, 1}));
+
+    std::vector<std::uint8_t> too_small(needles.size() - 1);
+    EXPECT_THROW(source.contains_many(needles, too_small), std::runtime_error);
+  }
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
+TEST(binfuse_sfilter, add_partitioned_shard) { // NOLINT
+  {
+    const binfuse::filter8 partitioned(
+        std::vector<std::uint64_t>{0x0000000000000000, 0x4000000000000000, 0x8000000000000000},
+        {.max_part_keys = 2});
+    ASSERT_TRUE(partitioned.is_partitioned());
+
+    binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+    EXPECT_THROW(sink.add_shard(partitioned, 0), std::runtime_error);
+  }
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
 TEST(binfuse_sfilter, empty_shard) { // NOLINT
   {
     binfuse::filter8 tiny_high(std::vector<std::uint64_t>{});
@@ -197,6 +239,37 @@ TEST(binfuse_sfilter, read_sink_after_load) { // NOLINT
   std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
 }
 
+TEST(binfuse_sfilter, reopen_sink_and_add) { // NOLINT
+  {
+    binfuse::filter8 tiny_low(
+        std::vector<std::uint64_t>{0x0000000000000000, 0x0000000000000001, 0x0000000000000002});
+    binfuse::filter8 tiny_high(
+        std::vector<std::uint64_t>{0x8000000000000000, 0x8000000000000001, 0x8000000000000002});
+    {
+      binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+      sink.add_shard(tiny_low, 0);
+    }
+    // geometric growth slack is trimmed when the sink is destroyed
+    const auto index_end = 16 + 2 * sizeof(std::uintmax_t);
+    EXPECT_EQ(std::filesystem::file_size("tmp/sharded_filter8_tiny.bin"),
+              index_end + tiny_low.serialization_bytes());
+    {
+      binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+      EXPECT_EQ(sink.shards(), 1);
+      sink.add_shard(tiny_high, 1); // appended after the existing shard
+      EXPECT_THROW(sink.add_shard(tiny_high, 1), std::runtime_error);
+    }
+    EXPECT_EQ(std::filesystem::file_size("tmp/sharded_filter8_tiny.bin"),
+              index_end + tiny_low.serialization_bytes() + tiny_high.serialization_bytes());
+
+    binfuse::sharded_filter8_source source("tmp/sharded_filter8_tiny.bin", 1);
+    EXPECT_EQ(source.shards(), 2);
+    EXPECT_TRUE(source.contains(0x0000000000000001));
+    EXPECT_TRUE(source.contains(0x8000000000000001));
+  }
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
 TEST(binfuse_sfilter, stream_tiny) { // NOLINT
   {
     binfuse::sharded_filter<binary_fuse8_t, mio::access_mode::write> sink(
@@ -227,14 +300,69 @@ TEST(binfuse_sfilter, stream_tiny) { // NOLINT
 }
 
 TEST(binfuse_sfilter, stream_ooo) { // NOLINT
-  binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+  {
+    binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+
+    // alternative "streaming" API for bullding the filter
+    // the entries below must be strictly in order
+    sink.stream_prepare();
+    sink.stream_add(0x0000000000000001);
+    // out of order add
+    EXPECT_THROW(sink.stream_add(0x0000000000000000), std::runtime_error);
+  }
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
+TEST(binfuse_sfilter, stream_abandoned) { // NOLINT
+  const std::filesystem::path filename("tmp/sharded_filter8_abandoned.bin");
+  {
+    // shards still populating, from the sink's arenas, when it is destroyed
+    binfuse::sharded_filter8_sink sink(filename, 2);
+    sink.stream_prepare(4);
+    constexpr std::uint64_t keys = 4'000'000;
+    for (std::uint64_t i = 0; i != keys; ++i) sink.stream_add(i * (~std::uint64_t{0} / keys));
+    EXPECT_THROW(sink.stream_add(0), std::runtime_error);
+  }
+  std::filesystem::remove(filename);
+}
+
+namespace {
 
-  // alternative "streaming" API for bullding the filter
-  // the entries below must be strictly in order
-  sink.stream_prepare();
-  sink.stream_add(0x0000000000000001);
-  // out of order add
-  EXPECT_THROW(sink.stream_add(0x0000000000000000), std::runtime_error);
+// fails every add_shard, eg as if the disk were full
+struct failing_add_shard : binfuse::no_instrumentation {
+  [[nodiscard]] scope faults(binfuse::fault_site site) const {
+    if (site == binfuse::fault_site::add_shard) {
+      throw std::runtime_error("add_shard failed");
+    }
+    return {};
+  }
+};
+
+} // namespace
+
+TEST(binfuse_sfilter, failed_build_with_shards_in_flight) { // NOLINT
+  using failing_sink =
+      binfuse::sharded_filter<binary_fuse8_t, mio::access_mode::write, failing_add_shard>;
+  const std::filesystem::path filename("tmp/sharded_filter8_failing.bin");
+  // small shards, except for a large second one
+  std::vector<std::uint64_t> keys;
+  for (std::uint64_t prefix = 0; prefix != 4; ++prefix) {
+    const std::uint64_t count = prefix == 1 ? 4'000'000 : 1'000;
+    for (std::uint64_t i = 0; i != count; ++i) keys.push_back(prefix << 62U | i << 20U);
+  }
+  {
+    // 2 threads: the first add_shard fails with the second shard still
+    // populating, from keys which go away as add_sorted throws
+    failing_sink sink(filename, 2);
+    EXPECT_THROW(sink.add_sorted(std::vector<std::uint64_t>(keys), 2), std::runtime_error);
+    EXPECT_EQ(sink.shards(), 0U);
+
+    // and from the local keys of ingest_finalize
+    sink.ingest_prepare(2);
+    for (const auto key: keys) sink.ingest_add(key);
+    EXPECT_THROW(sink.ingest_finalize(), std::runtime_error);
+  }
+  std::filesystem::remove(filename);
 }
 
 TEST(binfuse_sfilter, load_tiny) { // NOLINT
@@ -250,17 +378,139 @@ TEST(binfuse_sfilter, load_tiny) { // NOLINT
   EXPECT_TRUE(source.contains(0x8000000000000000));
 }
 
+TEST(binfuse_sfilter, load_lazy) { // NOLINT
+  binfuse::sharded_filter8_source source("data/sharded_filter8_tiny.bin", 1,
+                                         binfuse::load_mode::lazy);
+  EXPECT_EQ(source.shards(), 2);
+  source.will_need(1);
+  EXPECT_THROW(source.will_need(2), std::runtime_error);
+
+  EXPECT_TRUE(source.contains(0x0000000000000002));
+  EXPECT_TRUE(source.contains(0x8000000000000000));
+}
+
+TEST(binfuse_sfilter, load_map_options) { // NOLINT
+  const binfuse::sharded_filter8_source tuned("data/sharded_filter8_tiny.bin", 1,
+                                              binfuse::load_mode::eager,
+                                              {.random_access = true, .huge_pages = true});
+  EXPECT_TRUE(tuned.contains(0x0000000000000002));
+  EXPECT_TRUE(tuned.contains(0x8000000000000000));
+
+  const binfuse::sharded_filter8_source copied("data/sharded_filter8_tiny.bin", 1,
+                                               binfuse::load_mode::lazy,
+                                               {.huge_pages = true, .anonymous_copy = true});
+  EXPECT_EQ(copied.shards(), 2);
+  EXPECT_TRUE(copied.contains(0x0000000000000002));
+  EXPECT_TRUE(copied.contains(0x8000000000000000));
+}
+
+TEST(binfuse_sfilter, truncated_shard) { // NOLINT
+  {
+    binfuse::filter8 tiny_high(
+        std::vector<std::uint64_t>{0x8000000000000000, 0x8000000000000001, 0x8000000000000002});
+    {
+      binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+      sink.add_shard(tiny_high, 1);
+    }
+    std::filesystem::resize_file("tmp/sharded_filter8_tiny.bin",
+                                 std::filesystem::file_size("tmp/sharded_filter8_tiny.bin") - 1);
+
+    binfuse::sharded_filter8_source eager;
+    EXPECT_THROW(eager.set_filename("tmp/sharded_filter8_tiny.bin", 1), std::runtime_error);
+
+    // lazy mode only detects the problem on first query of that shard
+    binfuse::sharded_filter8_source lazy("tmp/sharded_filter8_tiny.bin", 1,
+                                         binfuse::load_mode::lazy);
+    EXPECT_FALSE(lazy.contains(0x0000000000000001));
+    EXPECT_THROW((void)lazy.contains(0x8000000000000001), std::runtime_error);
+
+    // cut within the shard's own header: 16 byte file header, 2 * 8 byte index, shard
+    std::filesystem::resize_file("tmp/sharded_filter8_tiny.bin", 32 + 10);
+    EXPECT_THROW(eager.set_filename("tmp/sharded_filter8_tiny.bin", 1), std::runtime_error);
+    binfuse::sharded_filter8_source lazy_header("tmp/sharded_filter8_tiny.bin", 1,
+                                                binfuse::load_mode::lazy);
+    EXPECT_THROW((void)lazy_header.contains(0x8000000000000001), std::runtime_error);
+
+    // and within the index
+    std::filesystem::resize_file("tmp/sharded_filter8_tiny.bin", 20);
+    EXPECT_THROW(eager.set_filename("tmp/sharded_filter8_tiny.bin", 1), std::runtime_error);
+    EXPECT_THROW(binfuse::sharded_filter8_source("tmp/sharded_filter8_tiny.bin", 1,
+                                                 binfuse::load_mode::lazy),
+                 std::runtime_error);
+  }
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
+TEST(binfuse_sfilter, invalid_shard_bits) { // NOLINT
+  binfuse::sharded_filter8_source source;
+  EXPECT_THROW(source.set_filename("data/sharded_filter8_tiny.bin", 0), std::runtime_error);
+  EXPECT_THROW(source.set_filename("data/sharded_filter8_tiny.bin", 25), std::runtime_error);
+}
+
+TEST(binfuse_sfilter, v2_header) { // NOLINT
+  {
+    binfuse::filter8 tiny(
+        std::vector<std::uint64_t>{0xffff000000000000, 0xffff000000000001, 0xffff000000000002});
+    {
+      binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 16);
+      sink.add_shard(tiny, 0xffff);
+    }
+    std::ifstream file("tmp/sharded_filter8_tiny.bin", std::ios::binary);
+    std::string   tag(15, '\0');
+    file.read(tag.data(), static_cast<std::streamsize>(tag.size()));
+    EXPECT_EQ(tag, "sbinfuse08-v002");
+
+    binfuse::sharded_filter8_source source("tmp/sharded_filter8_tiny.bin", 16);
+    EXPECT_EQ(source.shards(), 1);
+    EXPECT_TRUE(source.contains(0xffff000000000001));
+    EXPECT_FALSE(source.contains(0x0000000000000001)); // empty shard
+
+    binfuse::sharded_filter8_source wrong;
+    EXPECT_THROW(wrong.set_filename("tmp/sharded_filter8_tiny.bin", 17), std::runtime_error);
+    EXPECT_THROW(wrong.set_filename("tmp/sharded_filter8_tiny.bin", 8), std::runtime_error);
+  }
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
 // larger data tests
 
+TEST(binfuse_sfilter, shard_descriptor) { // NOLINT
+  auto                    keys = load_sample();
+  const binfuse::filter16 filter(keys);
+  std::vector<char>       buffer(filter.serialization_bytes());
+  filter.serialize(buffer.data());
+
+  const auto desc = binfuse::shard_descriptor<binary_fuse16_t>::deserialize(buffer.data());
+  EXPECT_TRUE(desc.is_populated());
+  EXPECT_EQ(alignof(decltype(desc)), 32);
+  EXPECT_EQ(sizeof(desc), 32);
+
+  // identical results to the filter, including false positives
+  auto gen = std::mt19937_64(std::random_device{}());
+  for (std::size_t i = 0; i != 100'000; ++i) {
+    const auto needle = gen();
+    EXPECT_EQ(desc.contains(needle), filter.contains(needle));
+  }
+  for (auto key: keys) {
+    EXPECT_TRUE(desc.contains(key));
+  }
+
+  const binfuse::filter16 empty(std::vector<std::uint64_t>{});
+  buffer.resize(empty.serialization_bytes());
+  empty.serialize(buffer.data());
+  EXPECT_FALSE(
+      binfuse::shard_descriptor<binary_fuse16_t>::deserialize(buffer.data()).is_populated());
+}
+
 template <binfuse::filter_type FilterType>
 void test_sharded_filter(std::span<const std::uint64_t> keys, double max_false_positive_rate,
-                         uint8_t sharded_bits = 8) {
+                         uint8_t sharded_bits = 8, unsigned threads = 1) {
   std::filesystem::path filter_filename;
   filter_filename = "tmp/sharded_filter.bin";
   {
     binfuse::sharded_filter<FilterType, mio::access_mode::write> sharded_sink(filter_filename,
                                                                               sharded_bits);
-    sharded_sink.stream_prepare();
+    sharded_sink.stream_prepare(threads);
     for (auto key: keys) {
       sharded_sink.stream_add(key);
     }
@@ -273,6 +523,10 @@ void test_sharded_filter(std::span<const std::uint64_t> keys, double max_false_p
     for (auto needle: keys) {
       EXPECT_TRUE(sharded_source.contains(needle));
     }
+    std::vector<std::uint8_t> found(keys.size());
+    sharded_source.contains_many(keys, found);
+    EXPECT_EQ(std::count(found.begin(), found.end(), 1), keys.size());
+
     EXPECT_LE(estimate_false_positive_rate(sharded_source), max_false_positive_rate);
   } // allow mmap to be destroy before removing file (required on windows)
 
@@ -287,6 +541,10 @@ TEST(binfuse_sfilter, large16) { // NOLINT
   test_sharded_filter<binary_fuse16_t>(load_sample(), 0.00005);
 }
 
+TEST(binfuse_sfilter, large32) { // NOLINT
+  test_sharded_filter<binfuse::binary_fuse32_t>(load_sample(), 0.000005);
+}
+
 TEST(binfuse_sfilter, large8_32) {                              // NOLINT
   test_sharded_filter<binary_fuse8_t>(load_sample(), 0.005, 5); // 5 sharded_bits
 }
@@ -294,3 +552,464 @@ TEST(binfuse_sfilter, large8_32) {                              // NOLINT
 TEST(binfuse_sfilter, large16_32) {                                // NOLINT
   test_sharded_filter<binary_fuse16_t>(load_sample(), 0.00005, 5); // 5 sharded_bits
 }
+
+TEST(binfuse_sfilter, large8_65536) {                            // NOLINT
+  test_sharded_filter<binary_fuse8_t>(load_sample(), 0.005, 16); // 16 sharded_bits, v2 header
+}
+
+TEST(binfuse_sfilter, large8_parallel) {                           // NOLINT
+  test_sharded_filter<binary_fuse8_t>(load_sample(), 0.005, 8, 4); // 4 threads
+}
+
+TEST(binfuse_sfilter, large16_parallel) {                             // NOLINT
+  test_sharded_filter<binary_fuse16_t>(load_sample(), 0.00005, 5, 3); // 3 threads
+}
+
+TEST(binfuse_sfilter, lazy_concurrent_queries) { // NOLINT
+  auto                        keys = load_sample();
+  const std::filesystem::path filter_filename("tmp/sharded_filter.bin");
+  {
+    {
+      binfuse::sharded_filter16_sink sink(filter_filename, 6);
+      sink.add_sorted(keys);
+    }
+    const binfuse::sharded_filter16_source source(filter_filename, 6, binfuse::load_mode::lazy);
+
+    // all threads race to load the same shards on first query
+    std::vector<std::thread> threads;
+    std::vector<std::size_t> found(4);
+    for (std::size_t t = 0; t != found.size(); ++t) {
+      threads.emplace_back([&, t] {
+        for (auto key: keys) found[t] += source.contains(key) ? 1U : 0U;
+      });
+    }
+    for (auto& thread: threads) thread.join();
+    for (auto count: found) EXPECT_EQ(count, keys.size());
+    EXPECT_LE(estimate_false_positive_rate(source), 0.00005);
+  }
+  std::filesystem::remove(filter_filename);
+}
+
+TEST(binfuse_sfilter, per_thread_stats) { // NOLINT
+  auto                        keys = load_sample();
+  const std::filesystem::path filter_filename("tmp/sharded_filter.bin");
+  {
+    {
+      binfuse::sharded_filter8_sink sink(filter_filename, 6);
+      sink.add_sorted(keys);
+    }
+    const binfuse::sharded_filter8_source source(filter_filename, 6, binfuse::load_mode::lazy);
+
+    std::vector<binfuse::query_stats> stats(4, source.make_stats());
+    std::vector<std::thread>          threads;
+    for (std::size_t t = 0; t != stats.size(); ++t) {
+      threads.emplace_back([&, t] {
+        if (t % 2 == 0) {
+          for (auto key: keys) (void)source.contains(key, stats[t]);
+        } else {
+          std::vector<std::uint8_t> found(keys.size());
+          source.contains_many(keys, found, stats[t]);
+        }
+      });
+    }
+    for (auto& thread: threads) thread.join();
+
+    binfuse::query_stats total;
+    for (const auto& stat: stats) total += stat;
+    EXPECT_EQ(total.queries, stats.size() * keys.size());
+    EXPECT_EQ(total.positives, total.queries);
+    ASSERT_EQ(total.shard_hits.size(), 64);
+    EXPECT_EQ(std::accumulate(total.shard_hits.begin(), total.shard_hits.end(), 0UL),
+              total.queries);
+    EXPECT_GE(total.shard_skew(), 1.0);
+
+    auto cheap = source.make_stats(false);
+    EXPECT_TRUE(source.contains(keys.front(), cheap));
+    EXPECT_EQ(cheap.queries, 1);
+    EXPECT_TRUE(cheap.shard_hits.empty());
+  }
+  std::filesystem::remove(filter_filename);
+}
+
+TEST(binfuse_sfilter, add_sorted) { // NOLINT
+  auto                        keys = load_sample();
+  const std::filesystem::path filter_filename("tmp/sharded_filter.bin");
+  {
+    binfuse::sharded_filter8_sink sink(filter_filename, 6);
+    sink.add_sorted(keys, 4);
+
+    const binfuse::sharded_filter8_source source(filter_filename, 6);
+    EXPECT_EQ(source.shards(), sink.shards());
+    for (auto needle: keys) {
+      EXPECT_TRUE(source.contains(needle));
+    }
+    EXPECT_LE(estimate_false_positive_rate(source), 0.005);
+  }
+  std::filesystem::remove(filter_filename);
+}
+
+TEST(binfuse_sfilter, verify) { // NOLINT
+  const auto                  keys = load_sample();
+  const std::filesystem::path filter_filename("tmp/sharded_filter_verify.bin");
+  {
+    {
+      binfuse::sharded_filter16_sink sink(filter_filename, 4);
+      sink.add_sorted(keys);
+      EXPECT_TRUE(sink.verify(keys));
+    }
+    const binfuse::sharded_filter16_source source(filter_filename, 4);
+
+    const auto res = source.verify(keys, {.threads = 4});
+    EXPECT_TRUE(res.ok());
+    EXPECT_EQ(res.checked, keys.size());
+
+    const auto sampled = source.verify(keys, {.sample = 0.5});
+    EXPECT_TRUE(sampled.ok());
+    EXPECT_LT(sampled.checked, keys.size());
+
+    auto altered = std::vector(keys.begin(), keys.begin() + 1000);
+    for (auto& key: altered) key ^= 0x5555; // same shard, different key
+    const auto bad = source.verify(altered, {.max_reported = 3});
+    EXPECT_GT(bad.false_negatives, 990);
+    EXPECT_EQ(bad.offending.size(), 3);
+  }
+  std::filesystem::remove(filter_filename);
+}
+
+TEST(binfuse_sfilter, build_plan) { // NOLINT
+  constexpr std::size_t gib = 1UL << 30;
+
+  const auto uniform = binfuse::build_plan::for_count(1'000'000'000, 16 * gib, 8);
+  EXPECT_EQ(uniform.threads, 8);
+  EXPECT_LE(uniform.max_shard_keys * binfuse::build_plan::bytes_per_key * uniform.threads,
+            16 * gib);
+  EXPECT_GE(uniform.max_shard_keys, 1'000'000'000 >> uniform.shard_bits);
+
+  // tight budget: one shard at the time
+  const auto tight = binfuse::build_plan::for_count(1'000'000'000, gib, 8);
+  EXPECT_GT(tight.shard_bits, uniform.shard_bits - 3);
+  EXPECT_LE(tight.max_shard_keys * binfuse::build_plan::bytes_per_key * tight.threads, gib);
+
+  // half of all keys below 2^56: needs more shard_bits than uniform
+  std::mt19937_64            gen(42); // NOLINT fixed seed
+  std::vector<std::uint64_t> sample(100'000);
+  for (std::size_t i = 0; i != sample.size(); ++i) sample[i] = i % 2 == 0 ? gen() >> 8 : gen();
+  const auto skewed = binfuse::build_plan::for_sample(sample, 1'000'000'000, gib, 8);
+  EXPECT_GT(skewed.shard_bits, tight.shard_bits);
+  EXPECT_LE(skewed.max_shard_keys * binfuse::build_plan::bytes_per_key * skewed.threads, gib);
+
+  // one hot key: no shard_bits help
+  const std::vector<std::uint64_t> hot(1000, 42);
+  EXPECT_THROW((void)binfuse::build_plan::for_sample(hot, 1'000'000'000, gib, 8),
+               std::runtime_error);
+  EXPECT_THROW((void)binfuse::build_plan::for_count(1000, 0), std::runtime_error);
+}
+
+TEST(binfuse_sfilter, budgeted_build) { // NOLINT
+  const auto keys   = load_sample();
+  const auto budget = keys.size() * binfuse::build_plan::bytes_per_key / 4;
+  auto       plan   = binfuse::build_plan::for_keys(keys, budget, 4);
+  EXPECT_GE(plan.shard_bits, 2);
+  EXPECT_LE(plan.max_shard_keys * binfuse::build_plan::bytes_per_key * plan.threads, budget);
+  plan.threads = 4; // more than fit: the budget alone holds shards back
+
+  const std::filesystem::path filter_filename("tmp/sharded_filter_budget.bin");
+  {
+    {
+      binfuse::sharded_filter8_sink sink(filter_filename, plan.shard_bits);
+      sink.add_sorted(keys, plan);
+    }
+    const binfuse::sharded_filter8_source source(filter_filename, plan.shard_bits);
+    EXPECT_TRUE(source.verify(keys).ok());
+  }
+  std::filesystem::remove(filter_filename);
+  {
+    {
+      binfuse::sharded_filter8_sink sink(filter_filename, plan.shard_bits);
+      sink.stream_prepare(plan);
+      for (auto key: keys) sink.stream_add(key);
+      sink.stream_finalize();
+    }
+    const binfuse::sharded_filter8_source source(filter_filename, plan.shard_bits);
+    EXPECT_TRUE(source.verify(keys).ok());
+  }
+  std::filesystem::remove(filter_filename);
+  {
+    binfuse::sharded_filter8_sink sink(filter_filename, plan.shard_bits + 1);
+    EXPECT_THROW(sink.add_sorted(keys, plan), std::runtime_error); // plan for other shard_bits
+  }
+  std::filesystem::remove(filter_filename);
+}
+
+TEST(binfuse_sfilter, contains_partitioned) { // NOLINT
+  auto                        keys = load_sample();
+  const std::filesystem::path filter_filename("tmp/sharded_filter.bin");
+  for (std::uint8_t shard_bits: {6, 17}) { // 17: several shards per partition
+    {
+      binfuse::sharded_filter8_sink sink(filter_filename, shard_bits);
+      sink.add_sorted(keys);
+    }
+    {
+      const binfuse::sharded_filter8_source source(filter_filename, shard_bits);
+
+      // unsorted needles, half of them random, so including false positives
+      auto                       gen     = std::mt19937_64(std::random_device{}());
+      std::vector<std::uint64_t> needles = keys;
+      for (std::size_t i = 0; i != keys.size(); ++i) needles.push_back(gen());
+      std::shuffle(needles.begin(), needles.end(), gen);
+
+      std::vector<std::uint8_t> expected(needles.size());
+      source.contains_many(needles, expected);
+      for (unsigned threads: {1U, 4U}) {
+        std::vector<std::uint8_t> found(needles.size());
+        source.contains_partitioned(needles, found, threads);
+        EXPECT_EQ(found, expected);
+      }
+      std::vector<std::uint8_t> too_small(needles.size() - 1);
+      EXPECT_THROW(source.contains_partitioned(needles, too_small), std::runtime_error);
+    }
+    std::filesystem::remove(filter_filename);
+  }
+}
+
+TEST(binfuse_sfilter, ingest_unsorted) { // NOLINT
+  auto keys = load_sample();
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(std::random_device{}()));
+  const std::filesystem::path filter_filename("tmp/sharded_filter.bin");
+  for (auto [shard_bits, threads]: {std::pair<std::uint8_t, unsigned>{6, 1}, {10, 3}}) {
+    {
+      binfuse::sharded_filter8_sink sink(filter_filename, shard_bits);
+      sink.ingest_prepare(threads);
+      for (auto key: keys) sink.ingest_add(key);
+      sink.ingest_finalize();
+      EXPECT_FALSE(std::filesystem::exists("tmp/sharded_filter.bin.spill.0"));
+
+      const binfuse::sharded_filter8_source source(filter_filename, shard_bits);
+      for (auto needle: keys) {
+        EXPECT_TRUE(source.contains(needle));
+      }
+      EXPECT_LE(estimate_false_positive_rate(source), 0.005);
+    }
+    std::filesystem::remove(filter_filename);
+  }
+}
+
+TEST(binfuse_sfilter, ingest_abandoned) { // NOLINT
+  {
+    binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+    EXPECT_THROW(sink.ingest_add(0x0000000000000000), std::runtime_error);
+    EXPECT_THROW(sink.ingest_finalize(), std::runtime_error);
+
+    sink.ingest_prepare();
+    sink.ingest_add(0x8000000000000000);
+    EXPECT_TRUE(std::filesystem::exists("tmp/sharded_filter8_tiny.bin.spill.1"));
+  } // spill files removed by sink destructor
+  EXPECT_FALSE(std::filesystem::exists("tmp/sharded_filter8_tiny.bin.spill.1"));
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
+TEST(binfuse_sfilter, replace_shard_and_compact) { // NOLINT
+  auto keys = load_sample();
+  std::sort(keys.begin(), keys.end());
+  const std::filesystem::path filter_filename("tmp/sharded_filter.bin");
+
+  // keys of `prefix`, with every other one dropped and `added` new ones
+  const auto changed_keys = [&](std::uint64_t prefix, std::size_t added) {
+    std::vector<std::uint64_t> result;
+    for (auto key: keys) {
+      if (key >> 60 == prefix && (key & 1U) == 0) result.push_back(key);
+    }
+    for (std::uint64_t i = 0; i != added; ++i) result.push_back(prefix << 60 | i << 1 | 1U);
+    return result;
+  };
+  const auto shard3 = changed_keys(3, 20);
+  const auto shard5 = changed_keys(5, 1);
+  {
+    binfuse::sharded_filter8_sink sink(filter_filename, 4);
+    sink.add_sorted(keys);
+    EXPECT_EQ(sink.free_bytes(), 0);
+
+    sink.replace_shard(binfuse::filter8(shard3), 3); // appended, old shard 3 freed
+    const auto freed = sink.free_bytes();
+    EXPECT_GT(freed, 0);
+    for (auto key: shard3) EXPECT_TRUE(sink.contains(key));
+
+    const binfuse::filter8     new5(shard5);
+    std::vector<std::uint64_t> old5_keys;
+    std::copy_if(keys.begin(), keys.end(), std::back_inserter(old5_keys),
+                 [](auto key) { return key >> 60 == 5; });
+    const auto old5_bytes = binfuse::filter8(old5_keys).serialization_bytes();
+    sink.replace_shard(new5, 5); // appended too, old shard 3's space is not reused
+    EXPECT_EQ(sink.free_bytes(), freed + old5_bytes);
+    for (auto key: shard5) EXPECT_TRUE(sink.contains(key));
+
+    sink.compact();
+    EXPECT_EQ(sink.free_bytes(), 0);
+    EXPECT_EQ(sink.shards(), 16);
+    EXPECT_THROW(sink.replace_shard(binfuse::filter8(shard5), 16), std::runtime_error);
+  }
+  {
+    const binfuse::sharded_filter8_source source(filter_filename, 4);
+    for (auto key: keys) {
+      const auto prefix = key >> 60;
+      if (prefix != 3 && prefix != 5) {
+        EXPECT_TRUE(source.contains(key));
+      }
+    }
+    for (auto key: shard3) EXPECT_TRUE(source.contains(key));
+    for (auto key: shard5) EXPECT_TRUE(source.contains(key));
+    EXPECT_LE(estimate_false_positive_rate(source), 0.005);
+  }
+  std::filesystem::remove(filter_filename);
+}
+
+TEST(binfuse_sfilter, packed) { // NOLINT
+  auto keys = load_sample();
+  std::sort(keys.begin(), keys.end());
+  const std::filesystem::path filter_filename("tmp/sharded_filter.bin");
+  const std::filesystem::path packed_filename("tmp/sharded_filter.binz");
+  {
+    {
+      binfuse::sharded_filter16_sink sink(filter_filename, 14); // sparse, v2 header
+      sink.add_sorted(keys);
+      sink.save_packed(packed_filename);
+    }
+    EXPECT_LT(std::filesystem::file_size(packed_filename) + 100'000,
+              std::filesystem::file_size(filter_filename));
+
+    for (auto mode: {binfuse::load_mode::eager, binfuse::load_mode::lazy}) {
+      const binfuse::sharded_filter16_source source(packed_filename, 14, mode,
+                                                    {.huge_pages = true});
+      EXPECT_EQ(source.shards(), binfuse::sharded_filter16_source(filter_filename, 14).shards());
+      for (auto needle: keys) {
+        EXPECT_TRUE(source.contains(needle));
+      }
+      std::vector<std::uint8_t> found(keys.size());
+      source.contains_many(keys, found);
+      EXPECT_EQ(std::count(found.begin(), found.end(), 1), keys.size());
+      EXPECT_LE(estimate_false_positive_rate(source), 0.00005);
+
+      // a packed source can itself be re-packed, identically
+      source.save_packed("tmp/sharded_filter2.binz");
+      EXPECT_EQ(std::filesystem::file_size("tmp/sharded_filter2.binz"),
+                std::filesystem::file_size(packed_filename));
+      std::filesystem::remove("tmp/sharded_filter2.binz");
+    }
+
+    EXPECT_THROW(binfuse::sharded_filter16_source(packed_filename, 13), std::runtime_error);
+    EXPECT_THROW(binfuse::sharded_filter8_source(packed_filename, 14), std::runtime_error);
+
+    const auto write_shard_bits = [&](std::uint32_t bits) {
+      std::fstream file(packed_filename, std::ios::binary | std::ios::in | std::ios::out);
+      file.seekp(16);
+      file.write(reinterpret_cast<const char*>(&bits), sizeof(bits)); // NOLINT reinterpret_cast
+    };
+    write_shard_bits(200); // corrupt: not a valid shift
+    EXPECT_THROW(binfuse::sharded_filter16_source(packed_filename, 14), std::runtime_error);
+    write_shard_bits(14);
+
+    std::filesystem::resize_file(packed_filename, std::filesystem::file_size(packed_filename) - 1);
+    EXPECT_THROW(binfuse::sharded_filter16_source(packed_filename, 14), std::runtime_error);
+  }
+  std::filesystem::remove(filter_filename);
+  std::filesystem::remove(packed_filename);
+}
+
+TEST(binfuse_sfilter, compiled_view) { // NOLINT
+  const std::filesystem::path filename("tmp/sharded_filter8_view.bin");
+  {
+    auto keys = load_sample();
+    // only the lower half of prefixes: the upper shards stay empty
+    keys.erase(std::remove_if(keys.begin(), keys.end(),
+                              [](std::uint64_t key) { return key >> 63U != 0; }),
+               keys.end());
+    {
+      binfuse::sharded_filter8_sink sink(filename, 8);
+      sink.add_sorted(keys);
+    }
+    const binfuse::sharded_filter8_source source(filename, 8, binfuse::load_mode::lazy);
+    const auto                            view = source.compile();
+    static_assert(noexcept(view.contains(0)));
+    EXPECT_EQ(view.shard_bits(), 8);
+
+    std::mt19937_64 gen(42); // NOLINT fixed seed
+    auto            queries = keys;
+    for (std::size_t i = 0; i != 100'000; ++i) queries.push_back(gen());
+
+    std::vector<std::uint8_t> found(queries.size());
+    view.contains_many(queries, found);
+    for (std::size_t i = 0; i != queries.size(); ++i) {
+      EXPECT_EQ(view.contains(queries[i]), source.contains(queries[i]));
+      EXPECT_EQ(found[i], source.contains(queries[i]) ? 1 : 0);
+    }
+    EXPECT_FALSE(view.contains(0xFFFFFFFFFFFFFFFF)); // sentinel shard
+
+    // the sentinel never matches
+    const auto& sentinel = binfuse::shard_descriptor<binary_fuse8_t>::sentinel();
+    for (std::size_t i = 0; i != 1000; ++i) EXPECT_FALSE(sentinel.matches(gen()));
+
+    EXPECT_THROW(binfuse::sharded_view<binary_fuse8_t>({}, 8), std::runtime_error);
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST(binfuse_sfilter, add_sorted_ooo) { // NOLINT
+  {
+    binfuse::sharded_filter8_sink sink("tmp/sharded_filter8_tiny.bin", 1);
+
+    const std::vector<std::uint64_t> keys{0x0000000000000001, 0x0000000000000000};
+    EXPECT_THROW(sink.add_sorted(keys), std::runtime_error);
+
+    // out of order in the second shard: the first is not built either
+    const std::vector<std::uint64_t> later{0x0000000000000001, 0x8000000000000002,
+                                           0x8000000000000001};
+    EXPECT_THROW(sink.add_sorted(later), std::runtime_error);
+    EXPECT_EQ(sink.shards(), 0U);
+  }
+  std::filesystem::remove("tmp/sharded_filter8_tiny.bin");
+}
+
+TEST(binfuse_sfilter, merge) { // NOLINT
+  auto keys = load_sample();
+  std::sort(keys.begin(), keys.end());
+  // 3 "nodes", each with every 3rd prefix
+  const std::vector<std::filesystem::path> parts{"tmp/sharded_merge0.bin", "tmp/sharded_merge1.bin",
+                                                 "tmp/sharded_merge2.bin"};
+  const std::filesystem::path              merged("tmp/sharded_merged.bin");
+  for (std::size_t node = 0; node != parts.size(); ++node) {
+    binfuse::sharded_filter8_sink sink(parts[node], 6);
+    std::vector<std::uint64_t>    own;
+    std::copy_if(keys.begin(), keys.end(), std::back_inserter(own),
+                 [&](auto key) { return (key >> 58U) % parts.size() == node; });
+    sink.add_sorted(own);
+  }
+  binfuse::sharded_filter8_source::merge(parts, merged, 6);
+  {
+    const binfuse::sharded_filter8_source source(merged, 6);
+    std::size_t                           shards = 0;
+    for (const auto& part: parts) shards += binfuse::sharded_filter8_source(part, 6).shards();
+    EXPECT_EQ(source.shards(), shards);
+    EXPECT_TRUE(source.verify(keys));
+    EXPECT_LE(estimate_false_positive_rate(source), 0.005);
+
+    // shards are contiguous: the merge of a merge is the same size
+    binfuse::sharded_filter8_source::merge(std::vector{merged}, "tmp/sharded_merged2.bin", 6);
+    EXPECT_EQ(std::filesystem::file_size("tmp/sharded_merged2.bin"),
+              std::filesystem::file_size(merged));
+    std::filesystem::remove("tmp/sharded_merged2.bin");
+  }
+  // the same prefixes twice
+  EXPECT_THROW(binfuse::sharded_filter8_source::merge(std::vector{parts[0], parts[0]}, merged, 6),
+               std::runtime_error);
+  EXPECT_THROW(binfuse::sharded_filter8_source::merge(parts, merged, 7), std::runtime_error);
+  EXPECT_THROW(binfuse::sharded_filter16_source::merge(parts, merged, 6), std::runtime_error);
+  EXPECT_THROW(binfuse::sharded_filter8_source::merge({}, merged, 6), std::runtime_error);
+  // a truncated input, whose last shard is only checked by the merge
+  std::filesystem::resize_file(parts[2], std::filesystem::file_size(parts[2]) - 1);
+  EXPECT_THROW(binfuse::sharded_filter8_source::merge(parts, merged, 6), std::runtime_error);
+  EXPECT_TRUE(binfuse::sharded_filter8_source(merged, 6).verify(keys)); // untouched by failures
+  EXPECT_FALSE(std::filesystem::exists("tmp/sharded_merged.bin.merge"));
+
+  for (const auto& part: parts) std::filesystem::remove(part);
+  std::filesystem::remove(merged);
+}